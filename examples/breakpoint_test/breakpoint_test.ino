@@ -45,8 +45,8 @@ void setup() {
 
 //  *(int*)0 = 0;
 
-//  breakpoint_enable(0);
-//  breakpoint(0);
+//  breakpoint_enable("setup");
+//  breakpoint("setup");
 }
 
 //extern int debugcount;
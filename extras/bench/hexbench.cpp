@@ -0,0 +1,137 @@
+/**
+ * @file hexbench.cpp
+ * @author Fernando Trias
+ * @brief Host microbenchmark for the hex codec and checksum in gdbhex.h
+ * @version 0.1
+ * @date 2020-06-09
+ * 
+ * @copyright Copyright (c) 2020 Fernando Trias
+ * 
+ */
+
+/*
+ * Compares the table/word based routines in src/gdbhex.h against the
+ * original byte-at-a-time code and reports MB/s of input processed.
+ * Results are checked against each other before timing.
+ * 
+ * Build and run on the host:
+ * 
+ *   g++ -O2 -I../../src hexbench.cpp -o hexbench && ./hexbench
+ * 
+ * For Cortex-M numbers (including the UADD8 checksum), cross-compile the
+ * same file for the target with -mcpu=cortex-m7 or -mcpu=cortex-m4.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "gdbhex.h"
+
+// The original implementations from gdbstub.cpp
+namespace orig {
+
+char int2hex[] = { '0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f' };
+
+int calcChecksum(const char *c) {
+  uint8_t sum = 0;
+  while(*c) {
+    sum += *c++;
+  }
+  return sum;
+}
+
+int hex(unsigned char ch) {
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'A' && ch <= 'F')
+    return ch - 'A' + 10;
+  return -1;
+}
+
+char *mem2hex(char *buff, const void *addr, int sz) {
+  for (int i = 0; i < sz; i++) {
+    uint8_t b = ((uint8_t*)addr)[i];
+    *buff++ = int2hex[b >> 4];
+    *buff++ = int2hex[b & 0x0F];
+  }
+  *buff = 0;
+  return buff;
+}
+
+char *hex2str(char *buff, const char *hexstr) {
+  while (*hexstr) {
+    int c_high = hex(*hexstr++);
+    int c_low = hex(*hexstr++);
+    *buff++ = (c_high << 4) + c_low;
+  }
+  *buff = 0;
+  return buff;
+}
+
+}
+
+static const int SIZE = 512;        // bytes per call, a typical 'm' reply
+static const int ROUNDS = 200000;
+
+static double now() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// keep the optimizer from dropping results
+volatile int sink;
+
+#define BENCH(name, bytes, body) do { \
+    double t = now(); \
+    for (int r = 0; r < ROUNDS; r++) { body; } \
+    t = now() - t; \
+    printf("  %-10s %8.1f MB/s\n", name, (double)(bytes) * ROUNDS / t / 1e6); \
+  } while (0)
+
+int main() {
+  static uint8_t mem[SIZE + 4];
+  static char hexa[2*SIZE + 8];
+  static char hexb[2*SIZE + 8];
+  static char out[SIZE + 8];
+
+  srand(1);
+  for (int i = 0; i < SIZE + 4; i++) mem[i] = rand();
+
+  // check the new code against the old, including unaligned starts
+  for (int off = 0; off < 4; off++) {
+    for (int sz = 0; sz <= 64; sz++) {
+      orig::mem2hex(hexa, mem + off, sz);
+      mem2hex(hexb, mem + off, sz);
+      if (strcmp(hexa, hexb)) { printf("mem2hex mismatch off=%d sz=%d\n", off, sz); return 1; }
+      if (orig::calcChecksum(hexa + off) != calcChecksum(hexa + off, strlen(hexa + off))) {
+        printf("checksum mismatch off=%d sz=%d\n", off, sz); return 1;
+      }
+      hex2str(out, hexa);
+      if (memcmp(out, mem + off, sz)) { printf("hex2str mismatch off=%d sz=%d\n", off, sz); return 1; }
+    }
+  }
+  const char *p = "1234abCD,";
+  int v;
+  if (hexToInt(&p, &v) != 8 || v != 0x1234abcd || *p != ',') { printf("hexToInt mismatch\n"); return 1; }
+  p = "78563412";
+  if ((uint32_t)hex32ToInt(&p) != 0x12345678) { printf("hex32ToInt mismatch\n"); return 1; }
+
+  mem2hex(hexa, mem, SIZE);
+
+  printf("encode (mem2hex), %d bytes\n", SIZE);
+  BENCH("original", SIZE, orig::mem2hex(hexb, mem, SIZE); sink = hexb[r & 63]);
+  BENCH("new", SIZE, mem2hex(hexb, mem, SIZE); sink = hexb[r & 63]);
+
+  printf("decode (hex2str), %d chars\n", 2*SIZE);
+  BENCH("original", 2*SIZE, orig::hex2str(out, hexa); sink = out[r & 63]);
+  BENCH("new", 2*SIZE, hex2str(out, hexa); sink = out[r & 63]);
+
+  printf("checksum, %d chars\n", 2*SIZE);
+  BENCH("original", 2*SIZE, hexa[r & 1023] ^= 1; sink = orig::calcChecksum(hexa));
+  BENCH("new", 2*SIZE, hexa[r & 1023] ^= 1; sink = calcChecksum(hexa, 2*SIZE));
+
+  return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * Cycle cost of planting and removing a RAM breakpoint
+ *
+ * Setting or clearing a breakpoint stores one halfword into code with
+ * interrupts off and then cleans the D-cache line, invalidates the
+ * I-cache line and issues DSB/ISB so the change is seen by instruction
+ * fetch. This sketch times debug.setBreakpoint() and
+ * debug.clearBreakpoint() with the DWT cycle counter and compares them
+ * with a plain store to the same place. GDB's 'monitor patch' reports
+ * the same figures for the patches made during a session.
+ */
+
+#include "TeensyDebug.h"
+
+#define ROUNDS 1000
+
+// code that never runs; breakpoints go here
+FASTRUN __attribute__((noinline, naked))
+void bench_target() {
+  asm volatile(
+    ".rept 64 \n"
+    "nop \n"
+    ".endr \n"
+    "bx lr \n"
+  );
+}
+
+struct timing {
+  uint32_t best;
+  uint32_t total;
+};
+
+void add(timing *t, uint32_t cycles) {
+  t->total += cycles;
+  if (cycles < t->best) t->best = cycles;
+}
+
+void report(const char *name, timing *t) {
+  Serial.print(name);
+  Serial.print(" min=");
+  Serial.print(t->best);
+  Serial.print(" mean=");
+  Serial.println((float)t->total / ROUNDS, 1);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (! Serial && millis() < 4000) { }
+
+  debug.begin();
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+  timing set = { 0xffffffff, 0 };
+  timing clear = { 0xffffffff, 0 };
+  timing plain = { 0xffffffff, 0 };
+  volatile uint16_t *p = (uint16_t*)((uint32_t)bench_target & ~1) + 8;
+  uint16_t original = *p;
+
+  for (int i = 0; i < ROUNDS; i++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    debug.setBreakpoint((void*)p);
+    uint32_t t1 = ARM_DWT_CYCCNT;
+    debug.clearBreakpoint((void*)p);
+    uint32_t t2 = ARM_DWT_CYCCNT;
+    *p = 0xdf10;
+    uint32_t t3 = ARM_DWT_CYCCNT;
+    *p = original;
+    add(&set, t1 - t0);
+    add(&clear, t2 - t1);
+    add(&plain, t3 - t2);
+  }
+
+  Serial.println("Breakpoint patch cycles");
+  report("set  ", &set);
+  report("clear", &clear);
+  report("store", &plain);
+}
+
+void loop() {
+}
@@ -0,0 +1,88 @@
+/**
+ * Cycle cost of an SVC that is not the debugger's while breakpoints are set
+ *
+ * The debugger sees every SVC first and must decide whether the address
+ * holds one of its breakpoints before passing it on. This sketch installs
+ * its own SVC handler, plants 0, 32 and 256 breakpoints in code that never
+ * runs, and times "svc #0x22" with the DWT cycle counter.
+ *
+ * 256 breakpoints need a larger table than the default profile; build
+ * with -DGDB_SW_BREAKPOINTS=256 (e.g. through build.flags.optimize, as
+ * extras/size-report.sh does). Larger counts are skipped if they don't fit.
+ */
+
+#include "TeensyDebug.h"
+
+#define ROUNDS 10000
+
+volatile uint32_t svc_count = 0;
+
+// SVC handler for "our" SVCs; the debugger chains to it
+void bench_svc_isr() {
+  svc_count++;
+}
+
+// code that never runs; breakpoints go here
+FASTRUN __attribute__((noinline, naked))
+void bench_target() {
+  asm volatile(
+    ".rept 600 \n"
+    "nop \n"
+    ".endr \n"
+    "bx lr \n"
+  );
+}
+
+uint32_t svc_cycles() {
+  uint32_t best = 0xffffffff;
+  uint32_t total = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    asm volatile("svc #0x22");
+    uint32_t t = ARM_DWT_CYCCNT - t0;
+    total += t;
+    if (t < best) best = t;
+  }
+  Serial.print(" min=");
+  Serial.print(best);
+  Serial.print(" mean=");
+  Serial.println((float)total / ROUNDS, 1);
+  return best;
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (! Serial && millis() < 4000) { }
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+  // installed first so debug.begin() chains to it
+  _VectorsRam[11] = bench_svc_isr;
+  debug.begin();
+
+  Serial.println("SVC dispatch cycles");
+  int set = 0;
+  const int counts[] = { 0, 32, 256 };
+  for (int c : counts) {
+    while (set < c) {
+      if (debug.setBreakpoint((uint8_t*)bench_target + set * 4) != 0) break;
+      set++;
+    }
+    if (set < c) {
+      Serial.print(c);
+      Serial.println(" breakpoints: table full; build with a larger GDB_SW_BREAKPOINTS");
+      break;
+    }
+    Serial.print(c);
+    Serial.print(" breakpoints:");
+    svc_cycles();
+  }
+  while (set > 0) {
+    set--;
+    debug.clearBreakpoint((uint8_t*)bench_target + set * 4);
+  }
+}
+
+void loop() {
+}
@@ -0,0 +1,182 @@
+/**
+ * Cycle cost of getting into and out of the debugger at a breakpoint
+ *
+ * A breakpoint with an ignore count is hit over and over without
+ * stopping. Entry is the time from just before the call to the stub
+ * taking its first timestamp; exit is from its last timestamp back to
+ * the sketch, including the displaced instruction. Two paths are timed:
+ * the hit handled in the SVC handler, and the one through IRQ_DEBUG that
+ * hits which stop still take. Both use the current trap code, so neither
+ * is the trap path as it was before the SVC handler took hits.
+ *
+ * Only the register copy is compared against the old code: the copy of
+ * the old trap code (one ldr/str per word) and the current one (LDM/STM)
+ * are timed on their own.
+ */
+
+#include "TeensyDebug.h"
+
+#define ROUNDS 10000
+
+extern uint32_t debug_trap_cycles;
+extern uint32_t debug_resume_cycles;
+extern int debug_fast_hits;
+
+// the breakpoint goes on the first nop
+FASTRUN __attribute__((noinline, naked))
+void bench_site() {
+  asm volatile(
+    "nop \n"
+    "nop \n"
+    "bx lr \n"
+  );
+}
+
+// r0 = exception frame, r1 = save area of 17 words; r4-r11 are copied
+// out and back in, as a trap does
+__attribute__((noinline, naked))
+void copy_none(uint32_t *frame, uint32_t *save) {
+  asm volatile(
+    "push {r4-r11} \n"
+    "pop {r4-r11} \n"
+    "bx lr \n"
+  );
+}
+
+__attribute__((noinline, naked))
+void copy_ldr_str(uint32_t *frame, uint32_t *save) {
+  asm volatile(
+    "push {r4-r11} \n"
+    ".irp n, 0, 4, 8, 12, 16, 20, 24, 28 \n"
+    "ldr r2, [r0, #\\n] \n"
+    "str r2, [r1, #\\n] \n"
+    ".endr \n"
+    "str r4, [r1, #32] \n"
+    "str r5, [r1, #36] \n"
+    "str r6, [r1, #40] \n"
+    "str r7, [r1, #44] \n"
+    "str r8, [r1, #48] \n"
+    "str r9, [r1, #52] \n"
+    "str r10, [r1, #56] \n"
+    "str r11, [r1, #60] \n"
+    "str r0, [r1, #64] \n"
+    ".irp n, 0, 4, 8, 12, 16, 20, 24, 28 \n"
+    "ldr r2, [r1, #\\n] \n"
+    "str r2, [r0, #\\n] \n"
+    ".endr \n"
+    "ldr r4, [r1, #32] \n"
+    "ldr r5, [r1, #36] \n"
+    "ldr r6, [r1, #40] \n"
+    "ldr r7, [r1, #44] \n"
+    "ldr r8, [r1, #48] \n"
+    "ldr r9, [r1, #52] \n"
+    "ldr r10, [r1, #56] \n"
+    "ldr r11, [r1, #60] \n"
+    "pop {r4-r11} \n"
+    "bx lr \n"
+  );
+}
+
+__attribute__((noinline, naked))
+void copy_ldm_stm(uint32_t *frame, uint32_t *save) {
+  asm volatile(
+    "push {r4-r11} \n"
+    "add r2, r1, #32 \n"
+    "stm r2, {r4-r11} \n"
+    "ldm r0, {r4-r11} \n"
+    "stm r1, {r4-r11} \n"
+    "str r0, [r1, #64] \n"
+    "ldm r2, {r4-r11} \n"
+    "mov r2, r1 \n"
+    "ldm r2!, {r4-r11} \n"
+    "stm r0, {r4-r11} \n"
+    "ldm r2, {r4-r11} \n"
+    "pop {r4-r11} \n"
+    "bx lr \n"
+  );
+}
+
+struct timing {
+  uint32_t best;
+  uint32_t total;
+};
+
+void add(timing *t, uint32_t cycles) {
+  t->total += cycles;
+  if (cycles < t->best) t->best = cycles;
+}
+
+void report(const char *name, timing *t) {
+  Serial.print(name);
+  Serial.print(" min=");
+  Serial.print(t->best);
+  Serial.print(" mean=");
+  Serial.println((float)t->total / ROUNDS, 1);
+}
+
+void trap_cycles(const char *name) {
+  timing entry = { 0xffffffff, 0 };
+  timing exit = { 0xffffffff, 0 };
+  timing total = { 0xffffffff, 0 };
+  for (int i = 0; i < ROUNDS; i++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    bench_site();
+    uint32_t t1 = ARM_DWT_CYCCNT;
+    add(&entry, debug_trap_cycles - t0);
+    add(&exit, t1 - debug_resume_cycles);
+    add(&total, t1 - t0);
+  }
+  Serial.println(name);
+  report("  entry", &entry);
+  report("  exit ", &exit);
+  report("  total", &total);
+}
+
+uint32_t copy_cycles(void (*copy)(uint32_t*, uint32_t*)) {
+  static uint32_t frame[8];
+  static uint32_t save[17];
+  uint32_t best = 0xffffffff;
+  for (int i = 0; i < ROUNDS; i++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    copy(frame, save);
+    uint32_t t = ARM_DWT_CYCCNT - t0;
+    if (t < best) best = t;
+  }
+  return best;
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (! Serial && millis() < 4000) { }
+
+  debug.begin();
+
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+  timing none = { 0xffffffff, 0 };
+  for (int i = 0; i < ROUNDS; i++) {
+    uint32_t t0 = ARM_DWT_CYCCNT;
+    bench_site();
+    add(&none, ARM_DWT_CYCCNT - t0);
+  }
+  report("no breakpoint", &none);
+
+  debug.setBreakpoint((void*)bench_site);
+  debug.ignoreBreakpoint((void*)bench_site, 0xffffffff);
+  debug_fast_hits = 1;
+  trap_cycles("SVC handler path (hits that carry on)");
+  debug_fast_hits = 0;
+  trap_cycles("IRQ_DEBUG path (hits that stop): SVC, then IRQ_DEBUG");
+  debug_fast_hits = 1;
+  debug.clearBreakpoint((void*)bench_site);
+
+  uint32_t base = copy_cycles(copy_none);
+  Serial.print("register copy, old ldr/str: ");
+  Serial.println(copy_cycles(copy_ldr_str) - base);
+  Serial.print("register copy, current ldm/stm: ");
+  Serial.println(copy_cycles(copy_ldm_stm) - base);
+}
+
+void loop() {
+}
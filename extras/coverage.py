@@ -0,0 +1,379 @@
+#!/usr/bin/env python3
+# Copyright 2020 by Fernando Trias
+#
+# Line coverage of a running Teensy without a --coverage build.
+#
+# Reads the disassembly and line table of the sketch's .elf with objdump,
+# finds the start of every basic block, and plants a one-shot breakpoint
+# on each through 'monitor cover add'. The stub takes each one out the
+# first time it is reached, so a block costs one exception and then runs
+# at full speed. After the run the hit bits are read back and written as
+# an lcov .info file, which genhtml or an editor plugin can show.
+#
+# Only code in RAM can be covered (on Teensy 4 that is everything not
+# marked FLASHMEM; on Teensy 3.x only FASTRUN functions). The stub's own
+# code is left out, since a point there would trap inside the trap
+# handler. If there are more blocks than the stub has room for
+# (GDB_COVERAGE), use -s to pick the sources that matter.
+#
+# Block starts are function entries, branch targets, the instruction after
+# a branch or a return, and the first instruction after inline data (jump
+# tables, literal pools). Nothing inside an IT block is planted. A line is
+# reached if any block holding its code was.
+#
+# Usage: coverage.py [options] device sketch.elf
+#   device is the Teensy serial port (e.g. /dev/ttyACM0) or the pty
+#   printed by teensydebug-sim. GDB must not be connected.
+#   -o file       lcov output (default coverage.info)
+#   -t seconds    run this long, then collect (default: until Enter)
+#   -s text       only sources whose path contains text; may be repeated
+#   -x text       leave out sources whose path contains text (default
+#                 TeensyDebug); may be repeated
+#   --keep        leave the points that weren't reached in place
+#   --list        print the block starts and exit; no device needed
+#   OBJDUMP in the environment picks objdump and its options (default
+#   arm-none-eabi-objdump, or llvm-objdump if that isn't on the PATH)
+#
+
+import argparse
+import os
+import re
+import select
+import shlex
+import shutil
+import subprocess
+import sys
+import termios
+import time
+import tty
+
+
+#
+# Disassembly
+#
+
+RE_SYMBOL = re.compile(r'^([0-9a-f]+) <(.+)>:$')
+RE_INSN = re.compile(r'^\s*([0-9a-f]+):\s+(\S+)(?:\s+(.*))?$')
+RE_SOURCE = re.compile(r'^(?:; )?(.+):(\d+)(?: \(discriminator \d+\))?$')
+RE_TARGET = re.compile(r'(?:0x)?([0-9a-f]+)\s+<')
+RE_BRANCH = re.compile(r'^(b(eq|ne|cs|hs|cc|lo|mi|pl|vs|vc|hi|ls|ge|lt|gt|le|al)?|cbn?z)(\.[nw])?$')
+RE_IT = re.compile(r'^it[te]{0,3}$')
+
+
+class Insn:
+    def __init__(self, addr, mnemonic, operands, source):
+        self.addr = addr
+        self.mnemonic = mnemonic
+        self.operands = operands
+        self.source = source    # (file, line) or None
+        self.in_it = False
+
+
+def objdump_tool():
+    tool = os.environ.get('OBJDUMP')
+    if tool:
+        return shlex.split(tool)
+    if shutil.which('arm-none-eabi-objdump'):
+        return ['arm-none-eabi-objdump']
+    return ['llvm-objdump']
+
+
+def disassemble(elf):
+    """Return the instructions of an ELF in address order and the
+    function entry points with their names."""
+    text = subprocess.run(objdump_tool() + ['-d', '-l', '-C', '--no-show-raw-insn', elf],
+                          check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+    insns = []
+    functions = {}
+    source = None
+    data = False
+    after_data = set()
+    for line in text.splitlines():
+        line = line.rstrip()
+        m = RE_SYMBOL.match(line)
+        if m:
+            name = m.group(2)
+            if not name.startswith('$'):
+                functions[int(m.group(1), 16)] = name
+            continue
+        m = RE_INSN.match(line)
+        if m:
+            mnemonic = m.group(2)
+            if mnemonic.startswith('.') or mnemonic.startswith('<'):
+                # inline data: a jump table or a literal pool
+                data = True
+                continue
+            addr = int(m.group(1), 16)
+            if data:
+                after_data.add(addr)
+                data = False
+            insns.append(Insn(addr, mnemonic, m.group(3) or '', source))
+            continue
+        m = RE_SOURCE.match(line)
+        if m and not line.startswith('Disassembly'):
+            source = (m.group(1), int(m.group(2)))
+    insns.sort(key=lambda i: i.addr)
+    return insns, functions, after_data
+
+
+def ends_block(insn):
+    """True if the instruction after this one starts a block."""
+    op = insn.mnemonic
+    args = insn.operands.replace(' ', '')
+    if RE_BRANCH.match(op):
+        return True
+    if op.startswith('bx') or op.startswith('tbb') or op.startswith('tbh'):
+        return True
+    if op.startswith('pop') or op.startswith('ldm'):
+        return 'pc' in args
+    if op.startswith('ldr') or op.startswith('mov'):
+        return args.startswith('pc,')
+    return False
+
+
+def blocks(insns, functions, after_data):
+    """Return the sorted start addresses of the basic blocks."""
+    addrs = set(i.addr for i in insns)
+    starts = set(a for a in functions if a in addrs)
+    starts |= after_data & addrs
+    it_left = 0
+    prev = None
+    for insn in insns:
+        if it_left:
+            insn.in_it = True
+            it_left -= 1
+        if RE_IT.match(insn.mnemonic):
+            it_left = len(insn.mnemonic) - 1
+        if prev is not None and ends_block(prev):
+            starts.add(insn.addr)
+        if RE_BRANCH.match(insn.mnemonic):
+            m = RE_TARGET.search(insn.operands)
+            if m:
+                starts.add(int(m.group(1), 16))
+        prev = insn
+    index = dict((i.addr, i) for i in insns)
+    return sorted(a for a in starts if a in index and not index[a].in_it)
+
+
+def wanted(insn, only, skip):
+    if insn.source is None:
+        return False
+    path = insn.source[0]
+    if only and not any(s in path for s in only):
+        return False
+    return not any(s in path for s in skip)
+
+
+#
+# Remote protocol
+#
+
+class Remote:
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        if os.isatty(self.fd):
+            tty.setraw(self.fd)
+            termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.pending = bytearray()
+        self.packet_size = 256
+
+    def send(self, body):
+        checksum = 0
+        for c in body.encode():
+            checksum = (checksum + c) & 0xff
+        os.write(self.fd, ('$%s#%02x' % (body, checksum)).encode())
+
+    def receive(self, timeout=2.0):
+        """Next packet from the stub, or None after the timeout."""
+        end = time.time() + timeout
+        while True:
+            start = self.pending.find(b'$')
+            if start >= 0:
+                hash = self.pending.find(b'#', start)
+                if hash >= 0 and len(self.pending) >= hash + 3:
+                    body = self.pending[start + 1:hash].decode('latin-1')
+                    del self.pending[:hash + 3]
+                    os.write(self.fd, b'+')
+                    return body
+            else:
+                self.pending.clear()
+            left = end - time.time()
+            if left <= 0:
+                return None
+            r, _, _ = select.select([self.fd], [], [], left)
+            if r:
+                self.pending += os.read(self.fd, 4096)
+
+    def command(self, body):
+        self.send(body)
+        reply = self.receive()
+        if reply is None:
+            raise IOError('no reply to %s' % body[:20])
+        return reply
+
+    def monitor(self, text):
+        reply = self.command('qRcmd,' + text.encode().hex())
+        if reply == 'OK' or reply == '':
+            return reply
+        return bytes.fromhex(reply).decode('latin-1')
+
+
+def connect(path):
+    remote = Remote(path)
+    reply = remote.command('qSupported')
+    m = re.search(r'PacketSize=([0-9a-fA-F]+)', reply)
+    if m:
+        remote.packet_size = int(m.group(1), 16)
+    return remote
+
+
+def plant(remote, points):
+    """Send the points in as few packets as fit."""
+    room = (remote.packet_size - 16) // 2
+    batch = 'cover add'
+    for addr in points:
+        word = ' 0x%x' % addr
+        if len(batch) + len(word) > room:
+            check(remote.monitor(batch))
+            batch = 'cover add'
+        batch += word
+    if batch != 'cover add':
+        check(remote.monitor(batch))
+
+
+def check(reply):
+    if reply.startswith('E'):
+        raise IOError('stub: ' + reply.strip())
+
+
+def read_bits(remote, count):
+    words = []
+    while len(words) * 32 < count:
+        text = remote.monitor('cover bits %d' % len(words)).strip()
+        if not text or text.startswith('E'):
+            raise IOError('stub: cover bits: ' + text)
+        words += [int(text[i:i + 8], 16) for i in range(0, len(text), 8)]
+    return [(words[n >> 5] >> (n & 31)) & 1 for n in range(count)]
+
+
+def run(remote, seconds):
+    """Let the program run, carrying on from any stop, until the time is
+    up or Enter is pressed."""
+    remote.send('c')
+    if seconds is None:
+        print('running; press Enter to collect')
+    else:
+        print('running for %g s' % seconds)
+    sys.stdout.flush()
+    end = None if seconds is None else time.time() + seconds
+    stops = 0
+    while True:
+        wait = 0.2 if end is None else min(0.2, end - time.time())
+        if wait <= 0:
+            break
+        reply = remote.receive(wait)
+        if reply and reply[0] in 'ST':
+            stops += 1
+            remote.send('c')
+        if end is None:
+            r, _, _ = select.select([sys.stdin], [], [], 0)
+            if r:
+                sys.stdin.readline()
+                break
+    if stops:
+        print('carried on from %d stops' % stops)
+
+
+#
+# lcov
+#
+
+def write_lcov(path, insns, starts, reached, functions):
+    """A line is reached if a block with code on it was; lines only in
+    blocks without a point are left out."""
+    lines = {}      # file -> line -> reached
+    funcs = {}      # file -> [(line, name, reached)]
+    starts = set(starts)
+    block = None
+    for insn in insns:
+        if insn.addr in starts:
+            block = insn.addr
+        if insn.addr in functions and insn.addr in reached and insn.source:
+            file, line = insn.source
+            funcs.setdefault(file, []).append((line, functions[insn.addr], reached[insn.addr]))
+        if block is None or block not in reached or insn.source is None:
+            continue
+        file, line = insn.source
+        hits = lines.setdefault(file, {})
+        hits[line] = hits.get(line, 0) | reached[block]
+    with open(path, 'w') as out:
+        for file in sorted(lines):
+            out.write('TN:\nSF:%s\n' % file)
+            for line, name, hit in sorted(funcs.get(file, [])):
+                out.write('FN:%d,%s\n' % (line, name))
+            for line, name, hit in sorted(funcs.get(file, [])):
+                out.write('FNDA:%d,%s\n' % (hit, name))
+            if file in funcs:
+                out.write('FNF:%d\nFNH:%d\n' % (len(funcs[file]), sum(f[2] for f in funcs[file])))
+            hits = lines[file]
+            for line in sorted(hits):
+                out.write('DA:%d,%d\n' % (line, hits[line]))
+            out.write('LF:%d\nLH:%d\nend_of_record\n' % (len(hits), sum(hits.values())))
+    return sum(len(h) for h in lines.values()), sum(sum(h.values()) for h in lines.values())
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Breakpoint coverage of a running Teensy')
+    parser.add_argument('device', nargs='?')
+    parser.add_argument('elf')
+    parser.add_argument('-o', default='coverage.info')
+    parser.add_argument('-t', type=float)
+    parser.add_argument('-s', action='append', default=[])
+    parser.add_argument('-x', action='append')
+    parser.add_argument('--keep', action='store_true')
+    parser.add_argument('--list', action='store_true')
+    args = parser.parse_args()
+    skip = args.x if args.x is not None else ['TeensyDebug']
+
+    insns, functions, after_data = disassemble(args.elf)
+    index = dict((i.addr, i) for i in insns)
+    every = blocks(insns, functions, after_data)
+    starts = [a for a in every if wanted(index[a], args.s, skip)]
+
+    if args.list:
+        for a in starts:
+            file, line = index[a].source
+            print('0x%08x %s:%d' % (a, file, line))
+        return 0
+    if args.device is None:
+        parser.error('a device is needed unless --list is given')
+
+    remote = connect(args.device)
+    remote.monitor('cover clear')
+    status = remote.monitor('cover')
+    m = re.search(r'room for (\d+)\s+RAM 0x([0-9a-f]+)-0x([0-9a-f]+)', status)
+    if not m:
+        sys.stderr.write('the stub has no coverage (GDB_COVERAGE=0?): %s\n' % status.strip())
+        return 1
+    room, low, high = int(m.group(1)), int(m.group(2), 16), int(m.group(3), 16)
+    points = [a for a in starts if low <= a <= high]
+    print('%d blocks, %d in RAM' % (len(starts), len(points)))
+    if len(points) > room:
+        print('only the first %d fit; narrow them down with -s' % room)
+        points = points[:room]
+
+    plant(remote, points)
+    run(remote, args.t)
+    bits = read_bits(remote, len(points))
+    if not args.keep:
+        remote.monitor('cover clear')
+
+    reached = dict(zip(points, bits))
+    found, hit = write_lcov(args.o, insns, every, reached, functions)
+    print('%d of %d blocks reached; %d of %d lines; written to %s' %
+          (sum(bits), len(points), hit, found, args.o))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,114 @@
+/**
+ * @file Arduino.h
+ * @author Fernando Trias
+ * @brief Minimal stand-in for the Teensy core used by the host build
+ * @version 0.1
+ * @date 2020-06-09
+ * 
+ * @copyright Copyright (c) 2020 Fernando Trias
+ * 
+ */
+
+/*
+ * Just enough of the Arduino/Teensy API for the sources in src to compile
+ * and run on Linux. Timing uses the host clock, pins do nothing and
+ * interrupts are simulated by sim.cpp.
+ */
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define stricmp strcasecmp
+
+#define HEX 16
+#define DEC 10
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+
+extern volatile uint32_t systick_millis_count;
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void yield();
+
+inline void pinMode(int, int) { }
+inline void digitalWrite(int, int) { }
+inline int digitalRead(int) { return 0; }
+inline void analogWrite(int, int) { }
+inline int analogRead(int) { return 0; }
+
+// interrupts are simulated; nothing to mask or pend
+#define __disable_irq() do { } while (0)
+#define __enable_irq() do { } while (0)
+#define IRQ_SOFTWARE 70
+#define NVIC_SET_PENDING(n) do { } while (0)
+#define NVIC_CLEAR_PENDING(n) do { } while (0)
+#define NVIC_SET_PRIORITY(n, p) do { } while (0)
+#define NVIC_ENABLE_IRQ(n) do { } while (0)
+
+class Print {
+public:
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  virtual int availableForWrite(void) { return 0; }
+  virtual void flush() { }
+
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long n, int base = DEC) { return printNumber(n, base); }
+  size_t print(unsigned long n, int base = DEC) { return printNumber(n, base); }
+  size_t print(int n, int base = DEC) { return printNumber(n, base); }
+  size_t print(unsigned int n, int base = DEC) { return printNumber(n, base); }
+  size_t println() { return print("\r\n"); }
+  template <typename T> size_t println(T v) { return print(v) + println(); }
+  template <typename T> size_t println(T v, int base) { return print(v, base) + println(); }
+
+private:
+  size_t printNumber(long n, int base) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%ld", n);
+    return print(buf);
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() { return -1; }
+};
+
+// Serial goes to stderr so it doesn't mix with the simulator's output
+class HostSerial : public Stream {
+public:
+  void begin(uint32_t) { }
+  size_t write(uint8_t b) { return fputc(b, stderr) == EOF ? 0 : 1; }
+  int available() { return 0; }
+  int read() { return -1; }
+  operator bool() { return true; }
+};
+
+extern HostSerial Serial;
+
+// Runs the callback from sim.cpp's main loop, or from yield() while halted
+class IntervalTimer {
+public:
+  bool begin(void (*funct)(), uint32_t microseconds);
+  void end();
+  void priority(uint8_t) { }
+};
+
+#endif
@@ -0,0 +1,528 @@
+// Copyright 2020 by Fernando Trias
+//
+// Check the Thumb-2 next-PC decoder (src/nextpc.cpp) against llvm-objdump.
+//
+// Each file is disassembled and every instruction is run through
+// thumb_nextpc() with a made-up set of registers and memory. The answer
+// is compared with one worked out from objdump's text: branch targets
+// as objdump prints them, register lists and addressing modes from the
+// operands, IT block conditions from the it mnemonic. Conditional
+// instructions are tried with all 16 combinations of NZCV.
+//
+// The memory each store writes, from thumb_stores(), is checked the
+// same way against the addressing mode objdump prints.
+//
+// At the end it prints how often each entry in thumb_encodings[] was
+// used, so encodings that no input exercised stand out.
+//
+// Usage: nextpc-check [-v] file.o|sketch.elf ...
+//   OBJDUMP=... picks the disassembler (default llvm-objdump).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#define GDB_DEBUG_INTERNAL
+#include "TeensyDebug.h"
+
+struct insn {
+  uint32_t addr;
+  int size;
+  uint16_t h1, h2;
+  std::string mnem;   // without .w/.n
+  std::string ops;    // without the @ comment
+  std::string text;
+};
+
+static std::map<uint32_t, uint8_t> code;
+static uint32_t regs[16];
+static int verbose = 0;
+static long checked = 0;
+static long mismatches = 0;
+static long stores = 0;
+static long hits[64];
+
+// memory outside the disassembled code reads as a hash of the address
+static uint32_t made_up(uint32_t addr) {
+  return (addr * 2654435761u) ^ 0x9E3779B9;
+}
+
+static uint32_t mem_read(uint32_t addr, int size) {
+  uint32_t v = 0;
+  for (int i=size-1; i>=0; i--) {
+    auto it = code.find(addr + i);
+    uint8_t b = it != code.end() ? it->second : (uint8_t)(made_up(addr & ~3) >> (8 * ((addr + i) & 3)));
+    v = (v << 8) | b;
+  }
+  return v;
+}
+
+static const char *cond_names[] = {
+  "eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+  "hi", "ls", "ge", "lt", "gt", "le", "al"
+};
+
+static int cond_code(const std::string &s) {
+  if (s == "cs") return 2;
+  if (s == "cc") return 3;
+  for (int i=0; i<15; i++) {
+    if (s == cond_names[i]) return i;
+  }
+  return -1;
+}
+
+// written out separately from thumb_condition() on purpose
+static int cond_passes(int cond, int nzcv) {
+  int n = nzcv & 8, z = nzcv & 4, c = nzcv & 2, v = nzcv & 1;
+  switch(cond) {
+    case 0: return z != 0;
+    case 1: return z == 0;
+    case 2: return c != 0;
+    case 3: return c == 0;
+    case 4: return n != 0;
+    case 5: return n == 0;
+    case 6: return v != 0;
+    case 7: return v == 0;
+    case 8: return c && ! z;
+    case 9: return ! c || z;
+    case 10: return (n != 0) == (v != 0);
+    case 11: return (n != 0) != (v != 0);
+    case 12: return ! z && (n != 0) == (v != 0);
+    case 13: return z || (n != 0) != (v != 0);
+  }
+  return 1;
+}
+
+static int reg_number(const char *s) {
+  while (*s == ' ' || *s == '{' || *s == '[') s++;
+  if (! strncmp(s, "sp", 2)) return 13;
+  if (! strncmp(s, "lr", 2)) return 14;
+  if (! strncmp(s, "pc", 2)) return 15;
+  if (s[0] == 'r' && isdigit(s[1])) return atoi(s + 1);
+  return -1;
+}
+
+// register list "{r4, r5, pc}" -> number of registers, and whether pc is one
+static int reg_list(const std::string &ops, int *has_pc) {
+  size_t open = ops.find('{');
+  size_t close = ops.find('}');
+  *has_pc = 0;
+  if (open == std::string::npos || close == std::string::npos) return 0;
+  std::string list = ops.substr(open + 1, close - open - 1);
+  int count = 0;
+  size_t p = 0;
+  while (p < list.size()) {
+    size_t comma = list.find(',', p);
+    if (comma == std::string::npos) comma = list.size();
+    std::string r = list.substr(p, comma - p);
+    size_t dash = r.find('-');
+    if (dash != std::string::npos) {
+      count += reg_number(r.substr(dash + 1).c_str()) - reg_number(r.c_str()) + 1;
+    }
+    else {
+      count++;
+    }
+    if (reg_number(r.c_str()) == 15) *has_pc = 1;
+    p = comma + 1;
+  }
+  return count;
+}
+
+static uint32_t reg_value(int n, uint32_t pc) {
+  return n == 15 ? pc + 4 : regs[n];
+}
+
+static long imm_value(const char *s) {
+  const char *h = strchr(s, '#');
+  return h ? strtol(h + 1, NULL, 0) : 0;
+}
+
+// address read by "ldr pc, <ops>"
+static uint32_t ldr_address(const insn &in) {
+  const char *ops = in.ops.c_str();
+  const char *br = strchr(ops, '[');
+  int rn = reg_number(br + 1);
+  uint32_t base = rn == 15 ? (in.addr + 4) & ~3 : regs[rn];
+  const char *close = strchr(br, ']');
+  const char *comma = strchr(br, ',');
+  if (comma && comma < close) {
+    const char *second = comma + 1;
+    while (*second == ' ') second++;
+    if (*second == '#') return base + imm_value(second);   // [rn, #imm] and [rn, #imm]!
+    int rm = reg_number(second);
+    const char *lsl = strstr(second, "lsl");
+    return base + (regs[rm] << (lsl && lsl < close ? imm_value(lsl) : 0));
+  }
+  return base;  // [rn] and [rn], #imm
+}
+
+// vector list "{d8-d15}" or "{s0, s1}" -> number of bytes
+static int vreg_bytes(const std::string &ops) {
+  size_t open = ops.find('{');
+  size_t close = ops.find('}');
+  if (open == std::string::npos || close == std::string::npos) return 0;
+  int size = ops[open + 1] == 'd' ? 8 : 4;
+  std::string list = ops.substr(open + 1, close - open - 1);
+  int count = 0;
+  size_t p = 0;
+  while (p < list.size()) {
+    size_t comma = list.find(',', p);
+    if (comma == std::string::npos) comma = list.size();
+    std::string r = list.substr(p, comma - p);
+    while (! r.empty() && r[0] == ' ') r.erase(0, 1);
+    size_t dash = r.find('-');
+    count += dash != std::string::npos ? atoi(r.c_str() + dash + 2) - atoi(r.c_str() + 1) + 1 : 1;
+    p = comma + 1;
+  }
+  return count * size;
+}
+
+static int strip_cond(std::string &m, const char *base) {
+  size_t n = strlen(base);
+  if (m.size() == n + 2 && ! m.compare(0, n, base)) {
+    int c = cond_code(m.substr(n));
+    if (c >= 0) {
+      m = base;
+      return c;
+    }
+  }
+  return -1;
+}
+
+static void report(const char *file, const insn &in, const char *what, uint32_t expected, uint32_t got) {
+  mismatches++;
+  printf("%s:%lx: %s: %s: expected %08lx, got %08lx\n", file, (unsigned long)in.addr,
+    in.text.c_str(), what, (unsigned long)expected, (unsigned long)got);
+}
+
+// memory written by a store, worked out from objdump's text; 0 if none
+static int store_expected(const insn &in, const std::string &m, uint32_t *addr) {
+  const char *ops = in.ops.c_str();
+  int rn = reg_number(ops);
+  int has_pc = 0;
+  if (m == "push") {
+    int bytes = 4 * reg_list(in.ops, &has_pc);
+    *addr = regs[13] - bytes;
+    return bytes;
+  }
+  if (m == "stm" || m == "stmia" || m == "stmea") {
+    *addr = regs[rn];
+    return 4 * reg_list(in.ops, &has_pc);
+  }
+  if (m == "stmdb" || m == "stmfd") {
+    int bytes = 4 * reg_list(in.ops, &has_pc);
+    *addr = regs[rn] - bytes;
+    return bytes;
+  }
+  if (m == "vpush") {
+    int bytes = vreg_bytes(in.ops);
+    *addr = regs[13] - bytes;
+    return bytes;
+  }
+  if (m == "vstm" || m == "vstmia") {
+    *addr = regs[rn];
+    return vreg_bytes(in.ops);
+  }
+  if (m == "vstmdb") {
+    int bytes = vreg_bytes(in.ops);
+    *addr = regs[rn] - bytes;
+    return bytes;
+  }
+  if (m == "vstr") {
+    *addr = ldr_address(in);
+    return ops[0] == 'd' ? 8 : 4;
+  }
+  static const struct { const char *name; int size; } sizes[] = {
+    { "str", 4 }, { "strb", 1 }, { "strh", 2 }, { "strd", 8 }, { "strt", 4 },
+    { "strbt", 1 }, { "strht", 2 }, { "strex", 4 }, { "strexb", 1 }, { "strexh", 2 }
+  };
+  for (auto &s : sizes) {
+    if (m == s.name) {
+      *addr = ldr_address(in);
+      return s.size;
+    }
+  }
+  return 0;
+}
+
+static void check_stores(const char *file, const insn &in, std::string m) {
+  for (const char *b : { "str", "strb", "strh", "strd", "push", "stm", "vstr" }) {
+    if (strip_cond(m, b) >= 0) break;
+  }
+  uint32_t want_addr = 0, got_addr = 0;
+  int want = store_expected(in, m, &want_addr);
+  thumb_cpu cpu;
+  memcpy(cpu.r, regs, sizeof(regs));
+  cpu.r[15] = in.addr;
+  cpu.xpsr = 0x01000000;
+  cpu.read = mem_read;
+  int got = thumb_stores(&cpu, &got_addr);
+  if (got != want) {
+    report(file, in, "store size", want, got);
+  }
+  else if (want && got_addr != want_addr) {
+    report(file, in, "store address", want_addr, got_addr);
+  }
+  else if (want) {
+    stores++;
+  }
+}
+
+static uint32_t decode(uint32_t pc, int nzcv) {
+  thumb_cpu cpu;
+  memcpy(cpu.r, regs, sizeof(regs));
+  cpu.r[15] = pc;
+  cpu.xpsr = ((uint32_t)nzcv << 28) | 0x01000000;
+  cpu.read = mem_read;
+  return thumb_nextpc(&cpu);
+}
+
+static void check(const char *file, const std::vector<insn> &list, size_t i, int in_it) {
+  const insn &in = list[i];
+  uint32_t pc = in.addr;
+  uint32_t seq = pc + in.size;
+  std::string m = in.mnem;
+  const char *ops = in.ops.c_str();
+  int cond = -1;
+
+  checked++;
+  hits[thumb_lookup(in.h1, in.h2)]++;
+  if (thumb_width(in.h1) != in.size) {
+    report(file, in, "width", in.size, thumb_width(in.h1));
+    return;
+  }
+  check_stores(file, in, m);
+
+  // conditions inside an IT block come from ITSTATE, which is 0 here,
+  // so those instructions always run
+  if (in_it) {
+    const char *bases[] = { "b", "bx", "blx", "pop", "ldr", "ldm", "ldmdb", "mov", "add", "tbb", "tbh" };
+    for (const char *b : bases) {
+      if (strip_cond(m, b) >= 0) break;
+    }
+  }
+  else if (m != "bl" && m != "bx" && m != "blx" && m != "ble") {
+    cond = strip_cond(m, "b");
+  }
+  else if (m == "ble") {
+    m = "b";
+    cond = 13;
+  }
+
+  uint32_t expected = seq;
+  int rn = reg_number(ops);
+  int has_pc = 0;
+
+  if (m == "b" || m == "bl") {
+    uint32_t target = strtoul(ops, NULL, 16);
+    if (cond < 0 || in_it) cond = 14;
+    for (int nzcv=0; nzcv<16; nzcv++) {
+      uint32_t want = cond_passes(cond, nzcv) ? target : seq;
+      uint32_t got = decode(pc, nzcv);
+      if (got != want) {
+        report(file, in, "branch", want, got);
+        return;
+      }
+    }
+    return;
+  }
+  else if (m == "cbz" || m == "cbnz") {
+    uint32_t target = strtoul(strchr(ops, ',') + 1, NULL, 16);
+    uint32_t saved = regs[rn];
+    for (int zero=0; zero<2; zero++) {
+      regs[rn] = zero ? 0 : saved;
+      int taken = (m == "cbz") == (regs[rn] == 0);
+      uint32_t want = taken ? target : seq;
+      uint32_t got = decode(pc, 0);
+      regs[rn] = saved;
+      if (got != want) {
+        report(file, in, "cbz/cbnz", want, got);
+        return;
+      }
+    }
+    return;
+  }
+  else if (! m.compare(0, 2, "it") && m.size() <= 5 && in.size == 2) {
+    // "itte eq": the first takes the condition, t the same, e the opposite
+    int first = cond_code(std::string(ops).substr(0, 2));
+    for (int nzcv=0; nzcv<16; nzcv++) {
+      uint32_t want = 0;
+      size_t k;
+      for (k=1; k<m.size() && i+k<list.size(); k++) {
+        int c = m[k] == 'e' ? first ^ 1 : first;
+        if (cond_passes(c, nzcv)) {
+          want = list[i+k].addr;
+          break;
+        }
+      }
+      if (want == 0) {
+        if (i+k >= list.size()) return;   // block runs off the end of the section
+        want = list[i+k].addr;
+      }
+      uint32_t got = decode(pc, nzcv);
+      if (got != want) {
+        report(file, in, "it", want, got);
+        return;
+      }
+    }
+    return;
+  }
+  else if (m == "bx" || m == "blx") {
+    expected = reg_value(rn, pc) & ~1;
+  }
+  else if ((m == "mov" || m == "add") && rn == 15 && in.size == 2) {
+    int rm = reg_number(strchr(ops, ',') + 1);
+    expected = m == "mov" ? reg_value(rm, pc) & ~1 : (pc + 4 + reg_value(rm, pc)) & ~1;
+  }
+  else if (m == "tbb" || m == "tbh") {
+    int r1 = reg_number(strchr(ops, '[') + 1);
+    int r2 = reg_number(strchr(ops, ',') + 1);
+    uint32_t off = m == "tbb" ? mem_read(reg_value(r1, pc) + regs[r2], 1) : mem_read(reg_value(r1, pc) + 2 * regs[r2], 2);
+    expected = pc + 4 + 2 * off;
+  }
+  else if (m == "pop") {
+    int count = reg_list(in.ops, &has_pc);
+    if (has_pc) expected = mem_read(regs[13] + 4 * (count - 1), 4) & ~1;
+  }
+  else if (m == "ldm" || m == "ldmia" || m == "ldmdb" || m == "ldmea") {
+    int count = reg_list(in.ops, &has_pc);
+    if (has_pc) {
+      uint32_t addr = m == "ldmdb" || m == "ldmea" ? regs[rn] - 4 : regs[rn] + 4 * (count - 1);
+      expected = mem_read(addr, 4) & ~1;
+    }
+  }
+  else if (m == "ldr" && rn == 15) {
+    expected = mem_read(ldr_address(in), 4) & ~1;
+  }
+  else if (rn == 15 && m != "cmp" && m != "cmn" && m != "tst" && m != "teq" && m.compare(0, 3, "str") && m != "push" && m.compare(0, 3, "pld") && m.compare(0, 3, "pli")) {
+    printf("%s:%lx: %s: writes pc; not checked\n", file, (unsigned long)in.addr, in.text.c_str());
+    return;
+  }
+
+  uint32_t got = decode(pc, 0);
+  if (got != expected) {
+    report(file, in, "next", expected, got);
+  }
+  else if (verbose) {
+    printf("%s:%lx: %s -> %08lx\n", file, (unsigned long)in.addr, in.text.c_str(), (unsigned long)got);
+  }
+}
+
+static void check_section(const char *file, std::vector<insn> &list) {
+  code.clear();
+  for (const insn &in : list) {
+    code[in.addr] = in.h1 & 0xFF;
+    code[in.addr + 1] = in.h1 >> 8;
+    if (in.size == 4) {
+      code[in.addr + 2] = in.h2 & 0xFF;
+      code[in.addr + 3] = in.h2 >> 8;
+    }
+  }
+  int it_left = 0;
+  for (size_t i=0; i<list.size(); i++) {
+    check(file, list, i, it_left > 0);
+    const insn &in = list[i];
+    if (it_left > 0) {
+      it_left--;
+    }
+    else if (! in.mnem.compare(0, 2, "it") && in.mnem.size() <= 5 && in.size == 2) {
+      it_left = in.mnem.size() - 1;
+    }
+  }
+  list.clear();
+}
+
+static int check_file(const char *file) {
+  const char *objdump = getenv("OBJDUMP") ? getenv("OBJDUMP") : "llvm-objdump";
+  std::string cmd = std::string(objdump) + " -d --triple=thumbv7em-none-eabi --mcpu=cortex-m7 '" + file + "'";
+  FILE *f = popen(cmd.c_str(), "r");
+  if (! f) {
+    perror(objdump);
+    return -1;
+  }
+  std::vector<insn> list;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    if (! strncmp(line, "Disassembly of section", 22)) {
+      check_section(file, list);
+      continue;
+    }
+    // "      1e: df e8 01 f0  \ttbb\t[pc, r1]"
+    char *p = line;
+    while (*p == ' ') p++;
+    char *end;
+    unsigned long addr = strtoul(p, &end, 16);
+    if (end == p || *end != ':') continue;
+    p = end + 1;
+    uint8_t bytes[4];
+    int n = 0;
+    while (*p == ' ' && n < 4 && isxdigit(p[1]) && isxdigit(p[2]) && (p[3] == ' ' || p[3] == '\t')) {
+      bytes[n++] = strtoul(p + 1, NULL, 16);
+      p += 3;
+    }
+    char *tab = strchr(p, '\t');
+    if (! tab || (n != 2 && n != 4)) continue;
+    tab++;
+    if (*tab == '.' || *tab == '<') continue;  // data, or not an instruction
+    insn in;
+    in.addr = addr;
+    in.size = n;
+    in.h1 = bytes[0] | (bytes[1] << 8);
+    in.h2 = n == 4 ? bytes[2] | (bytes[3] << 8) : 0;
+    char *nl = strchr(tab, '\n');
+    if (nl) *nl = 0;
+    char *comment = strstr(tab, "@");
+    if (comment) *comment = 0;
+    in.text = tab;
+    while (! in.text.empty() && isspace(in.text.back())) in.text.pop_back();
+    for (char &c : in.text) if (c == '\t') c = ' ';
+    char *sep = strchr(tab, '\t');
+    in.mnem = sep ? std::string(tab, sep - tab) : std::string(tab);
+    in.ops = sep ? std::string(sep + 1) : "";
+    size_t dot = in.mnem.find('.');
+    if (dot != std::string::npos) in.mnem.erase(dot);
+    list.push_back(in);
+  }
+  check_section(file, list);
+  return pclose(f) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  int files = 0;
+  for (int i=0; i<16; i++) regs[i] = 0x20000010 + 0x100 * i;
+  regs[14] |= 1;  // return addresses have the Thumb bit set
+
+  for (int i=1; i<argc; i++) {
+    if (! strcmp(argv[i], "-v")) {
+      verbose = 1;
+      continue;
+    }
+    if (check_file(argv[i]) < 0) {
+      fprintf(stderr, "%s: objdump failed\n", argv[i]);
+      return 2;
+    }
+    files++;
+  }
+  if (files == 0) {
+    fprintf(stderr, "usage: nextpc-check [-v] file.o|sketch.elf ...\n");
+    return 2;
+  }
+
+  printf("\nencoding                            hits\n");
+  int unused = 0;
+  for (int i=0; i<thumb_encoding_count; i++) {
+    printf("%-34s %6ld%s\n", thumb_encodings[i].name, hits[i], hits[i] ? "" : "   <- not exercised");
+    if (hits[i] == 0) unused++;
+  }
+  printf("\n%d of %d encodings exercised\n", thumb_encoding_count - unused, thumb_encoding_count);
+  printf("%ld instructions (%ld stores), %ld mismatches\n", checked, stores, mismatches);
+  return mismatches ? 1 : 0;
+}
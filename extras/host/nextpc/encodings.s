@@ -0,0 +1,284 @@
+@ Input for nextpc-check: every encoding in thumb_encodings[], in the
+@ forms compilers emit, plus a few hand-written functions shaped like
+@ sketch code. Assembled with llvm-mc by 'make -C extras/host nextpc'.
+
+	.syntax unified
+	.thumb
+	.text
+
+	.globl	branches
+	.type	branches,%function
+	.thumb_func
+branches:
+	push	{r4, r5, r7, lr}
+1:	beq	1b
+	bne	2f
+	bhs	1b
+	blo	2f
+	bmi	1b
+	bpl	2f
+	bvs	1b
+	bvc	2f
+	bhi	1b
+	bls	2f
+	bge	1b
+	blt	2f
+	bgt	1b
+	ble	2f
+	b	1b
+	b	2f
+	beq.w	1b
+	bne.w	far
+	bhi.w	2f
+	ble.w	far
+	b.w	far
+	b.w	1b
+	bl	branches
+	bl	far
+2:	cbz	r0, 3f
+	cbnz	r7, 3f
+	cbz	r2, 4f
+	nop
+	nop
+3:	cbnz	r1, 4f
+	.rept	28
+	nop
+	.endr
+4:	pop	{r4, r5, r7, pc}
+
+	.globl	indirect
+	.type	indirect,%function
+	.thumb_func
+indirect:
+	bx	lr
+	bx	r3
+	blx	r3
+	blx	r12
+	mov	pc, r3
+	mov	pc, lr
+	add	pc, r2
+	pop	{pc}
+	pop	{r0-r7, pc}
+	pop.w	{r4-r11, pc}
+	pop.w	{r4, pc}
+	ldr	pc, [sp], #4
+	ldr.w	pc, [pc, #4]
+	ldr.w	pc, [pc, #-8]
+	ldr.w	pc, [r3, #8]
+	ldr.w	pc, [r1, #4092]
+	ldr	pc, [r3, #-8]
+	ldr	pc, [r4, #4]!
+	ldr	pc, [r4, #-252]!
+	ldr	pc, [r5], #-16
+	ldr.w	pc, [r2, r3]
+	ldr.w	pc, [r2, r3, lsl #2]
+	ldm	r0!, {r1, r2, pc}
+	ldm.w	r0, {r4, pc}
+	ldmdb	r5, {r0, pc}
+	ldmdb	r5!, {r0, r1, r2, pc}
+	.p2align 2
+	.word	0x60001235
+
+	.globl	tables
+	.type	tables,%function
+	.thumb_func
+tables:
+	cmp	r0, #3
+	bhi	9f
+	tbb	[pc, r0]
+	.byte	(5f - 5f) / 2
+	.byte	(6f - 5f) / 2
+	.byte	(7f - 5f) / 2
+	.byte	(8f - 5f) / 2
+5:	movs	r0, #1
+	bx	lr
+6:	movs	r0, #2
+	bx	lr
+7:	movs	r0, #3
+	bx	lr
+8:	tbh	[r1, r0, lsl #1]
+	tbb	[r1, r0]
+9:	movs	r0, #0
+	bx	lr
+
+	.globl	itblocks
+	.type	itblocks,%function
+	.thumb_func
+itblocks:
+	cmp	r0, r1
+	it	eq
+	moveq	r0, #1
+	itt	ne
+	movne	r0, #2
+	addne	r0, #3
+	ite	gt
+	movgt	r0, #4
+	movle	r0, #5
+	itte	hs
+	movhs	r0, #6
+	addhs.w	r0, r0, #1000
+	movlo	r0, #7
+	ittee	mi
+	movmi	r0, #8
+	movmi	r1, #9
+	movpl	r0, #10
+	movpl	r1, #11
+	itete	vs
+	movvs	r0, #12
+	movvc	r0, #13
+	movvs	r0, #14
+	movvc	r0, #15
+	it	lt
+	poplt	{r4, pc}
+	it	ge
+	bxge	lr
+	it	hi
+	ldrhi	pc, [sp], #4
+	itt	ls
+	movls	r0, #1
+	bls	itblocks
+	it	al
+	movs	r0, r0
+	bx	lr
+
+	.globl	misc
+	.type	misc,%function
+	.thumb_func
+misc:
+	svc	#0x10
+	svc	#0x11
+	udf	#0
+	nop
+	yield
+	wfi
+	wfe
+	sev
+	dsb	sy
+	isb	sy
+	dmb	sy
+	mrs	r0, primask
+	msr	basepri, r0
+	cpsid	i
+	cpsie	i
+	bkpt	#0
+	movs	r0, #1
+	adds	r0, r1, r2
+	ldr	r0, [pc, #4]
+	ldr.w	r1, [r2, #8]
+	str.w	r1, [r2, #-4]!
+	push	{r4-r11, lr}
+	push.w	{r4, lr}
+	mov.w	r0, #0x12345678 & 0xff
+	movw	r0, #0x1234
+	movt	r0, #0x5678
+	vldr	s0, [r0]
+	vadd.f32 s0, s1, s2
+	vpush	{d8-d15}
+	vpop	{d8-d15}
+	ldrd	r0, r1, [sp, #8]
+	strd	r0, r1, [sp, #8]
+	ldrex	r0, [r1]
+	strex	r2, r0, [r1]
+	clz	r0, r1
+	udiv	r0, r1, r2
+	mla	r0, r1, r2, r3
+	ubfx	r0, r1, #4, #8
+	bfi	r0, r1, #4, #8
+	tst.w	r0, #0x100
+	cmp	pc, r0
+	bx	lr
+
+@ stores, for the thumb_stores() check
+	.globl	stores
+	.type	stores,%function
+	.thumb_func
+stores:
+	str	r0, [r1, #124]
+	strb	r0, [r1, #31]
+	strh	r0, [r1, #62]
+	str	r0, [r1, r2]
+	strb	r0, [r1, r2]
+	strh	r0, [r1, r2]
+	str	r0, [sp, #1020]
+	push	{r0}
+	push	{r0-r7, lr}
+	stmia	r0!, {r1, r2, r3}
+	str.w	r0, [r1, #4095]
+	strb.w	r0, [r1, #1]
+	strh.w	r0, [r1, #2046]
+	str	r0, [r1, #-255]
+	str	r0, [r1, #255]!
+	strb	r0, [r1], #-1
+	strh	r0, [r1], #2
+	str	r0, [sp, #-4]!
+	str.w	r0, [r1, r2, lsl #3]
+	strb.w	r0, [r1, r2, lsl #1]
+	strt	r0, [r1, #4]
+	strex	r0, r1, [r2, #8]
+	strexb	r0, r1, [r2]
+	strexh	r0, r1, [r2]
+	strd	r0, r1, [r2, #-8]
+	strd	r0, r1, [r2, #16]!
+	strd	r0, r1, [r2], #-16
+	stm.w	r0!, {r1, r2, r9}
+	stm.w	r0, {r4-r11}
+	stmdb	r0!, {r1, r2}
+	push.w	{r4-r11, lr}
+	vstr	s1, [r0, #-8]
+	vstr	d1, [r0, #1020]
+	vpush	{s16-s19}
+	vstmia	r0!, {d0-d3}
+	vstmia	r0, {s0, s1}
+	vstmdb	r0!, {d8}
+	itt	ne
+	strne	r0, [r1]
+	pushne	{r4}
+	ldr	r0, [r1]
+	pop	{r4}
+	ldm	r0, {r1, r2}
+	ldrd	r0, r1, [r2]
+	ldrex	r0, [r1]
+	vpop	{d8}
+	vldr	d0, [r0]
+	vmov	r0, r1, d0
+	pld	[r0]
+	bx	lr
+
+@ a sketch-like loop: a state machine over a buffer with a call
+	.globl	loop_like
+	.type	loop_like,%function
+	.thumb_func
+loop_like:
+	push	{r4, r5, r6, lr}
+	mov	r4, r0
+	adds	r5, r0, r1
+	movs	r6, #0
+1:	cmp	r4, r5
+	beq	3f
+	ldrb	r0, [r4], #1
+	subs	r0, #'0'
+	cmp	r0, #9
+	itt	ls
+	addls.w	r6, r6, r6, lsl #2
+	addls.w	r6, r0, r6, lsl #1
+	bls	1b
+	cmp	r0, #('-' - '0') & 0xff
+	bne	2f
+	negs	r6, r6
+	b	1b
+2:	mov	r0, r6
+	bl	branches
+	cbz	r0, 3f
+	movs	r6, #0
+	b	1b
+3:	mov	r0, r6
+	pop	{r4, r5, r6, pc}
+
+	.space	0x3000
+	.globl	far
+	.type	far,%function
+	.thumb_func
+far:
+	b.w	branches
+	bl	loop_like
+	bx	lr
@@ -0,0 +1,979 @@
+/**
+ * @file sim.cpp
+ * @author Fernando Trias
+ * @brief Run the GDB stub on Linux against a simulated Teensy
+ * @version 0.1
+ * @date 2020-06-09
+ *
+ * @copyright Copyright (c) 2020 Fernando Trias
+ *
+ */
+
+/*
+ * The simulator links the real gdbstub.cpp and TeensyDebug.cpp (built with
+ * GDB_HOST_SIM) and provides:
+ *
+ *   - RAM and flash mapped at the addresses in TeensyDebug.h, so
+ *     isValidAddress(), 'm'/'M' and software breakpoints work unchanged.
+ *   - A tiny Thumb CPU that runs a fixed "loop()" in RAM. It knows just
+ *     enough instructions (adds, nop, b, bx lr, svc) to hit breakpoints,
+ *     and a few that store (movs, str, push, pop) for recording.
+ *   - The IntervalTimer "interrupt", run from the main loop and from
+ *     yield() while halted, the same as on the Teensy.
+ *
+ * Usage:
+ *
+ *   teensydebug-sim            open a pty and print its name; then
+ *                              gdb-multiarch -ex 'target remote /dev/pts/N'
+ *   teensydebug-sim --halt     the same, but stop in setup() as if the
+ *                              sketch called halt_cpu()
+ *   teensydebug-sim --bench N  run a scripted session N times over a
+ *                              socketpair and report per-packet latency
+ *   teensydebug-sim --svc-bench
+ *                              time SVC dispatch with breakpoints set
+ *   teensydebug-sim --replay [-n N] [-o out] session...
+ *                              replay recorded sessions N times, check
+ *                              the replies and report latency percentiles
+ *                              and throughput; -o writes what the stub
+ *                              actually sent, in session format
+ */
+
+#include <Arduino.h>
+#include "TeensyDebug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Fake Arduino core
+ */
+
+HostSerial Serial;
+
+static uint64_t sim_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t sim_start_nanos = sim_nanos();
+
+// added to the host clock, so taking stops off it works as on a Teensy
+volatile uint32_t systick_millis_count = 0;
+
+uint32_t millis() { return (sim_nanos() - sim_start_nanos) / 1000000 + systick_millis_count; }
+uint32_t micros() { return (sim_nanos() - sim_start_nanos) / 1000 + systick_millis_count * 1000; }
+void delay(uint32_t ms) { usleep(ms * 1000); }
+
+static void (*sim_timer_callback)() = NULL;
+static uint32_t sim_timer_interval = 0;
+static uint64_t sim_timer_next = 0;
+static int sim_in_timer = 0;
+
+bool IntervalTimer::begin(void (*funct)(), uint32_t microseconds) {
+  sim_timer_callback = funct;
+  sim_timer_interval = microseconds;
+  sim_timer_next = 0;
+  return true;
+}
+
+void IntervalTimer::end() {
+  sim_timer_callback = NULL;
+}
+
+// In bench mode the timer runs on every pass so we measure the stub, not
+// the polling interval.
+static int sim_bench = 0;
+
+/**
+ * @brief Run the timer "interrupt" if it is due. It never nests with
+ * itself, as on the Teensy.
+ */
+static void sim_service() {
+  if (sim_timer_callback == NULL || sim_in_timer) return;
+  uint64_t now = sim_nanos();
+  if (! sim_bench && now < sim_timer_next) return;
+  sim_timer_next = now + sim_timer_interval * 1000ull;
+  sim_in_timer = 1;
+  sim_timer_callback();
+  sim_in_timer = 0;
+}
+
+void yield() {
+  sim_service();
+}
+
+/**
+ * Serial link to GDB over a file descriptor (pty or socket)
+ */
+
+class FdStream : public Stream {
+public:
+  int fd = -1;
+
+  int available() {
+    if (head == tail) {
+      head = tail = 0;
+      ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n > 0) tail = n;
+      if (n == 0) exit(0); // GDB side closed
+    }
+    return tail - head;
+  }
+  int read() {
+    if (available() <= 0) return -1;
+    return buf[head++];
+  }
+  size_t write(uint8_t b) { return write(&b, 1); }
+  size_t write(const uint8_t *p, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t w = ::write(fd, p + done, n - done);
+      if (w > 0) done += w;
+      else if (w < 0 && errno != EAGAIN && errno != EINTR) break;
+    }
+    // let a client on the same core read it now rather than after our
+    // time slice; a running target never sleeps
+    sched_yield();
+    return done;
+  }
+
+private:
+  uint8_t buf[4096];
+  int head = 0, tail = 0;
+};
+
+static FdStream sim_link;
+
+/**
+ * @brief Wait for an "interrupt"; used in place of wfi.
+ */
+void sim_idle() {
+  struct pollfd p = { sim_link.fd, POLLIN, 0 };
+  poll(&p, 1, 1);
+}
+
+/**
+ * Simulated memory and CPU
+ */
+
+#define SIM_RAM    ((uint32_t)(uintptr_t)RAM_START)
+#define SIM_RAM_SIZE   ((uint32_t)(uintptr_t)RAM_END - (uint32_t)(uintptr_t)RAM_START + 1)
+#define SIM_FLASH  ((uint32_t)(uintptr_t)FLASH_START)
+#define SIM_FLASH_SIZE ((uint32_t)(uintptr_t)FLASH_END - (uint32_t)(uintptr_t)FLASH_START + 1)
+
+// loop(): adds r0,#1 then nops, then branch back
+#define SIM_LOOP       (SIM_RAM + 0x000)
+#define SIM_LOOP_END   (SIM_RAM + 0x01e)
+// setup(): halt_cpu() then branch to loop; used with --halt
+#define SIM_SETUP      (SIM_RAM + 0x080)
+// scratch RAM GDB may write freely
+#define SIM_DATA       (SIM_RAM + 0x1000)
+
+// breakpoint("nops") on two of the loop's nops and breakpoint("end") on
+// the last one, laid out as the macro lays them out on the Teensy, with
+// zero words between two records as the linker may pad them
+struct sim_site {
+  uint32_t addr;
+  char name[8];
+};
+__attribute__((section("gdb_breakpoints"), used))
+const sim_site sim_sites[] = {
+  { 0x20000008, "nops" },
+  { 0x2000000c, "nops" },
+  { 0, "" },
+  { 0x2000001c, "end" },
+};
+
+// Must match TeensyDebug.cpp
+struct stack_isr {
+  uint32_t r0;
+  uint32_t r1;
+  uint32_t r2;
+  uint32_t r3;
+  uint32_t r12;
+  uint32_t lr;
+  uint32_t pc;
+  uint32_t xPSR;
+};
+
+int debug_sim_trap(struct stack_isr *frame, uint32_t *callee, uint32_t sp);
+void debug_sim_interrupt(struct stack_isr *frame, uint32_t *callee, uint32_t sp);
+
+struct sim_cpu_struct {
+  uint32_t r[16];
+  uint32_t xpsr;
+} cpu;
+
+// stands in for DWT_CYCCNT: one per instruction
+uint32_t sim_cycles = 0;
+
+static volatile int sim_break_pending = 0;
+static int sim_halt = 0;
+static sigjmp_buf sim_reset;
+
+#define SIM_MEM16(a) (*(volatile uint16_t *)(uintptr_t)(a))
+
+static void *sim_map(uint32_t addr, uint32_t size) {
+  void *p = mmap((void *)(uintptr_t)addr, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (p != (void *)(uintptr_t)addr) {
+    fprintf(stderr, "cannot map simulated memory at 0x%08x\n", addr);
+    exit(1);
+  }
+  return p;
+}
+
+static void sim_load() {
+  memset((void *)(uintptr_t)SIM_RAM, 0, SIM_RAM_SIZE);
+  SIM_MEM16(SIM_LOOP) = 0x3001; // adds r0, #1
+  for (uint32_t a = SIM_LOOP + 2; a < SIM_LOOP_END; a += 2) {
+    SIM_MEM16(a) = 0xbf00;      // nop
+  }
+  int32_t offset = (int32_t)SIM_LOOP - (int32_t)(SIM_LOOP_END + 4);
+  SIM_MEM16(SIM_LOOP_END) = 0xe000 | ((offset >> 1) & 0x7ff); // b loop
+  SIM_MEM16(SIM_SETUP) = 0xdf11;          // svc 0x11
+  offset = (int32_t)SIM_LOOP - (int32_t)(SIM_SETUP + 2 + 4);
+  SIM_MEM16(SIM_SETUP + 2) = 0xe000 | ((offset >> 1) & 0x7ff); // b loop
+
+  memset(&cpu, 0, sizeof(cpu));
+  cpu.r[13] = SIM_RAM + SIM_RAM_SIZE;
+  cpu.r[14] = 0xffffffff;
+  cpu.r[15] = sim_halt ? SIM_SETUP : SIM_LOOP;
+  cpu.xpsr = 0x01000000; // Thumb
+}
+
+/**
+ * @brief Take an exception: push the frame, run the debugger and
+ * return to whatever PC it leaves in the frame.
+ * 
+ * @param svc 1 for the SVC at pc; 0 for IRQ_DEBUG pended by Ctrl-C,
+ * taken before the instruction at pc
+ */
+static void sim_exception(int svc) {
+  uint32_t sp = cpu.r[13] - sizeof(struct stack_isr);
+  struct stack_isr *frame = (struct stack_isr *)(uintptr_t)sp;
+  frame->r0 = cpu.r[0];
+  frame->r1 = cpu.r[1];
+  frame->r2 = cpu.r[2];
+  frame->r3 = cpu.r[3];
+  frame->r12 = cpu.r[12];
+  frame->lr = cpu.r[14];
+  frame->pc = cpu.r[15] + (svc ? 2 : 0);
+  frame->xPSR = cpu.xpsr;
+  uint32_t callee[8];
+  memcpy(callee, &cpu.r[4], sizeof(callee));
+
+  if (svc) debug_sim_trap(frame, callee, sp);
+  else debug_sim_interrupt(frame, callee, sp);
+
+  cpu.r[0] = frame->r0;
+  cpu.r[1] = frame->r1;
+  cpu.r[2] = frame->r2;
+  cpu.r[3] = frame->r3;
+  cpu.r[12] = frame->r12;
+  cpu.r[14] = frame->lr;
+  cpu.r[15] = frame->pc & ~1;
+  cpu.xpsr = frame->xPSR;
+  memcpy(&cpu.r[4], callee, sizeof(callee));
+}
+
+/**
+ * @brief Execute one instruction
+ */
+static void sim_step() {
+  if (sim_break_pending) {
+    // the "timer ISR" pended IRQ_DEBUG; it runs between two instructions,
+    // and the program always gets the next one
+    sim_break_pending = 0;
+    sim_exception(0);
+  }
+
+  sim_cycles++;
+  uint32_t pc = cpu.r[15];
+  if (pc < SIM_RAM || pc >= SIM_RAM + SIM_RAM_SIZE) {
+    fprintf(stderr, "pc 0x%08x outside RAM; resetting\n", pc);
+    siglongjmp(sim_reset, 1);
+  }
+  uint16_t inst = SIM_MEM16(pc);
+
+  if ((inst & 0xff00) == 0xdf00) {          // svc
+    sim_exception(1);
+  }
+  else if ((inst & 0xf800) == 0x3000) {     // adds rd, #imm8
+    cpu.r[(inst >> 8) & 7] += inst & 0xff;
+    cpu.r[15] += 2;
+  }
+  else if ((inst & 0xf800) == 0x2000) {     // movs rd, #imm8
+    cpu.r[(inst >> 8) & 7] = inst & 0xff;
+    cpu.r[15] += 2;
+  }
+  else if ((inst & 0xf800) == 0x6000) {     // str rt, [rn, #imm5]
+    uint32_t addr = cpu.r[(inst >> 3) & 7] + ((inst >> 6) & 0x1f) * 4;
+    *(volatile uint32_t *)(uintptr_t)addr = cpu.r[inst & 7];
+    cpu.r[15] += 2;
+  }
+  else if ((inst & 0xf800) == 0x9000) {     // str rt, [sp, #imm8]
+    uint32_t addr = cpu.r[13] + (inst & 0xff) * 4;
+    *(volatile uint32_t *)(uintptr_t)addr = cpu.r[(inst >> 8) & 7];
+    cpu.r[15] += 2;
+  }
+  else if ((inst & 0xfe00) == 0xb400) {     // push {rlist, lr}
+    for (int r = 14; r >= 0; r--) {
+      if (r == 14 ? (inst & 0x100) : r < 8 && (inst & (1 << r))) {
+        cpu.r[13] -= 4;
+        *(volatile uint32_t *)(uintptr_t)cpu.r[13] = cpu.r[r];
+      }
+    }
+    cpu.r[15] += 2;
+  }
+  else if ((inst & 0xff00) == 0xbc00) {     // pop {rlist}, without pc
+    for (int r = 0; r < 8; r++) {
+      if (inst & (1 << r)) {
+        cpu.r[r] = *(volatile uint32_t *)(uintptr_t)cpu.r[13];
+        cpu.r[13] += 4;
+      }
+    }
+    cpu.r[15] += 2;
+  }
+  else if (inst == 0xbf00) {                // nop
+    cpu.r[15] += 2;
+  }
+  else if (inst == 0x4770) {                // bx lr
+    cpu.r[15] = cpu.r[14] & ~1;
+  }
+  else if (inst == 0xf8df && (SIM_MEM16(pc + 2) & 0xf000) == 0xf000) {
+    // ldr.w pc, [pc, #imm12]; the jump back from a displaced step
+    uint32_t addr = ((pc + 4) & ~3) + (SIM_MEM16(pc + 2) & 0xfff);
+    cpu.r[15] = *(volatile uint32_t *)(uintptr_t)addr & ~1;
+  }
+  else if ((inst & 0xf800) == 0xe000) {     // b imm11
+    int32_t offset = (inst & 0x7ff) << 1;
+    if (offset & 0x800) offset -= 0x1000;
+    cpu.r[15] = pc + 4 + offset;
+  }
+  else {
+    fprintf(stderr, "unknown instruction 0x%04x at 0x%08x; skipping\n", inst, pc);
+    cpu.r[15] += 2;
+  }
+}
+
+/**
+ * Hooks used by gdbstub.cpp in place of Teensy-specific code
+ */
+
+void sim_break() {
+  sim_break_pending = 1;
+}
+
+void sim_restart() {
+  siglongjmp(sim_reset, 1);
+}
+
+/**
+ * Latency benchmark
+ */
+
+struct bench_packet {
+  const char *type;   // name in the report
+  std::string body;   // packet body; "\x03" sends a raw Ctrl-C
+  int reply = 1;      // 0 if the target just resumes
+};
+
+#if GDB_FEATURE_MONITOR
+static std::string hexstr(const char *s) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  for (; *s; s++) {
+    out += digits[(uint8_t)*s >> 4];
+    out += digits[*s & 0xf];
+  }
+  return out;
+}
+#endif
+
+static std::string hex32(uint32_t n) {
+  char buf[12];
+  snprintf(buf, sizeof(buf), "%x", n);
+  return buf;
+}
+
+static std::vector<bench_packet> bench_script() {
+  std::vector<bench_packet> s;
+  std::string bp = hex32(SIM_LOOP + 0x10);
+  std::string big = hex32(GDB_PACKET_SIZE / 2 - 16);
+  std::string fill;
+  for (int i = 0; i < 64; i++) fill += "a5";
+
+  // each round starts and ends with the target running
+  s.push_back({ "interrupt", "\x03" });
+  s.push_back({ "qSupported", "qSupported:multiprocess+;swbreak+;hwbreak+" });
+  s.push_back({ "?", "?" });
+  s.push_back({ "g", "g" });
+  s.push_back({ "m 4", "m" + hex32(SIM_DATA) + ",4" });
+  s.push_back({ "m 64", "m" + hex32(SIM_DATA) + ",40" });
+  s.push_back({ "m max", "m" + hex32(SIM_DATA) + "," + big });
+  s.push_back({ "M 64", "M" + hex32(SIM_DATA) + ",40:" + fill });
+  s.push_back({ "P", "P0=78563412" });
+  s.push_back({ "Z0", "Z0," + bp + ",2" });
+  s.push_back({ "c", "c" });
+  s.push_back({ "z0", "z0," + bp + ",2" });
+  s.push_back({ "s", "s" });
+  s.push_back({ "s", "s" });
+#if GDB_FEATURE_MONITOR
+  s.push_back({ "qRcmd", "qRcmd," + hexstr("buffers") });
+#endif
+  s.push_back({ "qAttached", "qAttached" });
+  s.push_back({ "c (resume)", "c", 0 });
+  return s;
+}
+
+struct bench_args {
+  int fd;
+  int rounds;
+};
+
+/**
+ * @brief GDB side of the link, used by the benchmark and replay clients
+ */
+struct client_link {
+  int fd;
+  uint8_t buf[4096];
+  int head = 0, tail = 0;
+  size_t bytes_in = 0;
+
+  client_link(int f) : fd(f) { }
+
+  // next byte, or -1 if the link closed or the stub went quiet
+  int readc() {
+    if (head == tail) {
+      struct pollfd p = { fd, POLLIN, 0 };
+      if (poll(&p, 1, 5000) <= 0) return -1;
+      ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n <= 0) return -1;
+      head = 0;
+      tail = n;
+      bytes_in += n;
+    }
+    return buf[head++];
+  }
+
+  // read until a '+' ack (returns 1) or a full "$...#xx" packet (returns 0)
+  int read_unit(std::string &reply) {
+    int c;
+    while ((c = readc()) != '$') {
+      if (c < 0) return -1;
+      if (c == '+') return 1;
+    }
+    reply.clear();
+    while ((c = readc()) != '#') {
+      if (c < 0) return -1;
+      reply += (char)c;
+    }
+    readc();
+    readc();
+    return 0;
+  }
+
+  // read a full packet; skip acks
+  int read_packet(std::string &reply) {
+    int r;
+    while ((r = read_unit(reply)) == 1) { }
+    return r;
+  }
+
+  int send(const std::string &wire) {
+    return ::write(fd, wire.data(), wire.size()) == (ssize_t)wire.size() ? 0 : -1;
+  }
+};
+
+static std::string frame_packet(const std::string &body) {
+  uint8_t sum = 0;
+  for (char ch : body) sum += ch;
+  char cs[4];
+  snprintf(cs, sizeof(cs), "%02x", sum);
+  return "$" + body + "#" + cs;
+}
+
+static void *bench_client(void *p) {
+  bench_args *args = (bench_args *)p;
+  client_link link(args->fd);
+  std::vector<bench_packet> script = bench_script();
+  std::map<std::string, std::vector<double> > times;
+  std::vector<std::string> order;
+
+  for (int round = 0; round < args->rounds; round++) {
+    for (auto &pk : script) {
+      std::string wire = pk.body == "\x03" ? pk.body : frame_packet(pk.body);
+      if (round == 0 && times.find(pk.type) == times.end()) order.push_back(pk.type);
+
+      uint64_t t0 = sim_nanos();
+      if (link.send(wire)) break;
+      std::string reply;
+      if (! pk.reply) {
+        // just the ack
+        while (link.readc() != '+') { }
+      }
+      // output ('O') packets may arrive ahead of the reply
+      else do {
+        if (link.read_packet(reply)) {
+          fprintf(stderr, "bench: link closed\n");
+          exit(1);
+        }
+      } while (reply.size() > 1 && reply[0] == 'O' && reply != "OK");
+      uint64_t t1 = sim_nanos();
+      link.send("+");
+      times[pk.type].push_back((t1 - t0) / 1000.0);
+    }
+  }
+
+  printf("%-12s %8s %10s %10s %10s %10s\n", "packet", "count", "min us", "median us", "mean us", "max us");
+  for (auto &type : order) {
+    std::vector<double> &v = times[type];
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (double x : v) sum += x;
+    printf("%-12s %8d %10.1f %10.1f %10.1f %10.1f\n", type.c_str(), (int)v.size(),
+      v.front(), v[v.size() / 2], sum / v.size(), v.back());
+  }
+  exit(0);
+  return NULL;
+}
+
+/**
+ * Session replay
+ *
+ * A session file holds one line per packet, in the order they crossed
+ * the link, as written by extras/rsp-record.py:
+ *
+ *   > body     packet from GDB
+ *   < body     packet from the stub; the replay checks it
+ *   <~ body    packet from the stub that varies from run to run
+ *   ^          Ctrl-C
+ *   # text     comment
+ *
+ * Bytes outside printable ASCII, and backslash, are written as \xNN.
+ * Acks are not recorded; the replay sends and expects them itself.
+ */
+
+struct replay_line {
+  char dir;           // '>', '<', '^' or '#'
+  int check;          // for '<': compare with what the stub sends
+  std::string body;
+};
+
+struct replay_session {
+  std::string name;
+  std::vector<replay_line> lines;
+};
+
+static std::string replay_unescape(const char *p) {
+  std::string out;
+  while (*p && *p != '\n' && *p != '\r') {
+    if (p[0] == '\\' && p[1] == 'x' && isxdigit(p[2]) && isxdigit(p[3])) {
+      char h[3] = { p[2], p[3], 0 };
+      out += (char)strtol(h, NULL, 16);
+      p += 4;
+    }
+    else {
+      out += *p++;
+    }
+  }
+  return out;
+}
+
+static std::string replay_escape(const std::string &s) {
+  std::string out;
+  for (char ch : s) {
+    uint8_t c = ch;
+    if (c < 0x20 || c >= 0x7f || c == '\\') {
+      char h[8];
+      snprintf(h, sizeof(h), "\\x%02x", c);
+      out += h;
+    }
+    else {
+      out += ch;
+    }
+  }
+  return out;
+}
+
+static int replay_load(const char *file, replay_session &session) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) {
+    perror(file);
+    return -1;
+  }
+  session.name = file;
+  char line[8192];
+  while (fgets(line, sizeof(line), fp)) {
+    replay_line r = { line[0], 1, "" };
+    const char *body = line + 1;
+    if (line[0] == '<' && line[1] == '~') {
+      r.check = 0;
+      body++;
+    }
+    if (*body == ' ') body++;
+    switch(line[0]) {
+      case '>': case '<': r.body = replay_unescape(body); break;
+      case '#': r.body = line; r.body.erase(r.body.find_last_not_of("\r\n") + 1); break;
+      case '^': break;
+      default: continue;
+    }
+    session.lines.push_back(r);
+  }
+  fclose(fp);
+  return 0;
+}
+
+/**
+ * @brief Name a packet for the report: the command letter, or the whole
+ * name of q/Q/v packets, or Z0..Z4.
+ */
+static std::string replay_kind(const replay_line &r) {
+  if (r.dir == '^') return "^C";
+  const std::string &b = r.body;
+  if (b.empty()) return "(empty)";
+  if (b[0] == 'q' || b[0] == 'Q' || b[0] == 'v') {
+    size_t n = 1;
+    while (n < b.size() && isalpha(b[n])) n++;
+    return b.substr(0, n);
+  }
+  if ((b[0] == 'Z' || b[0] == 'z') && b.size() > 1) return b.substr(0, 2);
+  return b.substr(0, 1);
+}
+
+struct replay_stats {
+  std::map<std::string, std::vector<double> > times;
+  std::vector<std::string> order;
+  double total_us = 0;
+  size_t packets = 0;
+  size_t bytes = 0;
+  int mismatches = 0;
+  int failures = 0;
+};
+
+static void sim_run(int fd);
+
+/**
+ * @brief Replay one session against a freshly started simulator
+ *
+ * @param session Session to replay
+ * @param stats Where to add timings and errors
+ * @param out If not NULL, write the session as observed
+ */
+static void replay_one(const replay_session &session, replay_stats &stats, FILE *out) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    perror("socketpair");
+    exit(1);
+  }
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(sv[1]);
+    sim_run(sv[0]);
+  }
+  close(sv[0]);
+
+  client_link link(sv[1]);
+  const std::vector<replay_line> &lines = session.lines;
+  size_t i = 0;
+  while (i < lines.size()) {
+    const replay_line &cmd = lines[i];
+    if (cmd.dir == '#') {
+      if (out) fprintf(out, "%s\n", cmd.body.c_str());
+      i++;
+      continue;
+    }
+
+    // send one packet (or the Ctrl-C), then collect every reply that
+    // followed it in the recording
+    std::string kind;
+    uint64_t t0 = sim_nanos();
+    size_t sent = 0;
+    if (cmd.dir == '>') {
+      std::string wire = frame_packet(cmd.body);
+      sent = wire.size();
+      if (link.send(wire)) break;
+      if (out) fprintf(out, "> %s\n", replay_escape(cmd.body).c_str());
+      kind = replay_kind(cmd);
+      i++;
+    }
+    else if (cmd.dir == '^') {
+      sent = 1;
+      if (link.send("\x03")) break;
+      if (out) fprintf(out, "^\n");
+      kind = replay_kind(cmd);
+      i++;
+    }
+
+    std::vector<std::string> early;
+    if (cmd.dir == '>') {
+      // the ack comes first; anything already queued ahead of it is kept
+      std::string reply;
+      int r;
+      while ((r = link.read_unit(reply)) == 0) {
+        early.push_back(reply);
+      }
+      if (r < 0) {
+        fprintf(stderr, "%s: no ack for '%s'\n", session.name.c_str(), cmd.body.c_str());
+        stats.failures++;
+        break;
+      }
+    }
+
+    int failed = 0;
+    size_t e = 0;
+    for (; i < lines.size() && lines[i].dir == '<'; i++) {
+      std::string reply;
+      if (e < early.size()) {
+        reply = early[e++];
+      }
+      else if (link.read_packet(reply)) {
+        fprintf(stderr, "%s: timeout waiting for '%s'\n", session.name.c_str(),
+          lines[i].body.c_str());
+        failed = 1;
+        break;
+      }
+      sent++;
+      link.send("+");
+      if (out) fprintf(out, "<%s %s\n", lines[i].check ? "" : "~", replay_escape(reply).c_str());
+      if (lines[i].check && reply != lines[i].body) {
+        if (stats.mismatches < 10) {
+          fprintf(stderr, "%s: after '%s' expected '%s' got '%s'\n", session.name.c_str(),
+            cmd.dir == '^' ? "^C" : cmd.body.c_str(), lines[i].body.c_str(), reply.c_str());
+        }
+        stats.mismatches++;
+      }
+    }
+    if (failed) {
+      stats.failures++;
+      break;
+    }
+    uint64_t t1 = sim_nanos();
+
+    if (kind.empty()) continue; // unsolicited output at the start
+    if (stats.times.find(kind) == stats.times.end()) stats.order.push_back(kind);
+    stats.times[kind].push_back((t1 - t0) / 1000.0);
+    stats.total_us += (t1 - t0) / 1000.0;
+    stats.packets++;
+    stats.bytes += sent;
+  }
+  stats.bytes += link.bytes_in;
+
+  close(sv[1]);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+static double percentile(const std::vector<double> &v, int p) {
+  size_t n = (v.size() * p + 99) / 100;
+  return v[n ? n - 1 : 0];
+}
+
+static int replay_main(int argc, char **argv) {
+  int rounds = 1;
+  FILE *out = NULL;
+  std::vector<replay_session> sessions;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out = strcmp(argv[++i], "-") == 0 ? stdout : fopen(argv[i], "w");
+      if (out == NULL) {
+        perror(argv[i]);
+        return 1;
+      }
+    }
+    else {
+      replay_session session;
+      if (replay_load(argv[i], session)) return 1;
+      sessions.push_back(session);
+    }
+  }
+  if (sessions.empty()) {
+    fprintf(stderr, "usage: teensydebug-sim --replay [-n rounds] [-o out] session...\n");
+    return 1;
+  }
+
+  replay_stats stats;
+  for (int round = 0; round < rounds; round++) {
+    for (auto &session : sessions) {
+      replay_one(session, stats, round == 0 ? out : NULL);
+    }
+  }
+  if (out && out != stdout) fclose(out);
+  if (out == stdout) return stats.failures ? 1 : 0;
+
+  printf("%-16s %8s %10s %10s %10s %10s\n", "packet", "count", "p50 us", "p90 us", "p99 us", "max us");
+  for (auto &kind : stats.order) {
+    std::vector<double> &v = stats.times[kind];
+    std::sort(v.begin(), v.end());
+    printf("%-16s %8d %10.1f %10.1f %10.1f %10.1f\n", kind.c_str(), (int)v.size(),
+      percentile(v, 50), percentile(v, 90), percentile(v, 99), v.back());
+  }
+  double secs = stats.total_us / 1e6;
+  printf("\n%d sessions x %d rounds: %zu packets, %zu bytes in %.1f ms\n",
+    (int)sessions.size(), rounds, stats.packets, stats.bytes, stats.total_us / 1000);
+  if (secs > 0) {
+    printf("%.0f packets/s, %.1f KB/s\n", stats.packets / secs, stats.bytes / secs / 1024);
+  }
+  printf("%d mismatches, %d failures\n", stats.mismatches, stats.failures);
+  return stats.mismatches || stats.failures ? 1 : 0;
+}
+
+/**
+ * SVC dispatch benchmark
+ *
+ * Every SVC in a sketch goes through testOurSVC() first. This times a
+ * foreign "svc 0x22" through debug_sim_trap() with 0, 32 and 256
+ * breakpoints set, next to a linear scan of a table of the same capacity
+ * as the stub used to do. Build with -DGDB_SW_BREAKPOINTS=256 (make
+ * svcbench does) for the 256 row.
+ */
+
+static uint32_t svcbench_table[GDB_SW_BREAKPOINTS];
+
+__attribute__((noinline))
+static int svcbench_scan(uint32_t addr) {
+  for (int i = 0; i < GDB_SW_BREAKPOINTS; i++) {
+    if (svcbench_table[i] == addr) return 1;
+  }
+  return 0;
+}
+
+static int svc_bench() {
+  const int rounds = 2000000;
+  const uint32_t svc = SIM_RAM + 0x200;
+  sim_map(SIM_RAM, SIM_RAM_SIZE);
+  sim_map(SIM_FLASH, SIM_FLASH_SIZE);
+  SIM_MEM16(svc) = 0xdf22;
+
+  printf("%-12s %12s %12s\n", "breakpoints", "ns/svc", "scan ns");
+  int set = 0;
+  const int counts[] = { 0, 32, 256 };
+  for (int c : counts) {
+    for (; set < c; set++) {
+      uint32_t a = SIM_DATA + set * 4;
+      if (debug.setBreakpoint((void *)(uintptr_t)a)) break;
+      svcbench_table[set] = a;
+    }
+    if (set < c) {
+      printf("%-12d %12s\n", c, "table full");
+      break;
+    }
+
+    struct stack_isr frame;
+    uint32_t callee[8];
+    uint64_t t0 = sim_nanos();
+    for (int i = 0; i < rounds; i++) {
+      frame.pc = svc + 2;
+      debug_sim_trap(&frame, callee, 0);
+    }
+    uint64_t t1 = sim_nanos();
+    volatile int hits = 0;
+    for (int i = 0; i < rounds; i++) {
+      hits += svcbench_scan(svc);
+    }
+    uint64_t t2 = sim_nanos();
+    printf("%-12d %12.2f %12.2f\n", c, (double)(t1 - t0) / rounds, (double)(t2 - t1) / rounds);
+  }
+  return 0;
+}
+
+/**
+ * Main
+ */
+
+static int open_pty() {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+    perror("pty");
+    exit(1);
+  }
+  const char *name = ptsname(fd);
+  // keep the slave open and raw so the master survives GDB reconnecting
+  int slave = open(name, O_RDWR | O_NOCTTY);
+  struct termios t;
+  tcgetattr(slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  printf("GDB stub listening on %s\n", name);
+  printf("  gdb-multiarch -ex 'set architecture armv7e-m' -ex 'target remote %s'\n", name);
+  fflush(stdout);
+  return fd;
+}
+
+/**
+ * @brief Run the simulated Teensy on a link; does not return
+ */
+static void sim_run(int fd) {
+  sim_link.fd = fd;
+  fcntl(sim_link.fd, F_SETFL, fcntl(sim_link.fd, F_GETFL) | O_NONBLOCK);
+
+  sim_map(SIM_RAM, SIM_RAM_SIZE);
+  sim_map(SIM_FLASH, SIM_FLASH_SIZE);
+
+  sigsetjmp(sim_reset, 1);
+  sim_in_timer = 0;
+  sim_break_pending = 0;
+  sim_load();
+  debug.begin(&sim_link);
+
+  while (1) {
+    sim_service();
+    sim_step();
+  }
+}
+
+int main(int argc, char **argv) {
+  int rounds = 0;
+  if (argc > 1 && strcmp(argv[1], "--replay") == 0) {
+    // sessions start from a halt so registers are reproducible
+    sim_bench = 1;
+    sim_halt = 1;
+    return replay_main(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--svc-bench") == 0) {
+    return svc_bench();
+  }
+  if (argc > 1 && strcmp(argv[1], "--halt") == 0) {
+    sim_halt = 1;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    rounds = argc > 2 ? atoi(argv[2]) : 1000;
+    sim_bench = 1;
+  }
+
+  if (sim_bench) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+      perror("socketpair");
+      return 1;
+    }
+    static bench_args args = { sv[1], rounds };
+    pthread_t th;
+    pthread_create(&th, NULL, bench_client, &args);
+    sim_run(sv[0]);
+  }
+  sim_run(open_pty());
+  return 0;
+}
@@ -0,0 +1 @@
+// The host build has no USB; nothing to describe.
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+# Copyright 2020 by Fernando Trias
+#
+# Record a GDB session with the stub for later replay.
+#
+# Sits between GDB and the Teensy (or the host simulator): it opens a
+# pty for GDB to connect to, forwards every byte to the device and back,
+# and writes the packets in both directions to a session file that
+# extras/host can replay:
+#
+#   > body     packet from GDB
+#   < body     packet from the stub
+#   ^          Ctrl-C
+#   # text     comment
+#
+# Bytes outside printable ASCII, and backslash, are written as \xNN.
+# Acks are not written. Edit '<' lines that change from run to run
+# (counters, timing-dependent stops) into '<~' so the replay does not
+# check them.
+#
+# A sketch that calls halt_cpu() in setup() reports the stop right away;
+# start the recorder before the Teensy boots, or add the '< S05' line by
+# hand, so the replay waits for it too.
+#
+# Usage: rsp-record.py device session.rsp [comment]
+#   device is the Teensy serial port (e.g. /dev/ttyACM0) or the pty
+#   printed by teensydebug-sim --halt. Stop with Ctrl-C.
+#
+
+import os
+import pty
+import select
+import sys
+import termios
+import tty
+
+
+def escape(body):
+    out = []
+    for c in body:
+        if c < 0x20 or c >= 0x7f or c == 0x5c:
+            out.append('\\x%02x' % c)
+        else:
+            out.append(chr(c))
+    return ''.join(out)
+
+
+class Splitter:
+    """Split one direction of the byte stream into packets."""
+
+    def __init__(self, out, prefix):
+        self.out = out
+        self.prefix = prefix
+        self.body = None    # bytearray while inside $...#
+        self.trailer = 0    # checksum chars still to skip
+
+    def feed(self, data):
+        for c in data:
+            if self.trailer:
+                self.trailer -= 1
+                if self.trailer == 0:
+                    self.out.write('%s %s\n' % (self.prefix, escape(self.body)))
+                    self.out.flush()
+                    self.body = None
+            elif self.body is not None:
+                if c == ord('#'):
+                    self.trailer = 2
+                else:
+                    self.body.append(c)
+            elif c == ord('$'):
+                self.body = bytearray()
+            elif c == 0x03 and self.prefix == '>':
+                self.out.write('^\n')
+                self.out.flush()
+
+
+def raw(fd):
+    attr = termios.tcgetattr(fd)
+    tty.setraw(fd)
+    return attr
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.stderr.write('usage: rsp-record.py device session.rsp [comment]\n')
+        return 1
+
+    dev = os.open(sys.argv[1], os.O_RDWR | os.O_NOCTTY)
+    if os.isatty(dev):
+        raw(dev)
+    master, slave = pty.openpty()
+    raw(slave)
+
+    out = open(sys.argv[2], 'w')
+    if len(sys.argv) > 3:
+        out.write('# %s\n' % ' '.join(sys.argv[3:]))
+    from_gdb = Splitter(out, '>')
+    from_stub = Splitter(out, '<')
+
+    print('recording to %s; connect GDB to %s' % (sys.argv[2], os.ttyname(slave)))
+    print("  gdb-multiarch -ex 'target remote %s'" % os.ttyname(slave))
+    sys.stdout.flush()
+
+    try:
+        while True:
+            r, _, _ = select.select([master, dev], [], [])
+            if master in r:
+                data = os.read(master, 4096)
+                os.write(dev, data)
+                from_gdb.feed(data)
+            if dev in r:
+                data = os.read(dev, 4096)
+                if not data:
+                    break
+                os.write(master, data)
+                from_stub.feed(data)
+    except KeyboardInterrupt:
+        pass
+    except OSError as e:
+        sys.stderr.write('%s\n' % e)
+    out.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
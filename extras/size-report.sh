@@ -0,0 +1,56 @@
+#!/bin/sh
+# Copyright 2020 by Fernando Trias
+#
+# Print flash and RAM use of the debugger for each feature profile
+# and board. Each profile is compiled with a minimal sketch and
+# compared against the same sketch compiled without GDB. The sketch
+# is in size-report/.
+#
+# Requires arduino-cli with the Teensy core installed and
+# arm-none-eabi-size in the PATH (or set SIZE to its location).
+#
+# Usage: size-report.sh [board ...]
+#   boards default to: teensy31 teensy36 teensy40 teensy41
+#
+
+d=`dirname $0`
+cd $d/..
+lib=`pwd`
+
+SIZE=${SIZE:-arm-none-eabi-size}
+SKETCH=${SKETCH:-$lib/extras/size-report}
+BOARDS=${*:-"teensy31 teensy36 teensy40 teensy41"}
+OUT=${TMPDIR:-/tmp}/teensydebug-size
+
+# build one configuration and print "text data bss" of the ELF
+build() {
+  board=$1
+  name=$2
+  flags=$3
+  path=$OUT/$board-$name
+  arduino-cli compile --fqbn teensy:avr:$board \
+    --library "$lib" \
+    --build-path "$path" \
+    --build-property "build.flags.optimize=-Os -g $flags" \
+    "$SKETCH" > "$path.log" 2>&1 || { echo "build failed, see $path.log" >&2; return 1; }
+  $SIZE "$path"/*.elf | awk 'NR==2 { print $1, $2, $3 }'
+}
+
+mkdir -p $OUT
+
+printf "%-10s %-10s %10s %10s %10s %10s\n" board profile flash ram "+flash" "+ram"
+for board in $BOARDS; do
+  base=`build $board nogdb ""` || continue
+  set -- $base
+  bflash=$(($1 + $2))
+  bram=$(($2 + $3))
+  printf "%-10s %-10s %10d %10d %10s %10s\n" $board none $bflash $bram - -
+  for profile in MINIMAL STANDARD FULL; do
+    sz=`build $board $profile "-DGDB_MANUAL_SELECTION -DGDB_PROFILE=GDB_PROFILE_$profile"` || continue
+    set -- $sz
+    flash=$(($1 + $2))
+    ram=$(($2 + $3))
+    printf "%-10s %-10s %10d %10d %10d %10d\n" $board $profile $flash $ram \
+      $(($flash - $bflash)) $(($ram - $bram))
+  done
+done
@@ -0,0 +1,19 @@
+//
+// Minimal sketch used by size-report.sh to measure the footprint
+// of each debugger profile. The script passes GDB_MANUAL_SELECTION
+// for the profile builds; without it the library is left out
+// entirely, which gives the baseline. (GDB_IS_ENABLED can't be used
+// here, since only TeensyDebug.h defines it.)
+//
+#ifdef GDB_MANUAL_SELECTION
+#include "TeensyDebug.h"
+#endif
+
+void setup() {
+#if defined(GDB_MANUAL_SELECTION) && !defined(REMAP_SETUP)
+  debug.begin(Serial1);
+#endif
+}
+
+void loop() {
+}
@@ -73,13 +73,121 @@ https://web.eecs.umich.edu/~prabal/teaching/eecs373-f10/readings/ARMv7-M_ARM.pdf
 
 #define CPU_FLAG_FPCA 2
 
-#ifdef __ARM_PCS_VFP
-// reserve space for 8 register, 16 floats, float stat and spacer
-#define ISR_STACK_SIZE ((8+16+1+1)*4)
+// Bytes an exception pushed: 8 registers, plus 16 floats, FPSCR and a
+// spacer if the code had FP state (EXC_RETURN bit 4 clear). The FP part
+// is only reserved; lazy stacking fills it in if the handler uses the FPU.
+// xPSR bit 9 says a word was skipped to align the frame.
+#define ISR_STACK_SIZE(exc_return, xpsr) \
+  ((((exc_return) & 0x10) ? 8*4 : (8+16+1+1)*4) + (((xpsr) >> 9) & 1) * 4)
+
+/***********************************************
+ * 
+ * Code patching
+ * 
+ */
+
+/**
+ * @brief Breakpoints are planted by storing instructions into code. On
+ * the Teensy 4, code outside ITCM runs through the caches, so the new
+ * instruction has to be cleaned from the D-cache and the old one dropped
+ * from the I-cache before it can execute; ITCM still needs the barriers.
+ * 
+ * Each patch is one aligned halfword or word store done with interrupts
+ * off, together with the cache maintenance, so an ISR executes either
+ * the old or the new instruction and never a torn 32-bit one.
+ * 
+ */
+
+#define CACHE_LINE_SIZE 32
+
+debug_patch_stats_struct debug_patch_stats;
+
+/**
+ * @brief Make code written with data stores visible to instruction fetch
+ * 
+ * @param addr Start of the code
+ * @param size Number of bytes
+ */
+void debug_syncCode(void *addr, int size) {
+#if defined(__IMXRT1062__)
+  uint32_t start = (uint32_t)addr & ~(CACHE_LINE_SIZE - 1);
+  uint32_t end = (uint32_t)addr + size;
+  asm volatile("dsb");
+  for (uint32_t line = start; line < end; line += CACHE_LINE_SIZE) {
+    SCB_CACHE_DCCMVAC = line;   // clean D-cache to point of coherency
+  }
+  asm volatile("dsb");
+  for (uint32_t line = start; line < end; line += CACHE_LINE_SIZE) {
+    SCB_CACHE_ICIMVAU = line;   // invalidate I-cache
+  }
+  asm volatile("dsb \n isb");
+#elif !defined(GDB_HOST_SIM)
+  // no caches on Teensy 3.x; just drain the write
+  asm volatile("dsb \n isb");
+#endif
+}
+
+#ifdef GDB_HOST_SIM
+#define PATCH_LOCK() 0
+#define PATCH_UNLOCK(state) (void)(state)
+// the simulator counts the instructions its fake CPU runs
+extern uint32_t sim_cycles;
+#define DEBUG_CYCLES() sim_cycles
 #else
-#define ISR_STACK_SIZE (8*4)
+static inline uint32_t PATCH_LOCK() {
+  uint32_t primask;
+  asm volatile("mrs %0, primask \n cpsid i" : "=r" (primask) :: "memory");
+  return primask;
+}
+#define PATCH_UNLOCK(state) asm volatile("msr primask, %0" :: "r" (state) : "memory")
+#define DEBUG_CYCLES() ARM_DWT_CYCCNT
 #endif
 
+static inline void debug_patchDone(uint32_t t0) {
+  uint32_t t = DEBUG_CYCLES() - t0;
+  debug_patch_stats.count++;
+  debug_patch_stats.last = t;
+  if (t > debug_patch_stats.max) debug_patch_stats.max = t;
+}
+
+/**
+ * @brief Replace a halfword of code
+ * 
+ * @param addr Halfword aligned address
+ * @param code New contents
+ * @return uint16_t Old contents
+ */
+uint16_t debug_patchCode16(void *addr, uint16_t code) {
+  volatile uint16_t *p = (volatile uint16_t*)addr;
+  uint32_t t0 = DEBUG_CYCLES();
+  uint32_t state = PATCH_LOCK();
+  uint16_t old = *p;
+  *p = code;
+  debug_syncCode(addr, 2);
+  PATCH_UNLOCK(state);
+  debug_patchDone(t0);
+  return old;
+}
+
+/**
+ * @brief Replace a word of code, e.g. a whole 32-bit instruction
+ * 
+ * @param addr Word aligned address
+ * @param code New contents
+ * @return uint32_t Old contents
+ */
+uint32_t debug_patchCode32(void *addr, uint32_t code) {
+  volatile uint32_t *p = (volatile uint32_t*)addr;
+  uint32_t t0 = DEBUG_CYCLES();
+  uint32_t state = PATCH_LOCK();
+  uint32_t old = *p;
+  *p = code;
+  debug_syncCode(addr, 4);
+  PATCH_UNLOCK(state);
+  debug_patchDone(t0);
+  return old;
+}
+
 /***********************************************
  * 
  * Breakpoint setup
@@ -89,51 +197,262 @@ https://web.eecs.umich.edu/~prabal/teaching/eecs373-f10/readings/ARMv7-M_ARM.pdf
 /**
  * @brief Software RAM breakpoints
  * 
+ * svcall_isr asks whether an address holds one of our breakpoints on
+ * every SVC in the system, including context switches in TeensyThreads,
+ * so lookups use an open-addressing hash table instead of a scan. The
+ * table has at least twice as many slots as GDB_SW_BREAKPOINTS so probe
+ * sequences stay short. Address 0 marks an empty slot.
+ * 
  */
 
-const int sw_breakpoint_count = 32;
-void *sw_breakpoint_addr[sw_breakpoint_count];
-uint16_t sw_breakpoint_code[sw_breakpoint_count];
+#if GDB_SW_BREAKPOINTS <= 8
+#define SW_BREAKPOINT_BITS 4
+#elif GDB_SW_BREAKPOINTS <= 16
+#define SW_BREAKPOINT_BITS 5
+#elif GDB_SW_BREAKPOINTS <= 32
+#define SW_BREAKPOINT_BITS 6
+#elif GDB_SW_BREAKPOINTS <= 64
+#define SW_BREAKPOINT_BITS 7
+#elif GDB_SW_BREAKPOINTS <= 128
+#define SW_BREAKPOINT_BITS 8
+#elif GDB_SW_BREAKPOINTS <= 256
+#define SW_BREAKPOINT_BITS 9
+#elif GDB_SW_BREAKPOINTS <= 512
+#define SW_BREAKPOINT_BITS 10
+#elif GDB_SW_BREAKPOINTS <= 1024
+#define SW_BREAKPOINT_BITS 11
+#else
+#error "GDB_SW_BREAKPOINTS must be 1024 or less"
+#endif
+
+#define SW_BREAKPOINT_SLOTS (1 << SW_BREAKPOINT_BITS)
+#define SW_BREAKPOINT_MASK (SW_BREAKPOINT_SLOTS - 1)
+
+const int sw_breakpoint_count = GDB_SW_BREAKPOINTS;
+uint32_t sw_breakpoint_addr[SW_BREAKPOINT_SLOTS];
+uint16_t sw_breakpoint_code[SW_BREAKPOINT_SLOTS];
+int sw_breakpoint_used = 0;
+
+#if GDB_COVERAGE
+static void debug_coverArm(uint32_t addr);
+static void debug_coverDisarm(uint32_t addr);
+#endif
+
+// Fibonacci hashing of the halfword address
+static inline uint32_t swdebug_hash(uint32_t addr) {
+  return ((addr >> 1) * 2654435769u) >> (32 - SW_BREAKPOINT_BITS);
+}
+
+// slot holding addr, or the empty slot where it would go
+static inline int swdebug_find(uint32_t addr) {
+  uint32_t i = swdebug_hash(addr);
+  while (sw_breakpoint_addr[i] && sw_breakpoint_addr[i] != addr) {
+    i = (i + 1) & SW_BREAKPOINT_MASK;
+  }
+  return i;
+}
 
 int swdebug_clearBreakpoint(void *p) {
-  uint32_t addr = ((uint32_t)p) & ADDRESS_MASK;
-  for(int i=0; i<sw_breakpoint_count; i++) {
-    if (sw_breakpoint_addr[i] == (void*)addr) {
-      sw_breakpoint_addr[i] = 0;
-      uint16_t *memory = (uint16_t*)addr;
-      *memory = sw_breakpoint_code[i];
-      // Serial.print("clear bkpt; restore ");Serial.print(addr, HEX);Serial.print("=");Serial.println(*memory, HEX);
-      return 0;
-    }
+  uint32_t addr = ((uint32_t)(uintptr_t)p) & ADDRESS_MASK;
+  uint32_t i = swdebug_find(addr);
+  if (sw_breakpoint_addr[i] == 0) return -1;
+
+  debug_patchCode16((void*)addr, sw_breakpoint_code[i]);
+  // Serial.print("clear bkpt; restore ");Serial.print(addr, HEX);Serial.print("=");Serial.println(*memory, HEX);
+  sw_breakpoint_used--;
+
+  // shift later entries of the probe sequence back into the hole so
+  // lookups never need tombstones
+  uint32_t j = i;
+  while (1) {
+    j = (j + 1) & SW_BREAKPOINT_MASK;
+    if (sw_breakpoint_addr[j] == 0) break;
+    uint32_t k = swdebug_hash(sw_breakpoint_addr[j]);
+    // entry j can stay if its home slot k is cyclically in (i, j]
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    sw_breakpoint_addr[i] = sw_breakpoint_addr[j];
+    sw_breakpoint_code[i] = sw_breakpoint_code[j];
+    i = j;
   }
-  return -1;
+  sw_breakpoint_addr[i] = 0;
+#if GDB_COVERAGE
+  debug_coverArm(addr);
+#endif
+  return 0;
 }
 
 int swdebug_setBreakpoint(void *p) {
-  uint32_t addr = ((uint32_t)p) & ADDRESS_MASK;
-  for(int i=0; i<sw_breakpoint_count; i++) {
-    if (sw_breakpoint_addr[i] == 0) {
-      sw_breakpoint_addr[i] = (void*)addr;
-      uint16_t *memory = (uint16_t*)addr;
-      sw_breakpoint_code[i] = *memory;
-      // Serial.print("set brkt; overwrite ");Serial.print(addr, HEX);Serial.print(" from ");Serial.println(*memory, HEX);
-      *memory = 0xdf10; // SVC 10
-      return 0;
-    }
+  uint32_t addr = ((uint32_t)(uintptr_t)p) & ADDRESS_MASK;
+  uint32_t i = swdebug_find(addr);
+  if (sw_breakpoint_addr[i]) return 0; // already set
+  if (sw_breakpoint_used >= sw_breakpoint_count) return -1;
+
+#if GDB_COVERAGE
+  debug_coverDisarm(addr);
+#endif
+  sw_breakpoint_addr[i] = addr;
+  sw_breakpoint_code[i] = debug_patchCode16((void*)addr, 0xdf10); // SVC 10
+  // Serial.print("set brkt; overwrite ");Serial.print(addr, HEX);Serial.print(" from ");Serial.println(sw_breakpoint_code[i], HEX);
+  sw_breakpoint_used++;
+  return 0;
+}
+
+int swdebug_isBreakpoint(void *p) {
+  if (sw_breakpoint_used == 0) return 0;
+  uint32_t addr = ((uint32_t)(uintptr_t)p) & ADDRESS_MASK;
+  return sw_breakpoint_addr[swdebug_find(addr)] != 0;
+}
+
+// the instruction under a breakpoint, or what is there if there isn't one
+uint16_t swdebug_original(void *p) {
+  uint32_t addr = ((uint32_t)(uintptr_t)p) & ADDRESS_MASK;
+  if (sw_breakpoint_used) {
+    uint32_t i = swdebug_find(addr);
+    if (sw_breakpoint_addr[i]) return sw_breakpoint_code[i];
+  }
+  return *(uint16_t*)addr;
+}
+
+#if GDB_COVERAGE
+
+/**
+ * @brief Coverage points. extras/coverage.py plants one at the start of
+ * each basic block of RAM code. The first time one is reached, the SVC
+ * handler puts the instruction back, sets the point's bit in
+ * debug_cover_hit and returns to it; after that the block runs at full
+ * speed. Points are added in ascending address order so that lookups,
+ * which happen on every SVC, are a binary search.
+ * 
+ * A GDB breakpoint takes out a point under it while it is set, and
+ * reaching the breakpoint counts as reaching the point.
+ * 
+ */
+
+#define COVER_WORDS ((GDB_COVERAGE + 31) / 32)
+
+int debug_cover_count = 0;
+uint32_t debug_cover_addr[GDB_COVERAGE];
+uint16_t debug_cover_code[GDB_COVERAGE];
+uint32_t debug_cover_hit[COVER_WORDS];
+uint32_t debug_cover_planted[COVER_WORDS];
+
+static inline int cover_test(uint32_t *map, int n) {
+  return (map[n >> 5] >> (n & 31)) & 1;
+}
+
+static inline void cover_set(uint32_t *map, int n, int on) {
+  if (on) map[n >> 5] |= 1UL << (n & 31);
+  else map[n >> 5] &= ~(1UL << (n & 31));
+}
+
+static int debug_coverFind(uint32_t addr) {
+  int lo = 0;
+  int hi = debug_cover_count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (debug_cover_addr[mid] == addr) return mid;
+    if (debug_cover_addr[mid] < addr) lo = mid + 1;
+    else hi = mid - 1;
   }
   return -1;
 }
 
-int swdebug_isBreakpoint(void *p) {
-  uint32_t addr = ((uint32_t)p) & ADDRESS_MASK;
-  for(int i=0; i<sw_breakpoint_count; i++) {
-    if (sw_breakpoint_addr[i] == (void*)addr) {
-      return 1;
+// plant the SVC of a point that hasn't been reached, unless a breakpoint
+// or an SVC is already there
+static void debug_coverArm(uint32_t addr) {
+  int n = debug_coverFind(addr);
+  if (n < 0 || cover_test(debug_cover_hit, n) || cover_test(debug_cover_planted, n)) return;
+  if (swdebug_isBreakpoint((void*)addr)) return;
+  uint16_t code = *(volatile uint16_t*)addr;
+  if ((code & 0xFFF0) == 0xdf10) return;
+  debug_cover_code[n] = code;
+  cover_set(debug_cover_planted, n, 1);
+  debug_patchCode16((void*)addr, 0xdf10); // SVC 10
+}
+
+// take out the SVC of a point for a breakpoint that goes on top of it
+static void debug_coverDisarm(uint32_t addr) {
+  int n = debug_coverFind(addr);
+  if (n < 0 || ! cover_test(debug_cover_planted, n)) return;
+  debug_patchCode16((void*)addr, debug_cover_code[n]);
+  cover_set(debug_cover_planted, n, 0);
+}
+
+// a breakpoint on a point was reached
+static void debug_coverMark(uint32_t addr) {
+  int n = debug_coverFind(addr);
+  if (n >= 0) cover_set(debug_cover_hit, n, 1);
+}
+
+/**
+ * @brief Called from the SVC handler before anything else. If the SVC
+ * at addr is a coverage point, put the instruction back and record it.
+ * 
+ * @param addr Address of the SVC
+ * @return int 1 = it was a point; the program goes back to addr
+ */
+int debug_coverHit(uint32_t addr) {
+  if (debug_cover_count == 0) return 0;
+  int n = debug_coverFind(addr);
+  if (n < 0 || ! cover_test(debug_cover_planted, n)) return 0;
+  debug_patchCode16((void*)addr, debug_cover_code[n]);
+  cover_set(debug_cover_planted, n, 0);
+  cover_set(debug_cover_hit, n, 1);
+  return 1;
+}
+
+/**
+ * @brief Add a coverage point and plant it
+ * 
+ * @param addr Halfword aligned address in RAM, above the last one added
+ * @return int 0 = success; -1 = no room; -2 = not in RAM; -3 = out of order
+ */
+int debug_coverAdd(uint32_t addr) {
+  if (debug_cover_count >= GDB_COVERAGE) return -1;
+  if ((addr & 1) || (void*)addr < RAM_START || (void*)addr > RAM_END) return -2;
+  if (debug_cover_count && addr <= debug_cover_addr[debug_cover_count - 1]) return -3;
+  int n = debug_cover_count;
+  debug_cover_addr[n] = addr;
+  cover_set(debug_cover_hit, n, 0);
+  cover_set(debug_cover_planted, n, 0);
+  // counted before the SVC goes in so the handler can find it
+  debug_cover_count++;
+  debug_coverArm(addr);
+  return 0;
+}
+
+/**
+ * @brief Count the points reached and still planted
+ * 
+ * @return int Number of points
+ */
+int debug_coverStats(int *hit, int *planted) {
+  *hit = 0;
+  *planted = 0;
+  for (int n=0; n<debug_cover_count; n++) {
+    *hit += cover_test(debug_cover_hit, n);
+    *planted += cover_test(debug_cover_planted, n);
+  }
+  return debug_cover_count;
+}
+
+/**
+ * @brief Take out all points that haven't been reached and forget them
+ * 
+ */
+void debug_coverClear() {
+  for (int n=0; n<debug_cover_count; n++) {
+    if (cover_test(debug_cover_planted, n)) {
+      debug_patchCode16((void*)debug_cover_addr[n], debug_cover_code[n]);
     }
   }
-  return 0;
+  debug_cover_count = 0;
+  memset(debug_cover_hit, 0, sizeof(debug_cover_hit));
+  memset(debug_cover_planted, 0, sizeof(debug_cover_planted));
 }
 
+#endif // GDB_COVERAGE
+
 #ifdef HAS_FP_MAP
 
 /**
@@ -217,6 +536,8 @@ int hwdebug_setBreakpoint(void *p) {
     hw_remap_table[(n<<1) + 1] = ((uint16_t*)pc)[1];
   }
   
+  // the remap table must be in memory before the comparator points at it
+  debug_syncCode(hw_remap_table + (n<<1), 4);
   uint32_t addr = pc & ADDRESS_MASK2;
   FP_COMP(n) = addr | 1;
   hw_breakpoints[n] = p;
@@ -227,15 +548,151 @@ int hwdebug_setBreakpoint(void *p) {
 
 #endif
 
+#if GDB_DEBUGMON
+
 /**
- * @brief Hard coded breakpoints
+ * @brief FPB breakpoints through the DebugMonitor exception (Teensy 4).
+ * The Cortex-M7 FPB can't remap, but with halting debug off a comparator
+ * match raises DebugMonitor instead of halting. Version 2 of the FPB
+ * compares the full address, so flash code can take breakpoints without
+ * being patched. Comparators are shared with relocate.cpp, which uses
+ * them to redirect calls to relocated functions.
+ * 
+ */
+
+#define FP_CTRL_REV(x)    (((x) >> 28) & 0xF)
+#define FP_CTRL_NUM(x)    ((((x) >> 4) & 0xF) | (((x) >> 8) & 0x70))
+#define ARM_DFSR  (*(volatile uint32_t*)0xE000ED30)
+#define ARM_HFSR  (*(volatile uint32_t*)0xE000ED2C)
+#define ARM_SHPR3 (*(volatile uint32_t*)0xE000ED20)
+#define DHCSR_C_DEBUGEN (1 << 0)
+#define DEMCR_MON_EN    (1 << 16)
+#define DEMCR_MON_PEND  (1 << 17)
+#define DEMCR_MON_STEP  (1 << 18)
+#define DFSR_HALTED     (1 << 0)  // step
+#define DFSR_BKPT       (1 << 1)  // FPB match or BKPT
+#define DFSR_DWTTRAP    (1 << 2)  // watchpoint
+#define HFSR_DEBUGEVT   (1UL << 31) // a debug event escalated
+
+#define FPB_MAX 8
+
+uint32_t fpb_addr[FPB_MAX];
+uint8_t fpb_kind[FPB_MAX];
+int fpb_count = 0;
+
+// DebugMonitor is usable (no debug probe has halting debug on)
+int debugmon_enabled = 0;
+
+// single-step in progress
+int debugmon_stepping = 0;
+
+/**
+ * @brief Find the comparator watching an address
+ * 
+ * @param addr Address of instruction
+ * @param kind FPB_BREAK or FPB_REDIRECT
+ * @return int Comparator or -1
+ */
+int fpb_find(uint32_t addr, int kind) {
+  addr &= ADDRESS_MASK;
+  for (int n=0; n<fpb_count; n++) {
+    if (fpb_kind[n] == kind && fpb_addr[n] == addr) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Program a free comparator
+ * 
+ * @param addr Address of instruction
+ * @param kind FPB_BREAK or FPB_REDIRECT
+ * @return int Comparator or -1 if all are in use
+ */
+int fpb_set(uint32_t addr, int kind) {
+  addr &= ADDRESS_MASK;
+  for (int n=0; n<fpb_count; n++) {
+    if (fpb_kind[n] == 0) {
+      fpb_addr[n] = addr;
+      fpb_kind[n] = kind;
+      FP_COMP(n) = addr | 1; // version 2: BPADDR[31:1], enable
+      return n;
+    }
+  }
+  return -1;
+}
+
+void fpb_clear(int n) {
+  FP_COMP(n) = 0;
+  fpb_addr[n] = 0;
+  fpb_kind[n] = 0;
+}
+
+int dmdebug_isBreakpoint(void *p) {
+  return fpb_find((uint32_t)p, FPB_BREAK) >= 0;
+}
+
+int dmdebug_clearBreakpoint(void *p) {
+  int n = fpb_find((uint32_t)p, FPB_BREAK);
+  if (n < 0) return -1;
+  fpb_clear(n);
+  return 0;
+}
+
+int dmdebug_setBreakpoint(void *p) {
+  if (! debugmon_enabled) return -1;
+  if (dmdebug_isBreakpoint(p)) return 0;
+#if GDB_RELOC_POOL
+  // keep the last comparator for redirecting a relocated function, which
+  // then takes any number of breakpoints
+  int free = 0;
+  for (int n=0; n<fpb_count; n++) {
+    if (fpb_kind[n] == 0) free++;
+  }
+  if (free <= 1) return -1;
+#endif
+  return fpb_set((uint32_t)p, FPB_BREAK) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Set up the FPB and DebugMonitor
  * 
+ * @return int 0 if success; -1 if halting debug is on or the FPB is
+ * version 1, which only covers the code region
  */
+int debugmon_init() {
+  debugmon_enabled = 0;
+  fpb_count = 0;
+  // with a debug probe attached, debug events would halt the core
+  if (ARM_DHCSR & DHCSR_C_DEBUGEN) return -1;
+  if (FP_CTRL_REV(FP_CTRL) != 1) return -1;
+
+  FP_LAR = FP_LAR_UNLOCK_KEY;
+  fpb_count = FP_CTRL_NUM(FP_CTRL);
+  if (fpb_count > FPB_MAX) fpb_count = FPB_MAX;
+  for (int n=0; n<fpb_count; n++) {
+    fpb_clear(n);
+  }
+  FP_CTRL = 0b11; // KEY, ENABLE
+
+  // Same priority as IRQ_DEBUG: the handler pends it and it runs before
+  // the interrupted code resumes, and single-step events can't fire
+  // inside debug_call_isr itself, because DebugMonitor can't preempt it.
+  // Comparator matches in code of that priority or higher escalate to
+  // HardFault instead; debugmon_escalated() carries on from those.
+  ARM_SHPR3 = (ARM_SHPR3 & ~0xFF) | debug_halt_priority;
+  ARM_DEMCR = (ARM_DEMCR & ~(DEMCR_MON_STEP | DEMCR_MON_PEND)) | DEMCR_MON_EN;
+  debugmon_enabled = 1;
+  return 0;
+}
 
-const int hc_breakpoint_count = 32;
-void *hc_breakpoint_addr[hc_breakpoint_count];
-int hc_breakpoint_enabled[hc_breakpoint_count];
-int hc_breakpoint_trip = -1;
+#endif // GDB_DEBUGMON
+
+/**
+ * @brief Hard coded breakpoints
+ * 
+ */
 
 int debug_isHardcoded(void *addr) {
   // if (addr >= RAM_START && addr <= RAM_END) {
@@ -250,28 +707,133 @@ int debug_isHardcoded(void *addr) {
   return 0;
 }
 
-int hcdebug_clearBreakpoint(int n) {
-  hc_breakpoint_enabled[n] = 0;
-  return 0;
+/**
+ * @brief Named breakpoint sites. Each breakpoint("name") in the sketch is
+ * a nop with a record in the gdb_breakpoints section: its address, then
+ * the name, padded to a word. The linker keeps the section and defines
+ * __start_/__stop_ symbols for it because its name is a C identifier; they
+ * are weak so a sketch without any sites still links. Enabling a site
+ * sets an ordinary breakpoint on the nop, so a disabled one costs one
+ * nop and an enabled one carries on by displaced stepping.
+ * 
+ */
+
+extern const debug_site_struct __start_gdb_breakpoints[] __attribute__((weak));
+extern const debug_site_struct __stop_gdb_breakpoints[] __attribute__((weak));
+
+/**
+ * @brief Walk the named breakpoint sites
+ * 
+ * @param site Previous site, or NULL for the first
+ * @return const debug_site_struct* Next site, or NULL after the last
+ */
+const debug_site_struct *debug_nextSite(const debug_site_struct *site) {
+  if (site == NULL) {
+    site = __start_gdb_breakpoints;
+  }
+  else {
+    uintptr_t next = (uintptr_t)site->name + strlen(site->name) + 1;
+    site = (const debug_site_struct *)((next + 3) & ~(uintptr_t)3);
+  }
+  // skip any zero padding the linker put between records, a word at a time
+  while (site && site < __stop_gdb_breakpoints && site->addr == 0) {
+    site = (const debug_site_struct *)((uintptr_t)site + 4);
+  }
+  if (site == NULL || site >= __stop_gdb_breakpoints) return NULL;
+  return site;
 }
 
-int hcdebug_setBreakpoint(int n) {
-  hc_breakpoint_enabled[n] = 1;
-  return 0;
+// sites turned on by name, a bit each in section order, so turning them
+// off leaves alone a breakpoint GDB put at the same address
+static uint32_t debug_sites_on[(GDB_SITES + 31) / 32];
+
+// take out the breakpoints turned on since the bits were 'before'
+static void debug_undoSites(const uint32_t *before) {
+  int n = 0;
+  for (const debug_site_struct *site = debug_nextSite(NULL); site && n < GDB_SITES; site = debug_nextSite(site), n++) {
+    uint32_t bit = 1UL << (n & 31);
+    if ((debug_sites_on[n >> 5] & ~before[n >> 5]) & bit) {
+      debug_clearBreakpoint((void*)(uintptr_t)site->addr);
+      debug_sites_on[n >> 5] &= ~bit;
+    }
+  }
 }
 
-int hcdebug_isEnabled(int n) {
-  return hc_breakpoint_enabled[n];
+/**
+ * @brief Enable or disable every site with a name. Disabling only takes
+ * out breakpoints that enabling put in.
+ * 
+ * @param name Name given to breakpoint()
+ * @param on 1 = enable; 0 = disable
+ * @return int Number of sites with the name; -1 if there is none, or a
+ * breakpoint couldn't be set, in which case none of them is changed
+ */
+int debug_enableSite(const char *name, int on) {
+  uint32_t before[(GDB_SITES + 31) / 32];
+  memcpy(before, debug_sites_on, sizeof(before));
+  int count = 0;
+  int n = 0;
+  for (const debug_site_struct *site = debug_nextSite(NULL); site; site = debug_nextSite(site), n++) {
+    if (strcmp(site->name, name)) continue;
+    void *p = (void*)(uintptr_t)site->addr;
+    uint32_t bit = 1UL << (n & 31);
+    if (n >= GDB_SITES) {
+      // no bit to remember it by
+      if (! on) continue;
+      debug_undoSites(before);
+      return -1;
+    }
+    if (! on) {
+      if (debug_sites_on[n >> 5] & bit) {
+        debug_clearBreakpoint(p);
+        debug_sites_on[n >> 5] &= ~bit;
+      }
+    }
+    else if ((debug_sites_on[n >> 5] & bit) == 0 && debug_isBreakpoint(p) <= 0) {
+      if (debug_setBreakpoint(p)) {
+        debug_undoSites(before);
+        return -1;
+      }
+      debug_sites_on[n >> 5] |= bit;
+    }
+    count++;
+  }
+  return count ? count : -1;
 }
 
-int hcdebug_isBreakpoint(int n) {
-  return hc_breakpoint_enabled[n];
+#if GDB_RELOC_POOL
+
+/**
+ * @brief Breakpoints in flash functions that relocate.cpp copied to RAM.
+ * Each one is a software breakpoint in the copy; calls go to the copy
+ * only while it holds at least one.
+ * 
+ */
+
+int reloc_enabled = 0;
+
+int rldebug_clearBreakpoint(int n, void *copy) {
+  if (swdebug_clearBreakpoint(copy)) return -1;
+  if (--reloc_functions[n].breakpoints == 0) {
+    reloc_redirect(n, 0);
+  }
+  return 0;
 }
 
-void hcdebug_tripBreakpoint(int n) {
-  hc_breakpoint_trip = n;
+int rldebug_setBreakpoint(int n, void *copy) {
+  if (swdebug_isBreakpoint(copy)) return 0;
+  if (swdebug_setBreakpoint(copy)) return -1;
+  if (reloc_functions[n].breakpoints++ == 0) {
+    if (reloc_redirect(n, 1)) {
+      rldebug_clearBreakpoint(n, copy);
+      return -1;
+    }
+  }
+  return 0;
 }
 
+#endif
+
 /**
  * Wrapper functions that call corresponding breakpoint functions.
  * 
@@ -282,12 +844,10 @@ void hcdebug_tripBreakpoint(int n) {
  * 
  */
 void debug_initBreakpoints() {
-  for(int i=0; i<sw_breakpoint_count; i++) {
+  for(int i=0; i<SW_BREAKPOINT_SLOTS; i++) {
     sw_breakpoint_addr[i] = 0;
   }
-  for(int i=0; i<hc_breakpoint_count; i++) {
-    hc_breakpoint_enabled[i] = 0;
-  }
+  sw_breakpoint_used = 0;
 #ifdef HAS_FP_MAP
   hwdebug_clearAllBreakpoints();
 #endif
@@ -304,12 +864,23 @@ void debug_initBreakpoints() {
 int debug_clearBreakpoint(void *p) {
   // Serial.print("clear ");Serial.println((int)p,HEX);
   if (p >= RAM_START && p <= RAM_END) {
+#if GDB_RELOC_POOL
+    int n = reloc_findCopy((uint32_t)(uintptr_t)p);
+    if (n >= 0) return rldebug_clearBreakpoint(n, p);
+#endif
     return swdebug_clearBreakpoint(p);
   }
   // else if (p < (void*)0xF) {
   //   return hcdebug_clearBreakpoint((int)p);
   // }
   else {
+#if GDB_DEBUGMON
+    if (dmdebug_isBreakpoint(p)) return dmdebug_clearBreakpoint(p);
+#endif
+#if GDB_RELOC_POOL
+    int n = reloc_find((uint32_t)(uintptr_t)p);
+    if (n >= 0) return rldebug_clearBreakpoint(n, (void*)reloc_toCopy((uint32_t)(uintptr_t)p));
+#endif
 #ifdef HAS_FP_MAP
     return hwdebug_clearBreakpoint(p);    
 #else
@@ -328,12 +899,30 @@ int debug_clearBreakpoint(void *p) {
 int debug_setBreakpoint(void *p) {
   // Serial.print("set ");Serial.println((int)p,HEX);
   if (p >= RAM_START && p <= RAM_END) {
+#if GDB_RELOC_POOL
+    int n = reloc_findCopy((uint32_t)(uintptr_t)p);
+    if (n >= 0) return rldebug_setBreakpoint(n, p);
+#endif
     return swdebug_setBreakpoint(p);
   }
   // else if (p < (void*)0xF) {
   //   return hcdebug_setBreakpoint((int)p);
   // }
   else {
+#if GDB_RELOC_POOL
+    // a function whose calls already go to its copy takes more for free
+    int n = reloc_find((uint32_t)(uintptr_t)p);
+    if (n >= 0 && reloc_functions[n].breakpoints) {
+      return rldebug_setBreakpoint(n, (void*)reloc_toCopy((uint32_t)(uintptr_t)p));
+    }
+#endif
+#if GDB_DEBUGMON
+    if (dmdebug_setBreakpoint(p) == 0) return 0;
+#endif
+#if GDB_RELOC_POOL
+    n = reloc_enabled ? reloc_create((uint32_t)(uintptr_t)p) : -1;
+    if (n >= 0) return rldebug_setBreakpoint(n, (void*)reloc_toCopy((uint32_t)(uintptr_t)p));
+#endif
 #ifdef HAS_FP_MAP
     return hwdebug_setBreakpoint(p);    
 #else
@@ -356,6 +945,12 @@ int debug_isBreakpoint(void *p) {
   //   return hcdebug_isBreakpoint((int)p);
   // }
   else {
+#if GDB_DEBUGMON
+    if (dmdebug_isBreakpoint(p)) return 1;
+#endif
+#if GDB_RELOC_POOL
+    if (reloc_find((uint32_t)(uintptr_t)p) >= 0) return swdebug_isBreakpoint((void*)reloc_toCopy((uint32_t)(uintptr_t)p));
+#endif
 #ifdef HAS_FP_MAP
     return hwdebug_isBreakpoint(p);    
 #else
@@ -364,41 +959,688 @@ int debug_isBreakpoint(void *p) {
   }
 }
 
-/*
- * Breakpoint handlers
+/**
+ * @brief Hit counters and ignore counts, kept by address so they survive
+ * GDB taking breakpoints out and putting them back at every stop. A
+ * breakpoint with an ignore count carries on from debug_monitor() by
+ * displaced stepping, without a round trip to GDB.
  * 
- * During a breakpoint:
- * 1. The interrupt is initiated and registers are saved.
- * 2. The breakpoint instruction is replaced with the original code.
- * 3. The handler callback is called.
- * 4. A new temporary breakpoint is put in the next instruction.
- * 5. Execution continues and breaks at next instruction.
- * 6. The temporary breakpoint is replaced with origianl code.
- * 7. The original breakpoint is restored.
- * 8. Execution continues.
  */
 
-// breakpoint handler pointer
-void (*callback)() = NULL;
+debug_hits_struct debug_hits[GDB_HIT_COUNTS];
+
+// entry for addr; if create, a free one is taken when there is none, and
+// if create is 2 and none is free, the plain hit counter (no ignore
+// count) with the fewest hits gives way
+static int debug_findHits(uint32_t addr, int create) {
+  int free = -1;
+  int spare = -1;
+  for (int i=0; i<GDB_HIT_COUNTS; i++) {
+    if (debug_hits[i].addr == addr) return i;
+    if (debug_hits[i].addr == 0 && free < 0) free = i;
+    if (debug_hits[i].ignore == 0 && (spare < 0 || debug_hits[i].hits < debug_hits[spare].hits)) spare = i;
+  }
+  if (free < 0 && create == 2) free = spare;
+  if (create && free >= 0) {
+    debug_hits[free].addr = addr;
+    debug_hits[free].hits = 0;
+    debug_hits[free].ignore = 0;
+  }
+  return create ? free : -1;
+}
 
-// Counter for debugging; counts number of breakpoint calls
-int debugcount = 0;
+/**
+ * @brief Count a hit of a breakpoint
+ * 
+ * @param addr Location of the breakpoint; may be in a relocated copy
+ * @param stepping A GDB step ended here; it stops regardless
+ * @return int 1 = the hit is ignored and the program carries on
+ */
+static int debug_countHit(uint32_t addr, int stepping) {
+#if GDB_RELOC_POOL
+  addr = reloc_toOriginal(addr);
+#endif
+  int n = debug_findHits(addr, 1);
+  if (n < 0) return 0;
+  debug_hits[n].hits++;
+  if (stepping || debug_hits[n].ignore == 0) return 0;
+  debug_hits[n].ignore--;
+  return 1;
+}
 
-// Debug system is enabled?
-int debugenabled = 0;
+/**
+ * @brief Go past the next hits of a breakpoint without stopping
+ * 
+ * @param p Pointer to location of breakpoint
+ * @param count Number of hits to ignore; 0 stops at the next one
+ * @return int 0 = success; -1 = every counter has an ignore count
+ */
+int debug_ignoreBreakpoint(void *p, uint32_t count) {
+  // every hit takes a counter, so an ignore count may need one back
+  int n = debug_findHits(((uint32_t)(uintptr_t)p) & ADDRESS_MASK, 2);
+  if (n < 0) return -1;
+  debug_hits[n].ignore = count;
+  return 0;
+}
 
-// Are we in a breakpoint or step instruction?
-int debugstep = 0;
+/**
+ * @brief Times a breakpoint has been reached
+ * 
+ * @param p Pointer to location of breakpoint
+ * @return uint32_t Hits, including ignored ones
+ */
+uint32_t debug_breakpointHits(void *p) {
+  int n = debug_findHits(((uint32_t)(uintptr_t)p) & ADDRESS_MASK, 0);
+  return n < 0 ? 0 : debug_hits[n].hits;
+}
 
-// Restore registers before returning?
-int debugrestore = 0;
+/**
+ * @brief Forget all hit counters and ignore counts
+ * 
+ */
+void debug_clearHits() {
+  for (int i=0; i<GDB_HIT_COUNTS; i++) {
+    debug_hits[i].addr = 0;
+  }
+}
 
-// Pretty names for breakpoint and fault types
-const char *hard_fault_debug_text[] = {
-  "debug", "break", "nmi", "hard", "mem", "bus", "usage"
-};
+// Cycle counter when the debugger was entered, and when it handed back
+// to the program (extras/bench/trapbench reads both)
+uint32_t debug_trap_cycles;
+uint32_t debug_resume_cycles;
 
-// The interrupt call
+#if GDB_STOPWATCHES
+
+/**
+ * @brief Stopwatches. Each is a pair of breakpoints: reaching the start
+ * notes the cycle counter and reaching the stop adds the cycles since
+ * then to the statistics. Neither stops the program; both carry on by
+ * displaced stepping. The time includes the exception at each end, a
+ * fixed cost that a pair on two adjacent instructions shows. With the
+ * same address for both, each hit times the loop since the last one.
+ * 
+ */
+
+debug_stopwatch_struct debug_stopwatches[GDB_STOPWATCHES];
+
+// how many stopwatch ends are at addr
+static int debug_stopwatchUses(uint32_t addr) {
+  int uses = 0;
+  for (int i=0; i<GDB_STOPWATCHES; i++) {
+    if (debug_stopwatches[i].start == addr) uses++;
+    if (debug_stopwatches[i].stop == addr) uses++;
+  }
+  return uses;
+}
+
+/**
+ * @brief Zero the statistics of a stopwatch
+ * 
+ * @param n Stopwatch number
+ */
+void debug_resetStopwatch(int n) {
+  debug_stopwatch_struct *sw = &debug_stopwatches[n];
+  sw->running = 0;
+  sw->count = 0;
+  sw->min = 0xFFFFFFFF;
+  sw->max = 0;
+  sw->total = 0;
+  memset(sw->histogram, 0, sizeof(sw->histogram));
+}
+
+/**
+ * @brief Start a stopwatch between two locations
+ * 
+ * @param start Location that starts it
+ * @param stop Location that stops it and records the time
+ * @return int Stopwatch number; -1 if none is free or a breakpoint can't be set
+ */
+int debug_setStopwatch(void *start, void *stop) {
+  uint32_t a = ((uint32_t)(uintptr_t)start) & ADDRESS_MASK;
+  uint32_t b = ((uint32_t)(uintptr_t)stop) & ADDRESS_MASK;
+  int n;
+  for (n=0; n<GDB_STOPWATCHES; n++) {
+    if (debug_stopwatches[n].start == 0) break;
+  }
+  if (n == GDB_STOPWATCHES || a == 0 || b == 0) return -1;
+
+  if (debug_setBreakpoint((void*)a)) return -1;
+  if (debug_setBreakpoint((void*)b)) {
+    if (debug_stopwatchUses(a) == 0) debug_clearBreakpoint((void*)a);
+    return -1;
+  }
+  debug_resetStopwatch(n);
+  debug_stopwatches[n].start = a;
+  debug_stopwatches[n].stop = b;
+  return n;
+}
+
+/**
+ * @brief Remove a stopwatch and its breakpoints
+ * 
+ * @param n Stopwatch number
+ * @return int 0 = success; -1 = no such stopwatch
+ */
+int debug_clearStopwatch(int n) {
+  if (n < 0 || n >= GDB_STOPWATCHES || debug_stopwatches[n].start == 0) return -1;
+  uint32_t a = debug_stopwatches[n].start;
+  uint32_t b = debug_stopwatches[n].stop;
+  debug_stopwatches[n].start = 0;
+  debug_stopwatches[n].stop = 0;
+  if (debug_stopwatchUses(a) == 0) debug_clearBreakpoint((void*)a);
+  if (b != a && debug_stopwatchUses(b) == 0) debug_clearBreakpoint((void*)b);
+  return 0;
+}
+
+/**
+ * @brief Stop and start the stopwatches at a breakpoint
+ * 
+ * @param addr Location of the breakpoint; may be in a relocated copy
+ * @return int 1 = it belongs to a stopwatch and the program carries on
+ */
+static int debug_stopwatchHit(uint32_t addr) {
+#if GDB_RELOC_POOL
+  addr = reloc_toOriginal(addr);
+#endif
+  int found = 0;
+  for (int i=0; i<GDB_STOPWATCHES; i++) {
+    debug_stopwatch_struct *sw = &debug_stopwatches[i];
+    if (sw->start == 0) continue;
+    if (addr == sw->stop && sw->running) {
+      uint32_t t = debug_trap_cycles - sw->started;
+      sw->running = 0;
+      sw->count++;
+      sw->total += t;
+      if (t < sw->min) sw->min = t;
+      if (t > sw->max) sw->max = t;
+      sw->histogram[31 - __builtin_clz(t | 1)]++;
+    }
+    if (addr == sw->start) {
+      sw->running = 2; // the time is taken on the way out
+    }
+    if (addr == sw->start || addr == sw->stop) found = 1;
+  }
+  return found;
+}
+
+// start the stopwatches just started, as late as possible
+static void debug_stopwatchStart() {
+  uint32_t now = DEBUG_CYCLES();
+  for (int i=0; i<GDB_STOPWATCHES; i++) {
+    if (debug_stopwatches[i].running == 2) {
+      debug_stopwatches[i].started = now;
+      debug_stopwatches[i].running = 1;
+    }
+  }
+}
+
+#endif // GDB_STOPWATCHES
+
+/**
+ * @brief Data watchpoints on the DWT comparators (Teensy 4). A matching
+ * access raises DebugMonitor once the instruction has completed, so the
+ * stop is just after the access. Ranges that aren't a power of two long
+ * and aligned are rounded out to the smallest block that is, since the
+ * DWT can only ignore low address bits; accesses next to the range may
+ * then stop too.
+ * 
+ */
+
+#if GDB_DEBUGMON
+
+#define DWT_COMP(n)     (((volatile uint32_t*)0xE0001020)[(n)*4])
+#define DWT_MASK(n)     (((volatile uint32_t*)0xE0001024)[(n)*4])
+#define DWT_FUNCTION(n) (((volatile uint32_t*)0xE0001028)[(n)*4])
+#define DWT_CTRL_NUMCOMP(x) (((x) >> 28) & 0xF)
+#define DWT_FUNCTION_MATCHED (1 << 24)
+
+#define DWT_MAX 4
+
+uint32_t dwt_addr[DWT_MAX];
+uint32_t dwt_len[DWT_MAX];
+uint8_t dwt_type[DWT_MAX];     // GDB type 2, 3 or 4; 0 = free
+
+// DWT_FUNCTION for GDB types 2 (write), 3 (read) and 4 (access)
+const uint8_t dwt_function[] = { 0, 0, 0b0110, 0b0101, 0b0111 };
+
+// watchpoint that stopped the program, for the stop reply
+int watch_hit_type = 0;
+uint32_t watch_hit_addr = 0;
+
+int dwt_count() {
+  int n = DWT_CTRL_NUMCOMP(ARM_DWT_CTRL);
+  return n > DWT_MAX ? DWT_MAX : n;
+}
+
+/**
+ * @brief Note which watchpoint fired; reading DWT_FUNCTION clears MATCHED
+ */
+void dwt_matched() {
+  for (int n=0; n<dwt_count(); n++) {
+    if ((DWT_FUNCTION(n) & DWT_FUNCTION_MATCHED) && dwt_type[n]) {
+      watch_hit_type = dwt_type[n];
+      watch_hit_addr = dwt_addr[n];
+    }
+  }
+}
+
+/**
+ * @brief Program a free DWT comparator
+ */
+int dwt_set(uint32_t addr, int len, int type) {
+  int free = -1;
+  for (int n=dwt_count()-1; n>=0; n--) {
+    if (dwt_type[n] == 0) free = n;
+  }
+  if (free < 0) return -1;
+
+  // smallest aligned power of two block holding the range
+  int mask = 0;
+  while ((addr >> mask) != ((addr + len - 1) >> mask)) mask++;
+  DWT_MASK(free) = mask;
+  if (DWT_MASK(free) != (uint32_t)mask) { // larger than this DWT supports
+    DWT_MASK(free) = 0;
+    return -1;
+  }
+  DWT_COMP(free) = addr & ~((1 << mask) - 1);
+  DWT_FUNCTION(free) = dwt_function[type];
+  dwt_addr[free] = addr;
+  dwt_len[free] = len;
+  dwt_type[free] = type;
+  return 0;
+}
+
+int dwt_find(uint32_t addr, int len, int type) {
+  for (int n=0; n<dwt_count(); n++) {
+    if (dwt_type[n] == type && dwt_addr[n] == addr && dwt_len[n] == (uint32_t)len) return n;
+  }
+  return -1;
+}
+
+void dwt_clear(int n) {
+  DWT_FUNCTION(n) = 0;
+  DWT_MASK(n) = 0;
+  dwt_type[n] = 0;
+}
+
+/**
+ * @brief Data watchpoints on spare MPU regions (Teensy 4), for buffers
+ * and structs larger than the DWT covers well. The region is made
+ * read-only (write watch) or inaccessible (access watch), and the
+ * MemManage fault stops the program before the access, with pc at the
+ * instruction, which is what GDB expects on ARM. Accesses that only
+ * fault because the region had to be rounded out go ahead without a
+ * stop: the region is lifted for one hardware step and then restored.
+ * Accesses from interrupt handlers can't be stopped or stepped there,
+ * so they lift the region for good.
+ * 
+ * The K66 (Teensy 3.6) has NXP's system MPU rather than the ARM one,
+ * so this is Teensy 4 only.
+ * 
+ */
+
+#define MPU_RNR (*(volatile uint32_t*)0xE000ED98)
+#define MPU_TYPE_DREGION(x) (((x) >> 8) & 0xFF)
+#define MPU_RASR_ATTR    0x103F0000   // XN, TEX, S, C, B
+#define MPU_RASR_AP_RO   (6 << 24)
+#define MPU_RASR_AP_NONE (0 << 24)
+#define MPU_RASR_TEX_NORMAL (1 << 19) // normal, non-cacheable
+#define MMFSR_DACCVIOL   (1 << 1)
+#define MMFSR_MSTKERR    (1 << 4)
+#define MMFSR_MLSPERR    (1 << 5)
+#define MMFSR_MMARVALID  (1 << 7)
+#define IPSR_MASK 0x1FF
+
+// regions used, counting down from the last one: watchpoints, then
+// stack guards
+#define MPU_WATCH_MAX 2
+#define MPU_GUARD_MAX 3
+
+uint32_t mpu_addr[MPU_WATCH_MAX];
+uint32_t mpu_len[MPU_WATCH_MAX];
+uint8_t mpu_type[MPU_WATCH_MAX];    // GDB type 2 or 4; 0 = free
+uint32_t mpu_base[MPU_WATCH_MAX];   // block the region covers
+uint32_t mpu_bits[MPU_WATCH_MAX];   // log2 of its size
+uint32_t mpu_rasr[MPU_WATCH_MAX];
+
+// region lifted to let one instruction through, or -1
+int mpu_stepover = -1;
+// region lifted for a stop; restored with a step when execution resumes
+int mpu_stopped = -1;
+
+// faulting instruction and address of the last MPU watchpoint hit
+uint32_t mpu_hit_pc = 0;
+uint32_t mpu_hit_addr = 0;
+
+static int mpu_region(int n) {
+  return MPU_TYPE_DREGION(SCB_MPU_TYPE) - 1 - n;
+}
+
+/**
+ * @brief Memory attributes at addr, taken from the highest region that
+ * holds it so caching doesn't change while it is watched
+ */
+static uint32_t mpu_attributes(uint32_t addr) {
+  for (int r = MPU_TYPE_DREGION(SCB_MPU_TYPE) - 1 - MPU_WATCH_MAX - MPU_GUARD_MAX; r >= 0; r--) {
+    MPU_RNR = r;
+    uint32_t rasr = SCB_MPU_RASR;
+    if ((rasr & 1) == 0) continue;
+    uint32_t bits = ((rasr >> 1) & 0x1F) + 1;
+    uint32_t base = SCB_MPU_RBAR & ~0x1F;
+    if (bits == 32 || ((addr - base) >> bits) == 0) {
+      return rasr & MPU_RASR_ATTR;
+    }
+  }
+  return MPU_RASR_TEX_NORMAL;
+}
+
+static void mpu_program(int region, uint32_t base, uint32_t rasr) {
+  SCB_MPU_RBAR = base | SCB_MPU_RBAR_VALID | region;
+  SCB_MPU_RASR = rasr;
+  asm volatile("dsb \n isb");
+}
+
+static void mpu_write(int n, uint32_t rasr) {
+  mpu_program(mpu_region(n), mpu_base[n], rasr);
+}
+
+int mpu_set(uint32_t addr, int len, int type) {
+  if (type == 3) return -1; // can't tell reads from writes
+  if (MPU_TYPE_DREGION(SCB_MPU_TYPE) < 8) return -1;
+  int n;
+  for (n=0; n<MPU_WATCH_MAX && mpu_type[n]; n++) ;
+  if (n == MPU_WATCH_MAX) return -1;
+
+  // smallest aligned power of two block of at least 32 bytes
+  uint32_t bits = 5;
+  while (bits < 32 && (addr >> bits) != ((addr + len - 1) >> bits)) bits++;
+  if (bits >= 32) return -1;
+  uint32_t base = addr & ~((1 << bits) - 1);
+  // blocks of 256 bytes and more are in 8 subregions; leave out the
+  // ones the range doesn't touch
+  uint32_t srd = 0;
+  if (bits >= 8) {
+    uint32_t sub = 1 << (bits - 3);
+    for (int i=0; i<8; i++) {
+      uint32_t lo = base + i * sub;
+      if (lo + sub <= addr || lo >= addr + len) srd |= 1 << i;
+    }
+  }
+
+  mpu_addr[n] = addr;
+  mpu_len[n] = len;
+  mpu_type[n] = type;
+  mpu_base[n] = base;
+  mpu_bits[n] = bits;
+  mpu_rasr[n] = mpu_attributes(addr) | (type == 2 ? MPU_RASR_AP_RO : MPU_RASR_AP_NONE) |
+    (srd << 8) | ((bits - 1) << 1) | SCB_MPU_RASR_ENABLE;
+  SCB_SHCSR |= SCB_SHCSR_MEMFAULTENA;
+  mpu_write(n, mpu_rasr[n]);
+  return 0;
+}
+
+int mpu_find(uint32_t addr, int len, int type) {
+  for (int n=0; n<MPU_WATCH_MAX; n++) {
+    if (mpu_type[n] == type && mpu_addr[n] == addr && mpu_len[n] == (uint32_t)len) return n;
+  }
+  return -1;
+}
+
+void mpu_clear(int n) {
+  mpu_write(n, 0);
+  mpu_type[n] = 0;
+  if (mpu_stepover == n) mpu_stepover = -1;
+  if (mpu_stopped == n) mpu_stopped = -1;
+}
+
+/**
+ * @brief Called by DebugMonitor after a step; restores a lifted region
+ */
+void mpu_stepped() {
+  if (mpu_stepover >= 0) {
+    mpu_write(mpu_stepover, mpu_rasr[mpu_stepover]);
+    mpu_stepover = -1;
+  }
+}
+
+/**
+ * @brief Called when the program resumes after a stop; lets the
+ * watched access through and then restores the region
+ */
+void mpu_resume() {
+  if (mpu_stopped >= 0) {
+    mpu_stepover = mpu_stopped;
+    mpu_stopped = -1;
+    ARM_DEMCR |= DEMCR_MON_STEP;
+  }
+}
+
+/**
+ * @brief Stack guards (Teensy 4, GDB_STACK_GUARD). A no-access MPU
+ * region at the bottom of the main stack, and of thread stacks given to
+ * debug.stackGuard(), turns an overflow into a MemManage fault before
+ * it damages .bss or the heap, at no cost per call. The fault handler
+ * moves to a stack of its own, so the debugger doesn't run on the
+ * overflowed one, and the stop reports the pc and sp.
+ * 
+ * An overflow can't be resumed. When the push that overflowed leaves
+ * the exception frame inside the guard too, the hardware can't save the
+ * registers there; the pc is then only known if its slot in the frame
+ * was above the guard, and is reported as 0 otherwise.
+ * 
+ */
+
+#if GDB_STACK_GUARD
+
+extern unsigned long _ebss;   // end of .bss; bottom of the main stack
+
+uint32_t mpu_guard_base[MPU_GUARD_MAX];   // 0 = free
+
+// overflow that stopped the program
+int mpu_overflow = 0;
+uint32_t mpu_overflow_pc = 0;
+uint32_t mpu_overflow_sp = 0;
+
+// stacks for the MemManage handler and for the debugger after an overflow
+uint32_t mpu_fault_stack[64] __attribute__((aligned(8)));
+uint32_t mpu_rescue_stack[GDB_STACK_RESCUE / 4] __attribute__((aligned(8)));
+uint32_t *mpu_fault_top = mpu_fault_stack + 64;
+uint32_t mpu_rescue_exc_return;
+
+static int mpu_in_guard(uint32_t addr) {
+  for (int n=0; n<MPU_GUARD_MAX; n++) {
+    if (mpu_guard_base[n] && addr - mpu_guard_base[n] < GDB_STACK_GUARD) return 1;
+  }
+  return 0;
+}
+
+#endif // GDB_STACK_GUARD
+
+#endif // GDB_DEBUGMON
+
+/**
+ * @brief Add or remove the guard at the bottom of a stack
+ * 
+ * @param bottom Lowest address of the stack; the guard is the first
+ * GDB_STACK_GUARD aligned bytes from there
+ * @param on 1 = add, 0 = remove (before the stack is freed)
+ * @return int 0 = success; -1 = no free MPU region or not supported
+ */
+int debug_stackGuard(void *bottom, int on) {
+#if GDB_STACK_GUARD
+  uint32_t base = ((uint32_t)bottom + GDB_STACK_GUARD - 1) & ~(GDB_STACK_GUARD - 1);
+  int free = -1;
+  for (int n=MPU_GUARD_MAX-1; n>=0; n--) {
+    if (mpu_guard_base[n] == base) {
+      if (! on) {
+        mpu_program(mpu_region(MPU_WATCH_MAX + n), base, 0);
+        mpu_guard_base[n] = 0;
+      }
+      return 0;
+    }
+    if (mpu_guard_base[n] == 0) free = n;
+  }
+  if (! on) return -1;
+  if (free < 0 || MPU_TYPE_DREGION(SCB_MPU_TYPE) < 8) return -1;
+  int region = mpu_region(MPU_WATCH_MAX + free);
+  MPU_RNR = region;
+  if (SCB_MPU_RASR & SCB_MPU_RASR_ENABLE) return -1; // the core uses it
+  mpu_guard_base[free] = base;
+  SCB_SHCSR |= SCB_SHCSR_MEMFAULTENA;
+  mpu_program(region, base, SCB_MPU_RASR_XN | MPU_RASR_TEX_NORMAL | MPU_RASR_AP_NONE |
+    ((__builtin_ctz(GDB_STACK_GUARD) - 1) << 1) | SCB_MPU_RASR_ENABLE);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief Overflow that stopped the program, if any
+ * 
+ * @param pc Set to the instruction that overflowed, or 0 if unknown
+ * @param sp Set to the stack pointer when it did
+ * @return int 1 = stopped by a stack guard; 0 = not
+ */
+int debug_stackOverflow(uint32_t *pc, uint32_t *sp) {
+#if GDB_STACK_GUARD
+  if (mpu_overflow) {
+    *pc = mpu_overflow_pc;
+    *sp = mpu_overflow_sp;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * @brief Set a data watchpoint. Ranges that the DWT covers exactly or
+ * that are small go to the DWT; others go to the MPU when a region is
+ * free, since the MPU lets accesses next to the range through without
+ * stopping.
+ * 
+ * @param p Start of the watched data
+ * @param len Number of bytes
+ * @param type 2 = write, 3 = read, 4 = read or write (as in GDB's Z packet)
+ * @return int 0 = success; -1 = failure
+ */
+int debug_setWatchpoint(void *p, int len, int type) {
+#if GDB_DEBUGMON
+  if (! debugmon_enabled || type < 2 || type > 4 || len <= 0) return -1;
+  uint32_t addr = (uint32_t)p;
+  if (dwt_find(addr, len, type) >= 0 || mpu_find(addr, len, type) >= 0) return 0;
+  int exact = (len & (len - 1)) == 0 && (addr & (len - 1)) == 0;
+  if (! exact && len > 4 && mpu_set(addr, len, type) == 0) return 0;
+  if (dwt_set(addr, len, type) == 0) return 0;
+  return mpu_set(addr, len, type);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief Clear a data watchpoint
+ * 
+ * @param p Start of the watched data
+ * @param len Number of bytes
+ * @param type 2, 3 or 4, as given to debug_setWatchpoint
+ * @return int 0 = success; -1 = there wasn't one
+ */
+int debug_clearWatchpoint(void *p, int len, int type) {
+#if GDB_DEBUGMON
+  int n = dwt_find((uint32_t)p, len, type);
+  if (n >= 0) {
+    dwt_clear(n);
+    return 0;
+  }
+  n = mpu_find((uint32_t)p, len, type);
+  if (n >= 0) {
+    mpu_clear(n);
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+/**
+ * @brief Watchpoint that stopped the program
+ * 
+ * @param addr Set to the watched address (DWT) or the address accessed (MPU)
+ * @return int Type (2, 3 or 4) or 0 if the stop wasn't a watchpoint
+ */
+int debug_watchpointHit(uint32_t *addr) {
+#if GDB_DEBUGMON
+  *addr = watch_hit_addr;
+  return watch_hit_type;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * @brief Number of data watchpoints
+ * 
+ * @param used Set to the number in use
+ * @return int Number the hardware has; 0 if they can't be used
+ */
+int debug_watchpointCount(int *used) {
+  *used = 0;
+#if GDB_DEBUGMON
+  if (! debugmon_enabled) return 0;
+  for (int n=0; n<dwt_count(); n++) {
+    if (dwt_type[n]) (*used)++;
+  }
+  for (int n=0; n<MPU_WATCH_MAX; n++) {
+    if (mpu_type[n]) (*used)++;
+  }
+  return dwt_count() + MPU_WATCH_MAX;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Breakpoint handlers
+ * 
+ * During a breakpoint:
+ * 1. The interrupt is initiated and registers are saved.
+ * 2. The breakpoint instruction is replaced with the original code.
+ * 3. The handler callback is called.
+ * 4. A new temporary breakpoint is put in the next instruction.
+ * 5. Execution continues and breaks at next instruction.
+ * 6. The temporary breakpoint is replaced with origianl code.
+ * 7. The original breakpoint is restored.
+ * 8. Execution continues.
+ */
+
+// breakpoint handler pointer
+void (*callback)() = NULL;
+
+// Counter for debugging; counts number of breakpoint calls
+int debugcount = 0;
+
+// Debug system is enabled?
+int debugenabled = 0;
+
+// Are we in a breakpoint or step instruction? 2 = continue one recorded
+// step at a time
+int debugstep = 0;
+
+// Restore registers before returning?
+int debugrestore = 0;
+
+// IRQ_DEBUG holds the program's registers in save_registers, from
+// saving them to putting them back; nothing else may save over them
+volatile int debug_serving = 0;
+
+#if GDB_FEATURE_SERIAL_DIAG
+// Pretty names for breakpoint and fault types
+const char *hard_fault_debug_text[] = {
+  "debug", "break", "nmi", "hard", "mem", "bus", "usage"
+};
+#endif
+
+// The interrupt call
 // 0 = breakpoint
 // 1 = nmi
 // 2 = hard fault, etc.
@@ -407,6 +1649,17 @@ uint32_t debug_id = 0;
 // Debug tracing - not used by code
 int debug_trace = 0;
 
+// GDB sent Ctrl-C and the program hasn't stopped yet
+volatile int debug_break_request = 0;
+
+// cycles from Ctrl-C to the stop
+debug_patch_stats_struct debug_interrupt_stats;
+static uint32_t debug_break_cycles;
+
+// Why the DebugMonitor stopped; 0 for SVC breakpoints and faults, 2 for
+// an FPB breakpoint and 1 for anything else
+int debug_event = 0;
+
 // Copy of the registers at breakpoint
 struct save_registers_struct {
   uint32_t r0;
@@ -444,222 +1697,793 @@ struct stack_isr {
 // return address and other things
 struct stack_isr *stack;
 
+// EXC_RETURN of the stop; bit 4 clear if the frame has room for FP state
+uint32_t debug_exc_return;
+
+#if GDB_FEATURE_SERIAL_DIAG
+/**
+ * @brief Display registers for debugging of the debugger
+ * 
+ */
+void print_registers() {
+  Serial.print("r0=");Serial.println(save_registers.r0);
+  Serial.print("r1=");Serial.println(save_registers.r1);
+  Serial.print("r2=");Serial.println(save_registers.r2);
+  Serial.print("r3=");Serial.println(save_registers.r3);
+  Serial.print("r12=");Serial.println(save_registers.r12);
+  Serial.print("lr=0x");Serial.println(save_registers.lr, HEX);
+  Serial.print("pc=0x");Serial.println(save_registers.pc, HEX);
+  Serial.print("r4=");Serial.println(save_registers.r4);
+  Serial.print("r5=");Serial.println(save_registers.r5);
+  Serial.print("r6=");Serial.println(save_registers.r6);
+  Serial.print("r7=");Serial.println(save_registers.r7);
+  Serial.print("r8=");Serial.println(save_registers.r8);
+  Serial.print("r9=");Serial.println(save_registers.r9);
+  Serial.print("r10=");Serial.println(save_registers.r10);
+  Serial.print("r11=");Serial.println(save_registers.r11);
+  Serial.print("sp=0x");Serial.println(save_registers.sp,HEX);
+}
+#endif
+
+/**
+ * @brief Default debug callback
+ * 
+ */
+void debug_action() {
+#if GDB_FEATURE_SERIAL_DIAG
+  Serial.println("****DEBUG");
+  print_registers();
+  Serial.println("****");
+#endif
+}
+
+// Saved address to restore original breakpoint
+uint32_t debugreset = 0;
+uint32_t temp_breakpoint = 0;
+
+/**
+ * @brief Set a breakpoint used for stepping. These never relocate a
+ * flash function: the code being stepped is already running, so
+ * redirecting new calls wouldn't make it stop.
+ * 
+ * @param p Pointer to location
+ * @return int 0 = success; -1 = failure
+ */
+int debug_setTempBreakpoint(void *p) {
+#if GDB_RELOC_POOL
+  if (! (p >= RAM_START && p <= RAM_END)) return -1;
+#endif
+  return debug_setBreakpoint(p);
+}
+
+/**
+ * @brief Breakpoints, watchpoints and stopwatches kept in RAM that the
+ * startup code doesn't clear, so that a reset from GDB ('monitor
+ * restart', 'R', 'k') keeps them and debug_init() puts them back before
+ * setup() runs. The copy is made when the program resumes after a stop,
+ * because GDB takes its breakpoints out while it is stopped. The
+ * checksum starts from where this code was linked, so neither power-on
+ * garbage nor the tables of another build are used.
+ * 
+ */
+
+#if GDB_PERSIST_BREAKPOINTS
+
+#if defined(GDB_HOST_SIM)
+#define DEBUG_NOINIT
+#elif defined(__IMXRT1062__)
+// OCRAM (DMAMEM); the startup code only clears DTCM
+#define DEBUG_NOINIT __attribute__((section(".dmabuffers"), used))
+#else
+#define DEBUG_NOINIT __attribute__((section(".noinit"), used))
+#endif
+
+#if GDB_DEBUGMON
+#define PERSIST_WATCHES (DWT_MAX + MPU_WATCH_MAX)
+#else
+#define PERSIST_WATCHES 1
+#endif
+
+#define PERSIST_STOPWATCHES (GDB_STOPWATCHES ? GDB_STOPWATCHES : 1)
+
+// all words, so there is no padding outside the checksum
+struct debug_persist_struct {
+  uint32_t breaks[GDB_PERSIST_BREAKPOINTS];   // original addresses; 0 = free
+  uint32_t watch_addr[PERSIST_WATCHES];
+  uint32_t watch_len[PERSIST_WATCHES];
+  uint32_t watch_type[PERSIST_WATCHES];       // 0 = free
+  uint32_t stopwatch_start[PERSIST_STOPWATCHES];
+  uint32_t stopwatch_stop[PERSIST_STOPWATCHES];
+  uint32_t sites_on[(GDB_SITES + 31) / 32];   // debug_sites_on
+  uint32_t check;
+};
+
+debug_persist_struct debug_persist DEBUG_NOINIT;
+
+static uint32_t debug_persistCheck() {
+  uint32_t sum = (uint32_t)(uintptr_t)&debug_persistCheck;
+  const uint32_t *w = (const uint32_t *)&debug_persist;
+  for (size_t i=0; i<offsetof(debug_persist_struct, check) / 4; i++) {
+    sum = ((sum << 5) | (sum >> 27)) ^ w[i];
+  }
+  return ~sum;
+}
+
+// note a breakpoint unless it is only there for stepping or a stopwatch
+static void debug_persistBreak(uint32_t addr, int *n) {
+#if GDB_RELOC_POOL
+  addr = reloc_toOriginal(addr);
+#endif
+  if (addr == temp_breakpoint || *n >= GDB_PERSIST_BREAKPOINTS) return;
+#if GDB_STOPWATCHES
+  if (debug_stopwatchUses(addr)) return;
+#endif
+  for (int i=0; i<*n; i++) {
+    if (debug_persist.breaks[i] == addr) return;
+  }
+  debug_persist.breaks[(*n)++] = addr;
+}
+
+/**
+ * @brief Copy the breakpoint, watchpoint and stopwatch tables to RAM
+ * that survives a reset
+ */
+void debug_persistSave() {
+  memset(&debug_persist, 0, sizeof(debug_persist));
+  int n = 0;
+  // RAM code, including copies of relocated flash functions
+  for (int i=0; i<SW_BREAKPOINT_SLOTS; i++) {
+    if (sw_breakpoint_addr[i]) debug_persistBreak(sw_breakpoint_addr[i], &n);
+  }
+#if GDB_DEBUGMON
+  for (int i=0; i<fpb_count; i++) {
+    if (fpb_kind[i] == FPB_BREAK) debug_persistBreak(fpb_addr[i], &n);
+  }
+  int w = 0;
+  for (int i=0; i<dwt_count(); i++) {
+    if (dwt_type[i] == 0) continue;
+    debug_persist.watch_addr[w] = dwt_addr[i];
+    debug_persist.watch_len[w] = dwt_len[i];
+    debug_persist.watch_type[w++] = dwt_type[i];
+  }
+  for (int i=0; i<MPU_WATCH_MAX; i++) {
+    if (mpu_type[i] == 0) continue;
+    debug_persist.watch_addr[w] = mpu_addr[i];
+    debug_persist.watch_len[w] = mpu_len[i];
+    debug_persist.watch_type[w++] = mpu_type[i];
+  }
+#endif
+#ifdef HAS_FP_MAP
+  for (int i=1; i<6; i++) {
+    if (hw_breakpoints[i]) debug_persistBreak((uint32_t)hw_breakpoints[i], &n);
+  }
+#endif
+#if GDB_STOPWATCHES
+  for (int i=0; i<GDB_STOPWATCHES; i++) {
+    debug_persist.stopwatch_start[i] = debug_stopwatches[i].start;
+    debug_persist.stopwatch_stop[i] = debug_stopwatches[i].stop;
+  }
+#endif
+  memcpy(debug_persist.sites_on, debug_sites_on, sizeof(debug_sites_on));
+  debug_persist.check = debug_persistCheck();
+#if defined(__IMXRT1062__)
+  // OCRAM is cached write-back and a reset doesn't write it out
+  uint32_t end = (uint32_t)&debug_persist + sizeof(debug_persist);
+  for (uint32_t line = (uint32_t)&debug_persist & ~(CACHE_LINE_SIZE - 1); line < end; line += CACHE_LINE_SIZE) {
+    SCB_CACHE_DCCMVAC = line;
+  }
+  asm volatile("dsb");
+#endif
+}
+
+/**
+ * @brief Forget the saved tables, so the next reset starts clean
+ */
+void debug_persistClear() {
+  debug_persist.check = ~debug_persistCheck();
+#if defined(__IMXRT1062__)
+  SCB_CACHE_DCCMVAC = (uint32_t)&debug_persist.check;
+  asm volatile("dsb");
+#endif
+}
+
+/**
+ * @brief Put back what debug_persistSave() kept before the last reset
+ * 
+ * @return int Number of breakpoints, watchpoints and stopwatches set; 0
+ * if nothing valid was kept
+ */
+int debug_persistRestore() {
+  if (debug_persist.check != debug_persistCheck()) return 0;
+  // copy, as setting them may save again
+  debug_persist_struct kept = debug_persist;
+  int count = 0;
+  for (int i=0; i<GDB_PERSIST_BREAKPOINTS && kept.breaks[i]; i++) {
+    if (debug_setBreakpoint((void*)kept.breaks[i]) == 0) count++;
+  }
+  for (int i=0; i<PERSIST_WATCHES && kept.watch_type[i]; i++) {
+    if (debug_setWatchpoint((void*)kept.watch_addr[i], kept.watch_len[i], kept.watch_type[i]) == 0) count++;
+  }
+#if GDB_STOPWATCHES
+  for (int i=0; i<GDB_STOPWATCHES; i++) {
+    if (kept.stopwatch_start[i] == 0) continue;
+    if (debug_setStopwatch((void*)kept.stopwatch_start[i], (void*)kept.stopwatch_stop[i]) >= 0) count++;
+  }
+#endif
+  // the same build comes back, so the sites are in the same order
+  memcpy(debug_sites_on, kept.sites_on, sizeof(debug_sites_on));
+  return count;
+}
+
+#else
+
+void debug_persistSave() {}
+void debug_persistClear() {}
+int debug_persistRestore() { return 0; }
+
+#endif // GDB_PERSIST_BREAKPOINTS
+
+static uint32_t debug_read(uint32_t addr, int size) {
+  if (size == 1) return *(uint8_t*)addr;
+  if (size == 2) return *(uint16_t*)addr;
+  return *(uint32_t*)addr;
+}
+
+// registers for thumb_nextpc(), with pc at addr
+static void debug_thumbCpu(thumb_cpu *cpu, uint32_t addr) {
+  cpu->r[0] = save_registers.r0;
+  cpu->r[1] = save_registers.r1;
+  cpu->r[2] = save_registers.r2;
+  cpu->r[3] = save_registers.r3;
+  cpu->r[4] = save_registers.r4;
+  cpu->r[5] = save_registers.r5;
+  cpu->r[6] = save_registers.r6;
+  cpu->r[7] = save_registers.r7;
+  cpu->r[8] = save_registers.r8;
+  cpu->r[9] = save_registers.r9;
+  cpu->r[10] = save_registers.r10;
+  cpu->r[11] = save_registers.r11;
+  cpu->r[12] = save_registers.r12;
+  cpu->r[13] = save_registers.sp;
+  cpu->r[14] = save_registers.lr;
+  cpu->r[15] = addr;
+  cpu->xpsr = save_registers.xPSR;
+  cpu->read = debug_read;
+}
+
+/**
+ * @brief Set a breakpoint at the instruction that will run after the
+ * one at breakaddr, worked out from the saved registers. If there is
+ * already a breakpoint there it does the job and is left alone.
+ * 
+ * @param breakaddr Location of instruction
+ */
+void setBreakPointNext(uint32_t breakaddr) {
+  thumb_cpu cpu;
+  debug_thumbCpu(&cpu, breakaddr);
+  uint32_t next = thumb_nextpc(&cpu);
+  if (debug_isBreakpoint((void*)next) > 0) return;
+  temp_breakpoint = next;
+  debug_setTempBreakpoint((void*)temp_breakpoint);
+}
+
+/**
+ * @brief Run exactly one instruction and stop
+ * 
+ * @param addr Location of the instruction
+ */
+static void debug_stepOne(uint32_t addr) {
+#if GDB_COVERAGE
+  // the step works out where it goes from the real instruction
+  debug_coverHit(addr);
+#endif
+#if GDB_DEBUGMON
+  if (debugmon_enabled) {
+    // hardware step: DebugMonitor fires after exactly one instruction
+    debugmon_stepping = 1;
+    ARM_DEMCR |= DEMCR_MON_STEP;
+    return;
+  }
+#endif
+  // break at next instruction
+  setBreakPointNext(addr);
+}
+
+/**
+ * @brief Displaced stepping. Breakpoints stay in place when they are hit.
+ * To carry on from one, the instruction under it runs from a scratch
+ * slot in RAM followed by a jump back, so a breakpoint that doesn't stop
+ * (a callback, a hit count) costs one exception. Branches are emulated
+ * with thumb_nextpc() rather than moved, as are the PC-relative loads
+ * compilers emit most. Anything else that reads PC, and instructions in
+ * an IT block, are stepped in place with the breakpoint lifted and put
+ * back after.
+ * 
+ */
+
+#define DISPLACED_SLOTS 4
+
+#ifdef GDB_HOST_SIM
+// the host build runs the slots from simulated RAM
+#define displaced_slots ((uint16_t(*)[8])((uint8_t*)RAM_START + 0x3ff00))
+#else
+// each slot is the instruction, ldr.w pc, [pc, #0] and the return
+// address; FASTRUN puts them in ITCM, which can run code, on Teensy 4
+__attribute__((section(".fastrun"), aligned(8)))
+uint16_t displaced_slots[DISPLACED_SLOTS][8];
+#endif
+
+// slots are used in turn in case an interrupt stops again before the
+// program gets to run the last one
+int displaced_next = 0;
+
+// Stepping over a breakpoint that couldn't be displaced
+int debug_stepover = 0;
+
+// GDB asked for the step that ends at the next stop
+int debug_stepping = 0;
+
+// thumb_nextpc() reads the instruction under the breakpoint at this
+// address in place of the SVC
+static uint32_t displaced_addr;
+static uint16_t displaced_code;
+
+static uint32_t displaced_read(uint32_t addr, int size) {
+  if (addr == displaced_addr && size == 2) return displaced_code;
+  return debug_read(addr, size);
+}
+
+/**
+ * @brief Carry on from a breakpoint without taking it out
+ * 
+ * @param addr Location of the breakpoint and of the next instruction to run
+ * @return int 0 = done; -1 = it has to be stepped in place
+ */
+static int debug_displace(uint32_t addr) {
+  if (save_registers.xPSR & 0x0600FC00) return -1; // in an IT block
+
+  uint16_t h1 = swdebug_original((void*)addr);
+  int width = thumb_width(h1);
+  uint16_t h2 = width == 4 ? *(uint16_t*)(addr + 2) : 0;
+  uint32_t next = addr + width;
+  int kind = thumb_encodings[thumb_lookup(h1, h2)].kind;
+
+  switch(kind) {
+    case THUMB_IT:
+      // ITSTATE is held in xPSR[15:10] and xPSR[26:25]
+      save_registers.xPSR |= ((h1 & 0xFC) << 8) | ((h1 & 0x3) << 25);
+      save_registers.pc = next;
+      break;
+
+    case THUMB_B_T1:
+    case THUMB_B_T2:
+    case THUMB_B_T3:
+    case THUMB_B_T4:
+    case THUMB_CBZ:
+    case THUMB_BX:
+    case THUMB_MOV_PC:
+    case THUMB_ADD_PC:
+    case THUMB_TB:
+    case THUMB_LDR_LIT: {
+      thumb_cpu cpu;
+      debug_thumbCpu(&cpu, addr);
+      displaced_addr = addr;
+      displaced_code = h1;
+      cpu.read = displaced_read;
+      save_registers.pc = thumb_nextpc(&cpu);
+      if ((kind == THUMB_B_T4 && (h2 & 0x4000)) || (kind == THUMB_BX && (h1 & 0x80))) {
+        save_registers.lr = next | 1; // bl, blx Rm
+      }
+      break;
+    }
+
+    default:
+      if ((h1 & 0xF800) == 0x4800 || (h1 & 0xF800) == 0xA000) {
+        // ldr Rt, [pc, #imm8] or adr Rd, label
+        uint32_t value = ((addr + 4) & ~3) + ((h1 & 0xFF) << 2);
+        if (h1 & 0x4000) value = *(uint32_t*)(uintptr_t)value;
+        int rd = (h1 >> 8) & 0x7;
+        *(rd < 4 ? &save_registers.r0 + rd : &save_registers.r4 + rd - 4) = value;
+        save_registers.pc = next;
+        break;
+      }
+      if (! thumb_relocatable(h1, h2)) return -1;
+
+      uint16_t *slot = displaced_slots[displaced_next];
+      displaced_next = (displaced_next + 1) % DISPLACED_SLOTS;
+      slot[0] = h1;
+      slot[1] = width == 4 ? h2 : 0xBF00; // nop
+      slot[2] = 0xF8DF;     // ldr.w pc, [pc, #0]
+      slot[3] = 0xF000;
+      *(uint32_t*)&slot[4] = next | 1;
+      debug_syncCode(slot, 12);
+      save_registers.pc = (uint32_t)(uintptr_t)slot;
+  }
+  debugrestore = 1;
+  return 0;
+}
+
+// take out a breakpoint and put it back at the next stop
+static void debug_liftBreakpoint(uint32_t addr) {
+  debug_clearBreakpoint((void*)addr);
+  debugreset = addr;
+}
+
+/**
+ * @brief On the way out of a stop, get past a breakpoint where the
+ * program carries on, leaving it in place if possible
+ * 
+ */
+static void debug_resume() {
+  uint32_t pc = save_registers.pc;
+  if (debug_isBreakpoint((void*)pc) <= 0) return;
+  if (debug_displace(pc) == 0) return;
+  debug_liftBreakpoint(pc);
+  debug_stepover = 1;
+  debug_stepOne(pc);
+}
+
+#if GDB_RECORD
+
+/**
+ * @brief Execution record for reverse stepping. While recording, 'c'
+ * and 's' run the program one instruction at a time from
+ * debug_monitor(), with no round trip to GDB, and each instruction adds
+ * a record to a ring of words:
+ * 
+ *   pc of the instruction
+ *   info: registers it changed (bits 0-16, save_registers order),
+ *         memory blocks (bits 17-18), record length in words (25-31)
+ *   the old values of those registers
+ *   per block: address, bytes, then the old bytes padded to words
+ * 
+ * The blocks are what a store overwrote and stack that was given back,
+ * which the next exception frame overwrites. Reverse stepping doesn't
+ * change the program: 'bs' and 'bc' move a replay position back through
+ * the records, and registers and memory are reported as they were
+ * there; 's' and 'c' move it forward again until the program's own
+ * position is reached and it can run.
+ * 
+ */
+
+#ifndef GDB_RECORD_MEMORY
+#if defined(GDB_HOST_SIM)
+#define GDB_RECORD_MEMORY
+#elif defined(__IMXRT1062__)
+// OCRAM (DMAMEM), leaving DTCM to the sketch
+#define GDB_RECORD_MEMORY __attribute__((section(".dmabuffers"), used))
+#else
+#define GDB_RECORD_MEMORY
+#endif
+#endif
+
+#define RECORD_WORDS (GDB_RECORD / 4)
+#define RECORD_REGS 17
+#define RECORD_PC 6
+#define RECORD_XPSR 7
+#define RECORD_SP 16
+#define RECORD_STORE 128    // bytes; vstm of d0-d15
+#define RECORD_FREED 128    // bytes of stack given back that are kept
+
+GDB_RECORD_MEMORY uint32_t debug_record_ring[RECORD_WORDS];
+
+// 'monitor record on'
+int debug_record_on = 0;
+
+// 1 = record the step GDB asked for; 2 = record until something stops
+static int record_run = 0;
+static uint32_t record_head = 0;    // next word to write
+static uint32_t record_used = 0;    // words in use
+static int record_count = 0;
+static int record_back = 0;         // records replayed backwards
+
+// the state before the instruction being recorded
+static uint32_t record_regs[RECORD_REGS];
+static uint32_t record_store_addr;
+static int record_store_len;
+static uint32_t record_store[RECORD_STORE / 4];
+static uint32_t record_stack_addr;
+static int record_stack_len;
+static uint32_t record_stack[RECORD_FREED / 4];
+
+// stack given back is read from above sp; not past the top of RAM
+#if defined(GDB_HOST_SIM)
+#define RECORD_STACK_TOP ((uint32_t)(uintptr_t)RAM_END + 1)
+#else
+extern unsigned long _estack;
+#define RECORD_STACK_TOP ((uint32_t)&_estack)
+#endif
+
+// save_registers as they were at the replay position
+static save_registers_struct replay_registers;
+
+static inline uint32_t record_word(uint32_t pos) {
+  return debug_record_ring[pos % RECORD_WORDS];
+}
+
+static inline int record_length(uint32_t pos) {
+  return record_word(pos + 1) >> 25;
+}
+
+// first word of record n, counting from the oldest
+static uint32_t record_find(int n) {
+  uint32_t pos = record_head + RECORD_WORDS - record_used;
+  while (n-- > 0) pos += record_length(pos);
+  return pos;
+}
+
+static int record_inRam(uint32_t addr, int len) {
+  return (void*)addr >= RAM_START && (void*)(addr + len - 1) <= RAM_END && addr + len > addr;
+}
+
 /**
- * @brief Display registers for debugging of the debugger
+ * @brief Keep what the instruction at pc may change, before it runs
  * 
+ * @param sp The program's stack pointer
  */
-void print_registers() {
-  Serial.print("r0=");Serial.println(save_registers.r0);
-  Serial.print("r1=");Serial.println(save_registers.r1);
-  Serial.print("r2=");Serial.println(save_registers.r2);
-  Serial.print("r3=");Serial.println(save_registers.r3);
-  Serial.print("r12=");Serial.println(save_registers.r12);
-  Serial.print("lr=0x");Serial.println(save_registers.lr, HEX);
-  Serial.print("pc=0x");Serial.println(save_registers.pc, HEX);
-  Serial.print("r4=");Serial.println(save_registers.r4);
-  Serial.print("r5=");Serial.println(save_registers.r5);
-  Serial.print("r6=");Serial.println(save_registers.r6);
-  Serial.print("r7=");Serial.println(save_registers.r7);
-  Serial.print("r8=");Serial.println(save_registers.r8);
-  Serial.print("r9=");Serial.println(save_registers.r9);
-  Serial.print("r10=");Serial.println(save_registers.r10);
-  Serial.print("r11=");Serial.println(save_registers.r11);
-  Serial.print("sp=0x");Serial.println(save_registers.sp,HEX);
+static void debug_recordSnapshot(uint32_t sp) {
+  memcpy(record_regs, &save_registers, sizeof(record_regs));
+  record_regs[RECORD_SP] = sp;
+  record_regs[RECORD_XPSR] &= ~0x200;  // frame alignment, not the program's
+  thumb_cpu cpu;
+  debug_thumbCpu(&cpu, save_registers.pc);
+  cpu.r[13] = sp;
+  record_store_len = thumb_stores(&cpu, &record_store_addr);
+  if (record_store_len > RECORD_STORE || ! record_inRam(record_store_addr, record_store_len)) {
+    record_store_len = 0;   // not RAM; not undone
+  }
+  memcpy(record_store, (void*)record_store_addr, record_store_len);
+  record_stack_addr = sp;
+  record_stack_len = 0;
+  if (sp < RECORD_STACK_TOP && record_inRam(sp, 4)) {
+    record_stack_len = RECORD_STACK_TOP - sp;
+    if (record_stack_len > RECORD_FREED) record_stack_len = RECORD_FREED;
+    memcpy(record_stack, (void*)sp, record_stack_len);
+  }
 }
 
-/**
- * @brief Return instruction width in bytes of the instruction *p
- * 
- * @param p Pointer to instruction
- * @return int Number of bytes (usually 2)
- */
-int instructionWidth(void *p) {
-  uint16_t prefix = (*(uint16_t*)p) & 0xF800;
-  if (prefix == 0xF000) return 2;
-  if (prefix == 0xE800) return 2;
-  if (prefix == 0xF000) return 2;
-  if (prefix == 0xF800) return 2;
-  return 1;
+static void record_put(uint32_t word) {
+  debug_record_ring[record_head] = word;
+  record_head = (record_head + 1) % RECORD_WORDS;
+}
+
+static void record_block(uint32_t addr, int len, const uint32_t *data) {
+  record_put(addr);
+  record_put(len);
+  for (int i=0; i<(len + 3) / 4; i++) record_put(data[i]);
 }
 
 /**
- * @brief Parse register instruction bits and return register value
+ * @brief Add the record of the instruction that has just run
  * 
- * @param x Register bits from instruction
- * @return uint32_t Value of register
+ * @param sp The program's stack pointer now
  */
-uint32_t getRegisterNum(int x) {
-  switch(x) {
-    case  0: return save_registers.r0;
-    case  1: return save_registers.r1;
-    case  2: return save_registers.r2;
-    case  3: return save_registers.r3;
-    case  4: return save_registers.r4;
-    case  5: return save_registers.r5;
-    case  6: return save_registers.r6;
-    case  7: return save_registers.r7;
+static void debug_recordAdd(uint32_t sp) {
+  uint32_t now[RECORD_REGS];
+  memcpy(now, &save_registers, sizeof(now));
+  now[RECORD_SP] = sp;
+  now[RECORD_XPSR] &= ~0x200;
+  uint32_t mask = 0;
+  int len = 2;
+  for (int r=0; r<RECORD_REGS; r++) {
+    if (r != RECORD_PC && now[r] != record_regs[r]) {
+      mask |= 1 << r;
+      len++;
+    }
   }
-  return 0;
+  int blocks = 0;
+  if (record_store_len) {
+    blocks++;
+    len += 2 + (record_store_len + 3) / 4;
+  }
+  int freed = sp - record_regs[RECORD_SP];
+  if (freed > record_stack_len) freed = record_stack_len;
+  if (freed > 0) {
+    blocks++;
+    len += 2 + (freed + 3) / 4;
+  }
+
+  if (len > RECORD_WORDS) {
+    debug_recordClear();   // ring too small to hold it
+    return;
+  }
+  while (record_used + len > RECORD_WORDS) {
+    record_used -= record_length(record_head + RECORD_WORDS - record_used);
+    record_count--;
+  }
+  record_put(record_regs[RECORD_PC]);
+  record_put(mask | (blocks << 17) | (len << 25));
+  for (int r=0; r<RECORD_REGS; r++) {
+    if (mask & (1 << r)) record_put(record_regs[r]);
+  }
+  if (record_store_len) record_block(record_store_addr, record_store_len, record_store);
+  if (freed > 0) record_block(record_stack_addr, freed, record_stack);
+  record_used += len;
+  record_count++;
 }
 
 /**
- * @brief Count the number of registers in instruction. Used by "pop" and "push"
+ * @brief Start recording the step GDB asked for; called once the step
+ * is set up
  * 
- * @param x Bits from instruction
- * @return int Number of registers to pop or push
+ * @param run 1 = keep going until a breakpoint or Ctrl-C stops it
  */
-int countBits(int x) {
-  return
-    ((x & (1<<0)) >> 0) +
-    ((x & (1<<1)) >> 1) +
-    ((x & (1<<2)) >> 2) +
-    ((x & (1<<3)) >> 3) +
-    ((x & (1<<4)) >> 4) +
-    ((x & (1<<5)) >> 5) +
-    ((x & (1<<6)) >> 6) +
-    ((x & (1<<7)) >> 7);
+static void debug_recordStart(int run) {
+  record_run = run ? 2 : 1;
+  debug_recordSnapshot(save_registers.sp);
 }
 
 /**
- * @brief If pointer is "return" instruction, return the address where
- * it will return.
+ * @brief A recorded step has finished. Adds its record and, unless
+ * something stops the program here, steps the next instruction.
  * 
- * @param p Pointer to instruction
- * @return void* Address to return to
+ * @param stepping The stop is the end of a step
+ * @param hitaddr Breakpoint that was reached; cleared once counted
+ * @return int 1 = stepping on; 0 = carry on with the stop
  */
-void *instructionReturn(void *p) {
-  uint16_t inst = *(uint16_t*)p;
-  uint16_t prefix = inst >> 8;
-  // mov pc, Rx
-  // Serial.print("ret? prefix ");Serial.println(prefix);
-  if (prefix == 0b01000110 && ((inst & 0b111) == 0b111)) {
-    uint32_t reg = getRegisterNum((inst >> 3) & 0b111);
-    // Serial.print("mov pc ");Serial.println(reg);
-    return (void*)reg;
+static int debug_recordStep(int stepping, uint32_t *hitaddr) {
+  if (! stepping || debug_id) {
+    // a fault or something other than the step; that instruction never ran
+    record_run = 0;
+    return 0;
   }
-  if (prefix == 0b10111101) { // pop {Rxxx, pc}
-    int regs = countBits(inst & 0xFF);
-    uint32_t *memory = (uint32_t*)save_registers.sp;
-    // Serial.print("pop pc instr ");Serial.println(inst, HEX);
-    // Serial.print("regs ");Serial.println(regs);
-    // Serial.print("pop pc at ");Serial.println(memory[regs], HEX);
-    // return 0;
-    return (void*)memory[regs]; 
+  uint32_t sp = save_registers.sp + ISR_STACK_SIZE(debug_exc_return, save_registers.xPSR);
+  debug_recordAdd(sp);
+
+  uint32_t pc = save_registers.pc;
+  int stop = record_run == 1 || debug_break_request;
+#if GDB_DEBUGMON
+  if (watch_hit_type) stop = 1;
+#endif
+  if (debug_isBreakpoint((void*)pc) > 0) {
+    if (! stop && ! debug_countHit(pc, 0)) stop = 1;
+    *hitaddr = 0;
+    if (! stop) debug_liftBreakpoint(pc);
   }
-  if (inst == 0x4770) { // bx lr
-    // Serial.print("bx lr=");Serial.println(save_registers.lr);
-    return (void*)save_registers.lr; 
+  if (stop) {
+    record_run = 0;
+    return 0;
   }
-  return 0;
+  debug_stepOne(pc);
+  debug_recordSnapshot(sp);
+  debug_stepping = 1;
+  debug_id = 0;
+  return 1;
 }
 
 /**
- * @brief If pointer is branch, return the branching address. Works for conditional
- * and explicit 2-byte and 4-byte branches.
+ * @brief Records kept, and the bytes they take
  * 
- * @param p Instruction pointer
- * @param bx Flag set if instruction is BX (modifies LR)
- * @return void* Address branching to
+ * @param bytes Set to the bytes used
+ * @return int Number of instructions recorded
  */
-void *instructionBranch(void *p, int *bx) {
-  *bx = 0;
-  uint16_t inst = *(uint16_t*)p;
+int debug_recordCount(int *bytes) {
+  if (bytes) *bytes = record_used * 4;
+  return record_count;
+}
 
-  // BX or BLX
-  if ((inst & 0xFF00) == 0x4700) {
-    int reg = (inst >> 3) & 0b1111;
-    uint32_t addr = getRegisterNum(reg);
-    *bx = 1;
-    // Serial.print("BX ");Serial.println(addr, HEX);
-    return (void*)(addr);
-  }
-  // B
-  if ((inst & 0xF800) == 0xC000) {
-    int16_t offset = inst & 0x7F;
-    if (offset & 0x400) { // sign extend negative number
-      offset |= 0xF800;
-    }
-    // Serial.print("B ");Serial.println(save_registers.pc + offset, HEX);
-    return (void*)(save_registers.pc + offset);
-  }
-  // BL prefix
-  else if ((inst & 0xF800) == 0xF000) {
-    int offset1 = inst & 0x3F;
-    uint16_t inst2 = ((uint16_t*)p)[1];
-    int offset2 = inst2 & 0x7FF;
-    int32_t offset = (offset1 << 11) + offset2;
-    if (offset &   0x10000) {
-      offset |= 0xFFFE0000;
-    }
-    offset <<= 1;
-    // Serial.print("BL prefix ");Serial.println(save_registers.pc + offset + 4, HEX);
-    return (void*)(save_registers.pc + offset + 4);
-  }
-  // B conditional
-  else  if ((inst & 0xF000) == 0xD000) {
-    int8_t offset = inst & 0xFF;
-    // Serial.print("B cond ");Serial.println(save_registers.pc + offset, HEX);
-    return (void*)(save_registers.pc + offset);
-  }
-  return 0;
+/**
+ * @brief Forget the record; the program has changed in a way it doesn't
+ * show, or runs without it
+ * 
+ */
+void debug_recordClear() {
+  record_head = 0;
+  record_used = 0;
+  record_count = 0;
+  record_back = 0;
 }
 
 /**
- * @brief Default debug callback
+ * @brief The replay position is behind the program
  * 
+ * @return int Records replayed backwards; 0 = at the program
  */
-void debug_action() {
-  Serial.println("****DEBUG");
-  print_registers();
-  Serial.println("****");
+int debug_replaying() {
+  return record_back;
 }
 
-// Saved address to restore original breakpoint
-uint32_t debugreset = 0;
-uint32_t temp_breakpoint = 0;
-uint32_t temp_breakpoint2 = 0;
+// registers at the replay position: the oldest value kept from there on
+static void replay_update() {
+  uint32_t *view = (uint32_t*)&replay_registers;
+  memcpy(view, &save_registers, sizeof(replay_registers));
+  if (record_back == 0) return;
+  int n = record_count - record_back;
+  uint32_t pos = record_find(n);
+  uint32_t seen = 0;
+  view[RECORD_PC] = record_word(pos);
+  for (; n<record_count; n++) {
+    uint32_t mask = record_word(pos + 1) & 0x1FFFF;
+    int w = 2;
+    for (int r=0; r<RECORD_REGS; r++) {
+      if (mask & (1 << r)) {
+        if (! (seen & (1 << r))) view[r] = record_word(pos + w);
+        w++;
+      }
+    }
+    seen |= mask;
+    pos += record_length(pos);
+  }
+}
 
 /**
- * @brief Set a breakpoint at the next instructions, taking into account returns
- * and branches.
+ * @brief Move the replay position, for 'bs', 'bc' and for 's' and 'c'
+ * while replaying
  * 
- * @param breakaddr Location of instruction
- * @param nextaddr Location of next instruction (as given by PC)
+ * @param back 1 = towards the oldest record; 0 = towards the program
+ * @param run 1 = until a breakpoint; 0 = one instruction
+ * @return int 0 = stopped; 1 = reached the oldest record or, going
+ * forward, the program
  */
-void setBreakPointNext(uint32_t breakaddr, uint32_t nextaddr) {
-#ifdef HAS_FP_MAP
-  // For some unknown reason, FP doesn't work across returns like pop {pc},
-  // etc.
-  if (0) { }
-#else
-  void *ret = instructionReturn((void*)breakaddr);
-  // is this a return of some sort?
-  if (ret) {
-    temp_breakpoint = (uint32_t)ret;
-    // Serial.print("return to ");Serial.println(temp_breakpoint, HEX);
+int debug_replayMove(int back, int run) {
+  int end = 0;
+  if (back) {
+    int n = record_count - record_back;   // position now
+    if (n == 0) return 1;
+    int to = run ? 0 : n - 1;
+    if (run) {
+      // the last breakpoint before here
+      uint32_t pos = record_find(0);
+      for (int i=0; i<n; i++) {
+        if (debug_isBreakpoint((void*)record_word(pos)) > 0) to = i;
+        pos += record_length(pos);
+      }
+      if (to == 0 && debug_isBreakpoint((void*)record_word(record_find(0))) <= 0) end = 1;
+    }
+    record_back = record_count - to;
   }
-#endif
   else {
-    int bx;
-    // are we branching?
-    void *b = instructionBranch((void*)breakaddr, &bx);
-    if (b) {
-      temp_breakpoint2 = (uint32_t)b;
-      // Serial.print("branch to ");Serial.println(temp_breakpoint2, HEX);
-      debug_setBreakpoint((void*)temp_breakpoint2);
-    }
-    // is 32 bits wide?
-    if (instructionWidth((void*)breakaddr) == 2) {
-    // Serial.print("32-bit instruction at ");Serial.println(breakaddr, HEX);
-      temp_breakpoint = nextaddr + 2;
+    if (record_back == 0) return 1;
+    int n = record_count - record_back + 1;
+    if (run) {
+      uint32_t pos = record_find(n);
+      while (n < record_count && debug_isBreakpoint((void*)record_word(pos)) <= 0) {
+        pos += record_length(pos);
+        n++;
+      }
+      if (n == record_count) end = 1;
     }
-    else {
-      temp_breakpoint = nextaddr;
+    record_back = record_count - n;
+  }
+  replay_update();
+  return end;
+}
+
+/**
+ * @brief Read memory as it was at the replay position
+ * 
+ * @param addr Address
+ * @param buf Where to put it
+ * @param len Bytes, up to GDB_PACKET_SIZE/2
+ */
+void debug_replayRead(uint32_t addr, uint8_t *buf, int len) {
+  static uint8_t seen[GDB_PACKET_SIZE / 16 + 1];
+  memcpy(buf, (void*)addr, len);
+  if (record_back == 0) return;
+  memset(seen, 0, sizeof(seen));
+  int n = record_count - record_back;
+  uint32_t pos = record_find(n);
+  for (; n<record_count; n++) {
+    uint32_t info = record_word(pos + 1);
+    uint32_t w = pos + 2 + __builtin_popcount(info & 0x1FFFF);
+    for (int b=(info >> 17) & 3; b>0; b--) {
+      uint32_t start = record_word(w);
+      int bytes = record_word(w + 1);
+      for (int i=0; i<bytes; i++) {
+        uint32_t k = start + i - addr;
+        if (k < (uint32_t)len && ! (seen[k / 8] & (1 << (k & 7)))) {
+          buf[k] = record_word(w + 2 + i / 4) >> (8 * (i & 3));
+          seen[k / 8] |= 1 << (k & 7);
+        }
+      }
+      w += 2 + (bytes + 3) / 4;
     }
+    pos += record_length(pos);
   }
-  debug_setBreakpoint((void*)temp_breakpoint);
 }
 
+#endif // GDB_RECORD
+
 /**
  * @brief Called by software interrupt to perform breakpoint manipulation
  * during execution and to call the callback.
@@ -668,11 +2492,37 @@ void setBreakPointNext(uint32_t breakaddr, uint32_t nextaddr) {
 void debug_monitor() {
   uint32_t nextaddr = save_registers.pc;
   uint32_t breakaddr = save_registers.pc - 2;
+  uint32_t hitaddr = 0; // breakpoint that was reached, if any
+  int trapped = debugenabled; // 0 if only a Ctrl-C brought us here
+
+  if (! trapped) {
+    // pc is where the interrupted code carries on. Don't stop in the
+    // middle of getting past a breakpoint; the next poll asks again.
+    uint32_t slot = nextaddr - (uint32_t)(uintptr_t)displaced_slots;
+    if (debug_stepping || debug_stepover || debugreset || temp_breakpoint ||
+        slot < sizeof(uint16_t) * DISPLACED_SLOTS * 8) {
+      return;
+    }
+  }
+
+  int stepping = debug_stepping;
+  debug_stepping = 0;
 
   // Serial.print("break at ");Serial.println(breakaddr, HEX);
   // print_registers();
 
-  if (debug_isHardcoded((void*)breakaddr)) {
+  if (! trapped) {
+    // nothing to undo
+    breakaddr = nextaddr;
+  }
+  else if (debug_event) {
+    // DebugMonitor stops happen before the instruction runs, so pc is
+    // already where to continue and there is nothing to undo
+    breakaddr = nextaddr;
+    if (debug_event == 2) hitaddr = breakaddr;
+    debug_event = 0;
+  }
+  else if (debug_isHardcoded((void*)breakaddr)) {
     // do nothing for hardcoded interrupts; we continue on next instruction
   }
   // else if (debug_id == 3) { // break cause by Ctrl-C
@@ -685,24 +2535,71 @@ void debug_monitor() {
     // set to rerun current instruction
     stack->pc = breakaddr;
 
-    // gdb will clear the current breakpoint but we do this first so disassembly holds 
-    // original code
-    debug_clearBreakpoint((void*)breakaddr);
-    // clear the temporary breakpoints
+    // the breakpoint stays in; debug_resume() gets past it. Clear the
+    // temporary one used for stepping.
+    if (temp_breakpoint != breakaddr) hitaddr = breakaddr;
+#if GDB_COVERAGE
+    debug_coverMark(breakaddr);
+#endif
     if (temp_breakpoint) {
       debug_clearBreakpoint((void*)temp_breakpoint);
       temp_breakpoint = 0;
     }
-    if (temp_breakpoint2) {
-      debug_clearBreakpoint((void*)temp_breakpoint2); 
-      temp_breakpoint2 = 0;
+  }
+
+  // put back a breakpoint lifted to step over it
+  if (debugreset) {
+    debug_setBreakpoint((void*)debugreset);
+    debugreset = 0;
+  }
+
+  if (debug_stepover) {
+    debug_stepover = 0;
+    if (debug_isBreakpoint((void*)save_registers.pc) <= 0) {
+      // stepped past a breakpoint without stopping; carry on
+      debug_id = 0;
+      return;
     }
   }
 
+#if GDB_RECORD
+  if (record_run && debug_recordStep(stepping, &hitaddr)) return;
+#endif
+
+#if GDB_STOPWATCHES
+  if (hitaddr && ! stepping && debug_stopwatchHit(hitaddr)) {
+    debug_id = 0;
+    debug_resume();
+    debug_stopwatchStart();
+    return;
+  }
+#endif
+
+  if (hitaddr && debug_countHit(hitaddr, stepping)) {
+    // ignored hit; carry on without stopping
+    debug_id = 0;
+    debug_resume();
+    return;
+  }
+
+  if (debug_break_request) {
+    // this stop answers GDB's Ctrl-C, whatever caused it
+    debug_break_request = 0;
+    uint32_t t = DEBUG_CYCLES() - debug_break_cycles;
+    debug_interrupt_stats.count++;
+    debug_interrupt_stats.last = t;
+    if (t > debug_interrupt_stats.max) debug_interrupt_stats.max = t;
+    if (! trapped) debug_id = 1; // SIGINT
+  }
+
   // Adjust original SP to before the interrupt call to remove ISR's stack entries
   // so GDB has correct stack. The actual stack pointer will get restored
   // to this value when the interrupt returns.
-  save_registers.sp += ISR_STACK_SIZE;
+  save_registers.sp += ISR_STACK_SIZE(debug_exc_return, save_registers.xPSR);
+#if GDB_STACK_GUARD
+  // the debugger runs on a copy of the frame; report where the stack was
+  if (mpu_overflow) save_registers.sp = mpu_overflow_sp;
+#endif
 
   if (callback) {
     callback();
@@ -712,98 +2609,129 @@ void debug_monitor() {
   }
 
   debug_id = 0;
+#if GDB_DEBUGMON
+  watch_hit_type = 0;
+  mpu_resume();
+#endif
+  // GDB has put its breakpoints back for the program to run
+  debug_persistSave();
 
   if (debugstep) {
-    // break at next instruction
-    setBreakPointNext(breakaddr, nextaddr);
+    // a breakpoint where the step starts would stop it going anywhere
+    if (debug_isBreakpoint((void*)save_registers.pc) > 0) {
+      debug_liftBreakpoint(save_registers.pc);
+    }
+    debug_stepOne(save_registers.pc);
+#if GDB_RECORD
+    if (debug_record_on) debug_recordStart(debugstep == 2);
+    else debug_recordClear();
+#endif
+    debug_stepping = 1;
     debugstep = 0;
-    // the original breakpoint needs to be put back after next break
-    // debugreset = breakaddr;
   }
+  else {
+#if GDB_RECORD
+    debug_recordClear();  // runs unrecorded
+#endif
+    debug_resume();
+  }
+}
 
-  // if we need to reset the original, do so
-  if (debugreset) {
-    debug_setBreakpoint((void*)debugreset);
-    debugreset = 0;
+// Breakpoint hits that don't stop are handled by the SVC handler
+int debug_fast_hits = 1;
+
+static uint32_t fast_cycles;
+
+/**
+ * @brief Whether a breakpoint hit could be handled in the SVC handler.
+ * Called before the registers are saved, so a hit while a stop is being
+ * served goes the usual way and leaves the stopped program's registers
+ * alone.
+ * 
+ * @param addr The SVC that was hit
+ * @return int 1 = save the registers and call debug_fastHit()
+ */
+int debug_fastHitWanted(uint32_t addr) {
+  if (! debug_fast_hits) return 0;
+  fast_cycles = DEBUG_CYCLES();
+  if (debug_serving || debugenabled || debug_stepping || debug_stepover ||
+      debugreset || temp_breakpoint || debug_break_request) return 0;
+  if (debug_isBreakpoint((void*)addr) <= 0) return 0;
+
+  uint32_t orig = addr;
+#if GDB_RELOC_POOL
+  orig = reloc_toOriginal(addr);
+#endif
+#if GDB_STOPWATCHES
+  if (debug_stopwatchUses(orig)) return 1;
+#endif
+  int n = debug_findHits(orig, 0);
+  return n >= 0 && debug_hits[n].ignore;
+}
+
+/**
+ * @brief Handle a breakpoint hit that doesn't stop (a stopwatch end or an
+ * ignored hit) in the SVC handler itself, without going on to IRQ_DEBUG,
+ * once debug_fastHitWanted() has agreed. A breakpoint that can't be
+ * displaced goes the usual way and nothing has been counted yet.
+ * 
+ * @return int 1 = done; the program carries on from save_registers
+ */
+int debug_fastHit() {
+  uint32_t addr = save_registers.pc - 2;
+  if (debug_displace(addr) != 0) return 0;
+  debug_trap_cycles = fast_cycles;
+  debugcount++;
+#if GDB_STOPWATCHES
+  if (debug_stopwatchHit(addr)) {
+    debug_stopwatchStart();
+    debug_resume_cycles = DEBUG_CYCLES();
+    return 1;
   }
+#endif
+  debug_countHit(addr, 0);
+  debug_resume_cycles = DEBUG_CYCLES();
+  return 1;
 }
 
 /**
- * @brief Macros to save/restore registers from stack
+ * @brief Macros to save/restore registers from stack. The frame and
+ * r4-r11 are each moved with one LDM/STM pair; r4-r11 are parked in
+ * save_registers first so they can carry the frame.
  * 
  */
 #define SAVE_STACK \
     "ldr r0, =stack \n" \
-    "str sp, [r0] \n"
+    "str sp, [r0] \n" \
+    "ldr r0, =debug_exc_return \n" \
+    "str lr, [r0] \n"
 
-// Save registers within an interrupt. Changes R0 register
+// Save registers within an interrupt. Changes R0-R2 registers
 #define SAVE_REGISTERS \
     "ldr r0, =stack \n" \
     "ldr r1, [r0] \n " \
     "ldr r0, =save_registers \n" \
-    "ldr r2, [r1, #0] \n" \
-    "str r2, [r0, #0] \n" \
-    "ldr r2, [r1, #4] \n" \
-    "str r2, [r0, #4] \n" \
-    "ldr r2, [r1, #8] \n" \
-    "str r2, [r0, #8] \n" \
-    "ldr r2, [r1, #12] \n" \
-    "str r2, [r0, #12] \n" \
-    "ldr r2, [r1, #16] \n" \
-    "str r2, [r0, #16] \n" \
-    \
-    "ldr r2, [r1, #20] \n" \
-    "str r2, [r0, #20] \n" \
-    "ldr r2, [r1, #24] \n" \
-    "str r2, [r0, #24] \n" \
-    "ldr r2, [r1, #28] \n" \
-    "str r2, [r0, #28] \n" \
-    \
-    "str r4, [r0, #32] \n" \
-    "str r5, [r0, #36] \n" \
-    "str r6, [r0, #40] \n" \
-    "str r7, [r0, #44] \n" \
-    "str r8, [r0, #48] \n" \
-    "str r9, [r0, #52] \n" \
-    "str r10, [r0, #56] \n" \
-    "str r11, [r0, #60] \n" \
-    "str r1, [r0, #64] \n"
+    "add r2, r0, #32 \n" \
+    "stm r2, {r4-r11} \n" \
+    "ldm r1, {r4-r11} \n" \
+    "stm r0, {r4-r11} \n" \
+    "str r1, [r0, #64] \n" \
+    "ldm r2, {r4-r11} \n"
 
 // Restore all registers except SP
 #define RESTORE_REGISTERS \
     "ldr r0, =stack \n" \
     "ldr r1, [r0] \n " \
     "ldr r0, =save_registers \n" \
-    "ldr r2, [r0, #0] \n" \
-    "str r2, [r1, #0] \n" \
-    "ldr r2, [r0, #4] \n" \
-    "str r2, [r1, #4] \n" \
-    "ldr r2, [r0, #8] \n" \
-    "str r2, [r1, #8] \n" \
-    "ldr r2, [r0, #12] \n" \
-    "str r2, [r1, #12] \n" \
-    "ldr r2, [r0, #16] \n" \
-    "str r2, [r1, #16] \n" \
-    \
-    "ldr r2, [r0, #20] \n" \
-    "str r2, [r1, #20] \n" \
-    "ldr r2, [r0, #24] \n" \
-    "str r2, [r1, #24] \n" \
-    "ldr r2, [r0, #28] \n" \
-    "str r2, [r1, #28] \n" \
-    \
-    "ldr r4, [r0, #32] \n" \
-    "ldr r5, [r0, #36] \n" \
-    "ldr r6, [r0, #40] \n" \
-    "ldr r7, [r0, #44] \n" \
-    "ldr r8, [r0, #48] \n" \
-    "ldr r9, [r0, #52] \n" \
-    "ldr r10, [r0, #56] \n" \
-    "ldr r11, [r0, #60] \n"
+    "ldm r0!, {r4-r11} \n" \
+    "stm r1, {r4-r11} \n" \
+    "ldm r0, {r4-r11} \n"
 
 void (*original_software_isr)() = NULL;
 void (*original_svc_isr)() = NULL;
 
+#ifndef GDB_HOST_SIM
+
 /**
  * @brief Called by software interrupt. Perform chaining or
  * call handler.
@@ -814,12 +2742,14 @@ void debug_call_isr() {
   __disable_irq();
   asm volatile(SAVE_STACK);
   asm volatile(SAVE_REGISTERS);
+  debug_serving = 1;
   __enable_irq();
   asm volatile("push {lr}");
   NVIC_CLEAR_PENDING(IRQ_DEBUG);
 
   // Are we in debug mode? If not, just jump to original ISR
-  if (debugenabled == 0) {
+  if (debugenabled == 0 && debug_break_request == 0) {
+    debug_serving = 0;
 #if 1
     if (original_software_isr) {
       // asm volatile("ldr r0, =original_software_isr");
@@ -837,6 +2767,7 @@ void debug_call_isr() {
   }
 
   debug_monitor();              // process the debug event
+  debug_resume_cycles = DEBUG_CYCLES();
   debugenabled = 0;
   // Serial.print("restore regs=");Serial.println(debugrestore);
 
@@ -846,26 +2777,59 @@ void debug_call_isr() {
     asm volatile("pop {r12}");
     __disable_irq();
     asm volatile(RESTORE_REGISTERS);
+    asm volatile(
+      "ldr r0, =debug_serving \n"
+      "mov r1, #0 \n"
+      "str r1, [r0] \n"
+    );
     __enable_irq();
     asm volatile("mov lr, r12");
     asm volatile("bx lr");
   }
   else {
+    debug_serving = 0;
     asm volatile("pop {pc}");
   }
 }
 
+#endif // GDB_HOST_SIM
+
 /**
  * @brief Called by SVC ISR to trigger software interrupt
  * 
  */
 void debug_call_isr_setup() {
+  debug_trap_cycles = DEBUG_CYCLES();
   debugcount++;
   debugenabled = 1;
   // process in lower priority so services can keep running
   NVIC_SET_PENDING(IRQ_DEBUG); 
 }
 
+#ifdef GDB_HOST_SIM
+void sim_break();
+#endif
+
+/**
+ * @brief Stop the program for GDB's Ctrl-C. IRQ_DEBUG is pended with no
+ * trap, so it runs as the timer interrupt that got the Ctrl-C returns,
+ * on the frame of the code that was preempted, and the stop reports the
+ * program's own pc and stack. Called again at every poll until the
+ * program stops, so a step in progress only delays it by one poll.
+ * 
+ */
+void debug_interrupt() {
+  if (! debug_break_request) {
+    debug_break_cycles = DEBUG_CYCLES();
+    debug_break_request = 1;
+  }
+#ifdef GDB_HOST_SIM
+  sim_break();
+#else
+  NVIC_SET_PENDING(IRQ_DEBUG);
+#endif
+}
+
 #if 1
 uint32_t lastpc;
 
@@ -878,6 +2842,8 @@ int testOurSVC() {
 }
 #endif
 
+#ifndef GDB_HOST_SIM
+
 /**
  * @brief SVC handler. Save registers and handle breakpoint.
  * 
@@ -895,49 +2861,349 @@ void svcall_isr() {
     "str r0, [r1] \n"
     "push {lr}"
   );
+#if GDB_COVERAGE
+  if (debug_coverHit(lastpc)) {
+    // back to the instruction the point stood on
+    asm volatile(
+      "ldr r0, =lastpc \n"
+      "ldr r0, [r0] \n"
+      "str r0, [sp, #28] \n"
+      "pop {pc}"
+    );
+  }
+#endif
   if (testOurSVC()) {
+    // only save over stack and save_registers when not serving a stop
+    if (debug_fastHitWanted(lastpc)) {
+      // the frame is above the saved lr
+      asm volatile(
+        "add r1, sp, #4 \n"
+        "ldr r0, =stack \n"
+        "str r1, [r0] \n"
+        SAVE_REGISTERS
+      );
+      if (debug_fastHit()) {
+        debugrestore = 0;
+        asm volatile(RESTORE_REGISTERS);
+        asm volatile("pop {pc}");
+      }
+    }
     debug_call_isr_setup();
     asm volatile("pop {pc}");
   }
-  else {
-    if (original_svc_isr) {
-      asm volatile("pop {lr}");
-      asm volatile("mov pc, %0" : : "r" (original_svc_isr));
+  else {
+    if (original_svc_isr) {
+      asm volatile("pop {lr}");
+      asm volatile("mov pc, %0" : : "r" (original_svc_isr));
+    }
+    asm volatile("pop {pc}");
+  }
+#else
+  asm volatile("push {lr}");
+  debug_call_isr_setup();
+  asm volatile("pop {pc}");
+#endif
+}
+
+/**
+ * @brief Table used by FP_MAP to map memory to breakpoints. This will
+ * get copied to RAM and serve as reference. Probably not really needed.
+ * 
+ */
+__attribute__((naked))
+void svc_call_table() {
+  asm volatile(
+    "svc #0x10 \n"
+    "nop \n"
+    "svc #0x10 \n"
+    "nop \n"
+    "svc #0x10 \n"
+    "nop \n"
+    "svc #0x10 \n"
+    "nop \n"
+    "svc #0x10 \n"
+    "nop \n"
+    "svc #0x10 \n"
+    "nop \n"
+    "svc #0x10 \n"
+    "nop \n"
+ );  
+}
+
+#if GDB_DEBUGMON
+
+#if GDB_STACK_GUARD
+
+extern int debug_crash;
+
+/**
+ * @brief A stack guard was hit. Lifts the guards so GDB can look at the
+ * stack, and copies the exception frame to the rescue stack, where the
+ * debugger runs from now on.
+ * 
+ * @return uint32_t Rescue stack pointer, holding the copy
+ */
+static uint32_t mpu_guard_hit(struct stack_isr *frame, uint32_t exc_return, uint32_t cfsr) {
+  for (int n=0; n<MPU_GUARD_MAX; n++) {
+    if (mpu_guard_base[n]) mpu_program(mpu_region(MPU_WATCH_MAX + n), mpu_guard_base[n], 0);
+  }
+  // words of the frame that landed in the guard were never written
+  int lost = cfsr & (MMFSR_MSTKERR | MMFSR_MLSPERR);
+  uint32_t *from = (uint32_t*)frame;
+  uint32_t *copy = mpu_rescue_stack + GDB_STACK_RESCUE / 4 - 8;
+  for (int i=0; i<8; i++) {
+    copy[i] = (lost && mpu_in_guard((uint32_t)&from[i])) ? 0 : from[i];
+  }
+  if (copy[7] == 0) copy[7] = 0x01000000; // Thumb bit
+
+  mpu_overflow = 1;
+  mpu_overflow_pc = copy[6];
+  mpu_overflow_sp = (uint32_t)frame + ISR_STACK_SIZE(exc_return, copy[7]);
+  SCB_CFSR = SCB_CFSR & 0xFF; // write 1 to clear MemManage status
+  // return on the rescue stack with a basic frame, to the same mode
+  mpu_rescue_exc_return = (exc_return & 8) ? 0xFFFFFFF9 : 0xFFFFFFF1;
+  debug_crash = 1;
+  debug_id = 4;
+  debug_call_isr_setup();
+  return (uint32_t)copy;
+}
+
+#endif // GDB_STACK_GUARD
+
+/**
+ * @brief Called by the MemManage handler, on a stack of its own
+ * 
+ * @param frame Exception frame of the faulting code
+ * @param exc_return EXC_RETURN the handler was entered with
+ * @return uint32_t 1 if it was one of our watchpoint regions and the
+ * fault is handled; 0 to report the fault; otherwise a stack guard was
+ * hit and this is the stack to report it on
+ */
+extern "C" uint32_t mpu_fault(struct stack_isr *frame, uint32_t exc_return) {
+  uint32_t cfsr = SCB_CFSR;
+#if GDB_STACK_GUARD
+  if (((cfsr & (MMFSR_MSTKERR | MMFSR_MLSPERR)) && (mpu_in_guard((uint32_t)frame) || mpu_in_guard((uint32_t)frame + 28))) ||
+      ((cfsr & MMFSR_DACCVIOL) && (cfsr & MMFSR_MMARVALID) && mpu_in_guard(SCB_MMFAR))) {
+    return mpu_guard_hit(frame, exc_return, cfsr);
+  }
+#endif
+  if ((cfsr & MMFSR_DACCVIOL) == 0 || (cfsr & MMFSR_MMARVALID) == 0) return 0;
+  uint32_t addr = SCB_MMFAR;
+  int n;
+  for (n=0; n<MPU_WATCH_MAX; n++) {
+    if (mpu_type[n] && ((addr - mpu_base[n]) >> mpu_bits[n]) == 0) break;
+  }
+  if (n == MPU_WATCH_MAX) return 0;
+
+  SCB_CFSR = MMFSR_DACCVIOL | MMFSR_MMARVALID; // write 1 to clear
+  mpu_write(n, 0);
+  if (frame->xPSR & IPSR_MASK) {
+    // in an interrupt handler: DebugMonitor can't step or stop here
+    return 1;
+  }
+  if (addr >= mpu_addr[n] && addr < mpu_addr[n] + mpu_len[n]) {
+    mpu_hit_pc = frame->pc;
+    mpu_hit_addr = addr;
+    watch_hit_type = mpu_type[n];
+    watch_hit_addr = addr;
+    mpu_stopped = n;
+    debug_event = 1;
+    debug_call_isr_setup();
+    return 1;
+  }
+  mpu_stepover = n;
+  ARM_DEMCR |= DEMCR_MON_STEP;
+  return 1;
+}
+
+/**
+ * @brief DebugMonitor events. Breakpoints and finished steps pend
+ * IRQ_DEBUG, like SVC breakpoints do, and stop there; calls to relocated
+ * functions are sent to the copy without stopping.
+ * 
+ * @param frame Exception frame of the interrupted code
+ */
+extern "C" void debugmon_event(struct stack_isr *frame) {
+  uint32_t dfsr = ARM_DFSR;
+  ARM_DFSR = dfsr; // write 1 to clear
+
+  if (dfsr & DFSR_HALTED) {
+    ARM_DEMCR &= ~DEMCR_MON_STEP;
+    mpu_stepped();
+    if (debugmon_stepping) {
+      debugmon_stepping = 0;
+      debug_event = 1;
+      debug_call_isr_setup();
+    }
+    return;
+  }
+
+  if (dfsr & DFSR_DWTTRAP) {
+    dwt_matched();
+    debug_event = 1;
+    debug_call_isr_setup();
+    return;
+  }
+
+  if (dfsr & DFSR_BKPT) {
+    uint32_t pc = frame->pc;
+#if GDB_RELOC_POOL
+    if (fpb_find(pc, FPB_REDIRECT) >= 0) {
+      frame->pc = reloc_toCopy(pc);
+      return;
+    }
+#endif
+    if (fpb_find(pc, FPB_BREAK) < 0 && (*(uint16_t*)pc & 0xFF00) == 0xBE00) {
+      // a BKPT in the sketch stops like halt_cpu() and continues after it
+      frame->pc = pc + 2;
+    }
+    debug_event = fpb_find(pc, FPB_BREAK) >= 0 ? 2 : 1;
+    debug_call_isr_setup();
+  }
+}
+
+/**
+ * @brief A comparator match or BKPT in code whose priority is at or
+ * above DebugMonitor's (the halt priority) can't take DebugMonitor and
+ * escalates to HardFault. Returning to the same pc would only match
+ * again, so the program carries on without stopping: a redirect goes to
+ * the copy and a breakpoint is displaced. The code may have interrupted
+ * a stop, so save_registers is put back as it was.
+ * 
+ * @param frame Exception frame
+ * @param callee r4-r11, pushed by the HardFault handler; updated
+ * @param exc_return EXC_RETURN of the HardFault
+ * @return int 1 = handled; 0 = a real fault
+ */
+extern "C" int debugmon_escalated(struct stack_isr *frame, uint32_t *callee, uint32_t exc_return) {
+  if (! debugmon_enabled || (ARM_HFSR & HFSR_DEBUGEVT) == 0) return 0;
+  if ((ARM_DFSR & DFSR_BKPT) == 0) return 0;
+  uint32_t pc = frame->pc;
+  int handled = 0;
+#if GDB_RELOC_POOL
+  if (fpb_find(pc, FPB_REDIRECT) >= 0) {
+    frame->pc = reloc_toCopy(pc);
+    handled = 1;
+  }
+#endif
+  int n = fpb_find(pc, FPB_BREAK);
+  if (! handled && n >= 0) {
+    save_registers_struct kept = save_registers;
+    int keptrestore = debugrestore;
+    memcpy(&save_registers, frame, sizeof(*frame));
+    memcpy(&save_registers.r4, callee, 8*4);
+    save_registers.sp = (uint32_t)(uintptr_t)frame + ISR_STACK_SIZE(exc_return, frame->xPSR);
+    if (debug_displace(pc) == 0) {
+      memcpy(frame, &save_registers, sizeof(*frame));
+      memcpy(callee, &save_registers.r4, 8*4);
+    }
+    else {
+      // it can only be stepped in place, which needs a stop; rather than
+      // hang, the breakpoint goes
+      fpb_clear(n);
+    }
+    save_registers = kept;
+    debugrestore = keptrestore;
+    handled = 1;
+  }
+  if (! handled && (*(uint16_t*)pc & 0xFF00) == 0xBE00) {
+    // a BKPT in the sketch; as if it had stopped and been continued
+    frame->pc = pc + 2;
+    handled = 1;
+  }
+  if (handled) {
+    ARM_DFSR = DFSR_BKPT;         // write 1 to clear
+    ARM_HFSR = HFSR_DEBUGEVT;
+  }
+  return handled;
+}
+
+/**
+ * @brief DebugMonitor handler; passes the exception frame on
+ * 
+ */
+__attribute__((naked))
+void debugmon_isr() {
+  asm volatile(
+    "tst lr, #4 \n"
+    "ite eq \n"
+    "mrseq r0, msp \n"
+    "mrsne r0, psp \n"
+    "b debugmon_event \n"
+  );
+}
+
+#endif // GDB_DEBUGMON
+
+#else // GDB_HOST_SIM
+
+// debug_call_isr() for the simulator, on a frame it built
+static void debug_sim_monitor(struct stack_isr *frame, uint32_t *callee, uint32_t sp) {
+  stack = frame;
+  debug_exc_return = 0xFFFFFFF9; // basic frame on the main stack
+  memcpy(&save_registers, frame, sizeof(*frame));
+  memcpy(&save_registers.r4, callee, 8*4);
+  save_registers.sp = sp;
+  debug_serving = 1;
+
+  debug_monitor();
+  debug_resume_cycles = DEBUG_CYCLES();
+  debugenabled = 0;
+  if (debugrestore) {
+    debugrestore = 0;
+    memcpy(frame, &save_registers, sizeof(*frame));
+    memcpy(callee, &save_registers.r4, 8*4);
+  }
+  debug_serving = 0;
+}
+
+/**
+ * @brief Trap entry for the host simulator in extras/host. The simulator
+ * has no exceptions, so when its fake CPU reaches an SVC it builds the
+ * exception frame itself and calls this in place of svcall_isr and
+ * debug_call_isr.
+ * 
+ * @param frame Exception frame; pc is the address after the SVC
+ * @param callee r4-r11; updated if GDB changes registers
+ * @param sp Stack pointer after the frame was pushed
+ * @return int 1 if it was our SVC; 0 if it should go to the original handler
+ */
+int debug_sim_trap(struct stack_isr *frame, uint32_t *callee, uint32_t sp) {
+  lastpc = frame->pc - 2;
+#if GDB_COVERAGE
+  if (debug_coverHit(lastpc)) {
+    frame->pc = lastpc;
+    return 1;
+  }
+#endif
+  if (! testOurSVC()) return 0;
+  if (debug_fastHitWanted(lastpc)) {
+    stack = frame;
+    memcpy(&save_registers, frame, sizeof(*frame));
+    memcpy(&save_registers.r4, callee, 8*4);
+    save_registers.sp = sp;
+    if (debug_fastHit()) {
+      debugrestore = 0;
+      memcpy(frame, &save_registers, sizeof(*frame));
+      memcpy(callee, &save_registers.r4, 8*4);
+      return 1;
     }
-    asm volatile("pop {pc}");
   }
-#else
-  asm volatile("push {lr}");
   debug_call_isr_setup();
-  asm volatile("pop {pc}");
-#endif
+  debug_sim_monitor(frame, callee, sp);
+  return 1;
 }
 
 /**
- * @brief Table used by FP_MAP to map memory to breakpoints. This will
- * get copied to RAM and serve as reference. Probably not really needed.
- * 
+ * @brief IRQ_DEBUG pended by debug_interrupt(), for the simulator; frame
+ * pc is the next instruction the program would run
  */
-__attribute__((naked))
-void svc_call_table() {
-  asm volatile(
-    "svc #0x10 \n"
-    "nop \n"
-    "svc #0x10 \n"
-    "nop \n"
-    "svc #0x10 \n"
-    "nop \n"
-    "svc #0x10 \n"
-    "nop \n"
-    "svc #0x10 \n"
-    "nop \n"
-    "svc #0x10 \n"
-    "nop \n"
-    "svc #0x10 \n"
-    "nop \n"
- );  
+void debug_sim_interrupt(struct stack_isr *frame, uint32_t *callee, uint32_t sp) {
+  if (debug_break_request) debug_sim_monitor(frame, callee, sp);
 }
 
+#endif // GDB_HOST_SIM
+
 /**
  * @brief Return register value for a text representation.
  * 
@@ -945,33 +3211,45 @@ void svc_call_table() {
  * @return uint32_t Value of register
  */
 uint32_t debug_getRegister(const char *reg) {
+#if GDB_RECORD
+  // as they were at the replay position
+  const save_registers_struct *regs = record_back ? &replay_registers : &save_registers;
+#else
+  const save_registers_struct *regs = &save_registers;
+#endif
   if (reg[0] == 'r') {
     if (reg[2] == 0) { // r0-r9
       switch(reg[1]) {
-        case '0': return save_registers.r0;
-        case '1': return save_registers.r1;
-        case '2': return save_registers.r2;
-        case '3': return save_registers.r3;
-        case '4': return save_registers.r4;
-        case '5': return save_registers.r5;
-        case '6': return save_registers.r6;
-        case '7': return save_registers.r7;
-        case '8': return save_registers.r8;
-        case '9': return save_registers.r9;
+        case '0': return regs->r0;
+        case '1': return regs->r1;
+        case '2': return regs->r2;
+        case '3': return regs->r3;
+        case '4': return regs->r4;
+        case '5': return regs->r5;
+        case '6': return regs->r6;
+        case '7': return regs->r7;
+        case '8': return regs->r8;
+        case '9': return regs->r9;
       }
     }
     else if (reg[1] == '1') { // r10-r12
       switch(reg[2]) {
-        case '0': return save_registers.r10;
-        case '1': return save_registers.r11;
-        case '2': return save_registers.r12;
+        case '0': return regs->r10;
+        case '1': return regs->r11;
+        case '2': return regs->r12;
       }
     }
   }
-  else if (strcmp(reg, "lr")==0) return save_registers.lr;
-  else if (strcmp(reg, "pc")==0) return save_registers.pc;
-  else if (strcmp(reg, "sp")==0) return save_registers.sp;
-  else if (strcmp(reg, "cpsr")==0) return save_registers.xPSR;
+#if GDB_RELOC_POOL
+  // report addresses in relocated code as the original so they match symbols
+  else if (strcmp(reg, "lr")==0) return reloc_toOriginal(regs->lr);
+  else if (strcmp(reg, "pc")==0) return reloc_toOriginal(regs->pc);
+#else
+  else if (strcmp(reg, "lr")==0) return regs->lr;
+  else if (strcmp(reg, "pc")==0) return regs->pc;
+#endif
+  else if (strcmp(reg, "sp")==0) return regs->sp;
+  else if (strcmp(reg, "cpsr")==0) return regs->xPSR;
   return -1;
 }
 
@@ -1009,8 +3287,13 @@ int debug_setRegister(const char *reg, uint32_t value) {
       }
     }
   }
+#if GDB_RELOC_POOL
+  else if (strcmp(reg, "lr")==0) save_registers.lr = reloc_toCopy(value);
+  else if (strcmp(reg, "pc")==0) save_registers.pc = reloc_toCopy(value);
+#else
   else if (strcmp(reg, "lr")==0) save_registers.lr = value;
   else if (strcmp(reg, "pc")==0) save_registers.pc = value;
+#endif
   else if (strcmp(reg, "sp")==0) save_registers.sp = value;
   else if (strcmp(reg, "cpsr")==0) save_registers.xPSR = value;
   else {
@@ -1032,6 +3315,8 @@ int debug_restoreRunMode() {
  * Fault debug messages
  */
 
+#if GDB_FEATURE_SERIAL_DIAG
+
 /**
  * @brief Blink LED in infinite loop
  * 
@@ -1051,8 +3336,12 @@ void flash_blink(int n) {
   }
 }
 
+#endif // GDB_FEATURE_SERIAL_DIAG
+
 int debug_crash = 0;
 
+#if GDB_FEATURE_SERIAL_DIAG
+
 /**
  * @brief Default handler for faults
  * 
@@ -1074,6 +3363,10 @@ void hard_fault_debug(int n) {
   flash_blink(n);
 }
 
+#endif // GDB_FEATURE_SERIAL_DIAG
+
+#ifndef GDB_HOST_SIM
+
 extern "C" 
 __attribute__((noinline, naked)) 
 void fault_halt() {
@@ -1085,7 +3378,7 @@ void fault_halt() {
 #pragma GCC push_options
 #pragma GCC optimize ("O0")
 
-#ifdef DISPLAY_HARD_FAULT
+#if defined(DISPLAY_HARD_FAULT) && GDB_FEATURE_SERIAL_DIAG
 
 // Save registers during fault and call default handler
 #define fault_isr_stack(fault) \
@@ -1113,18 +3406,87 @@ void fault_halt() {
  * 
  */
 __attribute__((noinline, naked)) void call_nmi_isr(void) { fault_isr_stack(2); }
+#if GDB_DEBUGMON
+// a breakpoint in code that DebugMonitor can't preempt comes here first
+__attribute__((noinline, naked)) void call_hard_fault_isr(void) {
+  asm volatile(
+    "tst lr, #4 \n"
+    "ite eq \n"
+    "mrseq r0, msp \n"
+    "mrsne r0, psp \n"
+    "push {r4-r11} \n"
+    "mov r1, sp \n"
+    "mov r2, lr \n"
+    "push {r0, lr} \n"
+    "bl debugmon_escalated \n"
+    "pop {r1, lr} \n"
+    "pop {r4-r11} \n"
+    "cbz r0, 1f \n"
+    "bx lr \n"
+    "1: \n"
+  );
+  fault_isr_stack(3);
+}
+#else
 __attribute__((noinline, naked)) void call_hard_fault_isr(void) { fault_isr_stack(3); }
+#endif
+#if GDB_DEBUGMON
+// MPU watchpoints and stack guards are handled here; other faults are
+// reported. mpu_fault() runs on its own stack in case the fault was a
+// stack overflow.
+__attribute__((noinline, naked)) void call_memmanage_fault_isr(void) {
+  asm volatile(
+    "tst lr, #4 \n"
+    "ite eq \n"
+    "mrseq r0, msp \n"
+    "mrsne r0, psp \n"
+    "mov r1, lr \n"
+#if GDB_STACK_GUARD
+    "mrs r2, msp \n"
+    "ldr r3, =mpu_fault_top \n"
+    "ldr r3, [r3] \n"
+    "msr msp, r3 \n"
+    "push {r2, lr} \n"
+    "bl mpu_fault \n"
+    "pop {r2, lr} \n"
+    "cmp r0, #1 \n"
+    "bhi 2f \n"
+    "msr msp, r2 \n"
+#else
+    "push {r0, lr} \n"
+    "bl mpu_fault \n"
+    "pop {r1, lr} \n"
+#endif
+    "cbz r0, 1f \n"
+    "bx lr \n"
+#if GDB_STACK_GUARD
+    "2: \n"
+    "msr msp, r0 \n"
+    "ldr r1, =mpu_rescue_exc_return \n"
+    "ldr lr, [r1] \n"
+    "bx lr \n"
+#endif
+    "1: \n"
+  );
+  fault_isr_stack(4);
+}
+#else
 __attribute__((noinline, naked)) void call_memmanage_fault_isr(void) { fault_isr_stack(4); } 
+#endif
 __attribute__((noinline, naked)) void call_bus_fault_isr(void)  { fault_isr_stack(5); }
 __attribute__((noinline, naked)) void call_usage_fault_isr(void)  { fault_isr_stack(6); }
 
 #pragma GCC pop_options
 
+#endif // GDB_HOST_SIM
+
 /**
  * Initialization code
  * 
  */
 
+#if GDB_FEATURE_SERIAL_DIAG
+
 /**
  * @brief Utility function to display memory.
  * 
@@ -1132,7 +3494,7 @@ __attribute__((noinline, naked)) void call_usage_fault_isr(void)  { fault_isr_st
  * @param sz 
  */
 void dumpmem(void *mem, int sz) {
-  Serial.print((uint32_t)mem, HEX);
+  Serial.print((uint32_t)(uintptr_t)mem, HEX);
   Serial.print("=");
   for(int i=0; i<sz; i++) {
     Serial.print(((uint8_t*)mem)[i], HEX);
@@ -1141,16 +3503,454 @@ void dumpmem(void *mem, int sz) {
   Serial.println();
 }
 
+#endif // GDB_FEATURE_SERIAL_DIAG
+
 // store the address of the stack pointer where we pre-allocate space since the remap
 // table must be in ram above 0x20000000 and this ram is in the stack area.
 uint32_t save_stack;
 
-#ifdef __IMXRT1062__
+#if defined(GDB_HOST_SIM)
+// no vectors to take over
+#elif defined(__IMXRT1062__)
 extern "C" void unused_interrupt_vector(void);
 #else
 extern "C" void unused_isr(void);
 #endif
 
+/**
+ * @brief Interrupt priorities while the program is stopped. The halt
+ * runs in IRQ_DEBUG (and DebugMonitor) at debug_halt_priority, so code
+ * of lower priority stops and higher priority interrupts keep running.
+ * debug_freeze_priority raises BASEPRI while stopped to hold off some of
+ * those as well. Both stay below the interrupts that talk to GDB.
+ * 
+ */
+
+uint8_t debug_halt_priority = GDB_HALT_PRIORITY;
+uint8_t debug_freeze_priority = GDB_FREEZE_PRIORITY;
+
+// priorities have 4 bits on Teensy 3.x and 4.x; anything below
+// GDB_PRIORITY_MIN would round down to the transport's own level
+static int debug_priority(int p) {
+  if (p < GDB_PRIORITY_MIN || p > 255) return -1;
+  return p & 0xF0;
+}
+
+/**
+ * @brief Set the priority of the halt; a breakpoint in an interrupt
+ * stops only if the interrupt has lower priority (a larger number)
+ * 
+ * @param p Priority, 144 to 255
+ * @return int 0 = success; -1 = it would block GDB's interrupts
+ */
+int debug_setHaltPriority(int p) {
+  p = debug_priority(p);
+  if (p < 0) return -1;
+  debug_halt_priority = p;
+#ifndef GDB_HOST_SIM
+  NVIC_SET_PRIORITY(IRQ_DEBUG, p);
+#endif
+#if GDB_DEBUGMON
+  if (debugmon_enabled) ARM_SHPR3 = (ARM_SHPR3 & ~0xFF) | p;
+#endif
+  return 0;
+}
+
+/**
+ * @brief Hold off interrupts of priority p and lower while stopped
+ * 
+ * @param p Priority, 144 to 255, or 0 to let them run
+ * @return int 0 = success; -1 = it would block GDB's interrupts
+ */
+int debug_setFreezePriority(int p) {
+  if (p) p = debug_priority(p);
+  if (p < 0) return -1;
+  debug_freeze_priority = p;
+  return 0;
+}
+
+/**
+ * @brief Raise BASEPRI to the freeze priority for a stop
+ * 
+ * @return uint32_t BASEPRI to give back to debug_thaw()
+ */
+uint32_t debug_freeze() {
+#ifdef GDB_HOST_SIM
+  return 0;
+#else
+  uint32_t basepri;
+  asm volatile("mrs %0, basepri" : "=r" (basepri));
+  if (debug_freeze_priority) {
+    // with interrupts off, so the new level holds from the next
+    // instruction on the Cortex-M7 (erratum 837070)
+    __disable_irq();
+    asm volatile("msr basepri_max, %0" :: "r" (debug_freeze_priority) : "memory");
+    __enable_irq();
+  }
+  return basepri;
+#endif
+}
+
+void debug_thaw(uint32_t basepri) {
+#ifndef GDB_HOST_SIM
+  asm volatile("msr basepri, %0" :: "r" (basepri) : "memory");
+#endif
+}
+
+/**
+ * @brief Watchdogs while stopped. A stop can outlast any watchdog
+ * timeout, so the debugger feeds the ones that are running while it
+ * waits for GDB, or with GDB_WATCHDOG_SUSPEND turns them off for the
+ * stop where the hardware still allows it. A watchdog that was set up to
+ * be locked stays on and is fed, and a suspended one is put back with
+ * its own settings before the program runs again; the debugger never
+ * leaves one off.
+ * 
+ */
+
+uint8_t debug_watchdog_mode = GDB_WATCHDOG;
+
+#if defined(__IMXRT1062__)
+
+// WDOG1 and WDOG2 can't be turned off once on; RTWDOG can be until its
+// UPDATE bit is cleared
+#define WATCHDOG_COUNT 3
+#define WATCHDOG_ENABLE 0x80 // RTWDOG_CS EN
+static const char *const watchdog_names[WATCHDOG_COUNT] = { "WDOG1", "WDOG2", "RTWDOG" };
+
+static int watchdog_running(int n) {
+  if (n == 0) return (CCM_CCGR3 & CCM_CCGR3_WDOG1(3)) && (WDOG1_WCR & 0x04); // WDE
+  if (n == 1) return (CCM_CCGR5 & CCM_CCGR5_WDOG2(3)) && (WDOG2_WCR & 0x04);
+  return (CCM_CCGR5 & CCM_CCGR5_WDOG3(3)) && (RTWDOG_CS & 0x80); // EN
+}
+
+static int watchdog_mutable(int n) {
+  return n == 2 && (RTWDOG_CS & 0x20); // UPDATE
+}
+
+static uint32_t watchdog_control(int n) {
+  return RTWDOG_CS;
+}
+
+static void watchdog_feed(int n) {
+  if (n < 2) {
+    volatile uint16_t *wsr = n ? &WDOG2_WSR : &WDOG1_WSR;
+    *wsr = 0x5555;
+    *wsr = 0xAAAA;
+    return;
+  }
+  uint32_t cs = RTWDOG_CS;
+  // in window mode a refresh before the window opens resets the board
+  if ((cs & 0x1000) && RTWDOG_CNT < RTWDOG_WIN) return;
+  __disable_irq();
+  if (cs & 0x2000) { // CMD32EN
+    RTWDOG_CNT = 0xB480A602;
+  }
+  else {
+    RTWDOG_CNT = 0xA602;
+    RTWDOG_CNT = 0xB480;
+  }
+  __enable_irq();
+}
+
+static void watchdog_setControl(int n, uint32_t cs) {
+  uint32_t toval = RTWDOG_TOVAL;
+  __disable_irq();
+  if (RTWDOG_CS & 0x2000) {
+    RTWDOG_CNT = 0xD928C520;
+  }
+  else {
+    RTWDOG_CNT = 0xC520;
+    RTWDOG_CNT = 0xD928;
+  }
+  while ((RTWDOG_CS & 0x800) == 0) ; // ULK
+  RTWDOG_TOVAL = toval;
+  RTWDOG_CS = cs & ~0x4000; // FLG is write 1 to clear; leave it
+  __enable_irq();
+  while ((RTWDOG_CS & 0x400) == 0) ; // RCS: new settings in effect
+}
+
+#elif defined(__MK20DX256__) || defined(__MK66FX1M0__)
+
+// WDOG can be reconfigured while ALLOWUPDATE is set, as Teensy's startup
+// code leaves it
+#define WATCHDOG_COUNT 1
+#define WATCHDOG_ENABLE 0x01 // WDOG_STCTRLH WDOGEN
+static const char *const watchdog_names[WATCHDOG_COUNT] = { "WDOG" };
+
+static int watchdog_running(int n) {
+  return WDOG_STCTRLH & 0x01; // WDOGEN
+}
+
+static int watchdog_mutable(int n) {
+  return WDOG_STCTRLH & 0x10; // ALLOWUPDATE
+}
+
+static uint32_t watchdog_control(int n) {
+  return WDOG_STCTRLH;
+}
+
+static void watchdog_feed(int n) {
+  // in window mode a refresh before the window opens resets the board
+  if ((WDOG_STCTRLH & 0x08) &&
+      ((WDOG_TMROUTH << 16) | WDOG_TMROUTL) < ((WDOG_WINH << 16) | WDOG_WINL)) return;
+  __disable_irq();
+  WDOG_REFRESH = 0xA602;
+  WDOG_REFRESH = 0xB480;
+  __enable_irq();
+}
+
+static void watchdog_setControl(int n, uint32_t ctrl) {
+  __disable_irq();
+  WDOG_UNLOCK = 0xC520;
+  WDOG_UNLOCK = 0xD928;
+  asm volatile("nop");
+  asm volatile("nop");
+  WDOG_STCTRLH = ctrl;
+  __enable_irq();
+}
+
+#else
+
+#define WATCHDOG_COUNT 0
+#define WATCHDOG_ENABLE 0
+static const char *const watchdog_names[1] = { "" };
+static int watchdog_running(int n) { return 0; }
+static int watchdog_mutable(int n) { return 0; }
+static uint32_t watchdog_control(int n) { return 0; }
+static void watchdog_feed(int n) {}
+static void watchdog_setControl(int n, uint32_t ctrl) {}
+
+#endif
+
+// control register of each watchdog suspended for this stop; 0 = none
+static uint32_t watchdog_saved[WATCHDOG_COUNT + 1];
+
+/**
+ * @brief Choose what happens to running watchdogs while stopped
+ * 
+ * @param mode GDB_WATCHDOG_OFF, GDB_WATCHDOG_FEED or GDB_WATCHDOG_SUSPEND
+ * @return int 0 = success; -1 = no such mode
+ */
+int debug_setWatchdogMode(int mode) {
+  if (mode < GDB_WATCHDOG_OFF || mode > GDB_WATCHDOG_SUSPEND) return -1;
+  debug_watchdog_mode = mode;
+  return 0;
+}
+
+/**
+ * @brief State of a watchdog, for 'monitor watchdog'
+ * 
+ * @param n Watchdog number, from 0
+ * @param name Set to its name
+ * @return int WATCHDOG_*; WATCHDOG_ABSENT past the last one
+ */
+int debug_watchdogState(int n, const char **name) {
+  if (n < 0 || n >= WATCHDOG_COUNT) return WATCHDOG_ABSENT;
+  *name = watchdog_names[n];
+  if (watchdog_saved[n]) return WATCHDOG_SUSPENDED;
+  if (! watchdog_running(n)) return WATCHDOG_IDLE;
+  return watchdog_mutable(n) ? WATCHDOG_MUTABLE : WATCHDOG_RUNNING;
+}
+
+/**
+ * @brief At the start of a stop, turn off the watchdogs that allow it if
+ * the mode is GDB_WATCHDOG_SUSPEND
+ * 
+ */
+void debug_watchdogHalt() {
+  if (debug_watchdog_mode != GDB_WATCHDOG_SUSPEND) return;
+  for (int n=0; n<WATCHDOG_COUNT; n++) {
+    if (watchdog_saved[n] || ! watchdog_running(n) || ! watchdog_mutable(n)) continue;
+    uint32_t ctrl = watchdog_control(n);
+    watchdog_setControl(n, ctrl & ~WATCHDOG_ENABLE);
+    watchdog_saved[n] = ctrl;
+  }
+}
+
+/**
+ * @brief Called while waiting for GDB; refreshes running watchdogs once
+ * a millisecond unless the mode is GDB_WATCHDOG_OFF
+ * 
+ */
+void debug_watchdogFeed() {
+  static uint32_t fed;
+  if (debug_watchdog_mode == GDB_WATCHDOG_OFF || millis() == fed) return;
+  fed = millis();
+  for (int n=0; n<WATCHDOG_COUNT; n++) {
+    if (watchdog_running(n)) watchdog_feed(n);
+  }
+}
+
+/**
+ * @brief At the end of a stop, put back the watchdogs suspended for it,
+ * counting from a full timeout
+ * 
+ */
+void debug_watchdogResume() {
+  for (int n=0; n<WATCHDOG_COUNT; n++) {
+    if (watchdog_saved[n] == 0) continue;
+    watchdog_setControl(n, watchdog_saved[n]);
+    watchdog_saved[n] = 0;
+    watchdog_feed(n);
+  }
+}
+
+/**
+ * @brief Time across a stop. The clock runs on while the program is
+ * stopped, so after a few seconds in GDB its timeouts and rate limits
+ * all fire at once. With GDB_TIME_VIRTUAL the time stopped is taken off
+ * systick_millis_count on resume, which moves millis() and micros()
+ * back by whole milliseconds. The part below a millisecond is left, so
+ * neither goes backwards from what the program saw before the stop.
+ * GDB_TIME_FROZEN also stops
+ * the program's PIT channels (not the debugger's own) and the GPTs, and
+ * starts them again where they were. The cycle counter is left alone;
+ * the debugger times itself with it.
+ * 
+ */
+
+uint8_t debug_time_mode = GDB_TIME;
+debug_time_stats_struct debug_time_stats;
+
+// PIT channel of the debugger's IntervalTimer, as a bit; set by gdb_init()
+uint8_t debug_time_own_pit;
+
+static uint32_t time_halt_ms;
+static uint32_t time_halt_us;
+static uint8_t time_halt_mode;
+
+#if defined(__IMXRT1062__)
+#define PIT_CHANNELS IMXRT_PIT_CHANNELS
+#define PIT_CLOCKED() (CCM_CCGR1 & CCM_CCGR1_PIT(3))
+#elif defined(__MK20DX256__) || defined(__MK66FX1M0__)
+#define PIT_CHANNELS KINETISK_PIT_CHANNELS
+#define PIT_CLOCKED() (SIM_SCGC6 & SIM_SCGC6_PIT)
+#endif
+
+#ifdef PIT_CHANNELS
+
+// PIT channels paused for this stop, and where each was
+static uint8_t time_pit_paused;
+static uint32_t time_pit_count[4];
+
+#if defined(__IMXRT1062__)
+// GPT1 and GPT2 paused for this stop; they keep their count (ENMOD = 0)
+static uint8_t time_gpt_paused;
+
+static volatile uint32_t *time_gpt(int n) {
+  if (n == 0) return (CCM_CCGR1 & CCM_CCGR1_GPT1_BUS(3)) ? &GPT1_CR : NULL;
+  return (CCM_CCGR0 & CCM_CCGR0_GPT2_BUS(3)) ? &GPT2_CR : NULL;
+}
+#endif
+
+#endif // PIT_CHANNELS
+
+/**
+ * @brief PIT channels that are counting
+ * 
+ * @return uint8_t Bit n set if channel n is
+ */
+uint8_t debug_pitRunning() {
+  uint8_t running = 0;
+#ifdef PIT_CHANNELS
+  if (! PIT_CLOCKED()) return 0;
+  for (int n=0; n<4; n++) {
+    if (PIT_CHANNELS[n].TCTRL & 1) running |= 1 << n; // TEN
+  }
+#endif
+  return running;
+}
+
+// stop the program's timers
+static void time_pause() {
+#ifdef PIT_CHANNELS
+  time_pit_paused = debug_pitRunning() & ~debug_time_own_pit;
+  for (int n=0; n<4; n++) {
+    if ((time_pit_paused & (1 << n)) == 0) continue;
+    time_pit_count[n] = PIT_CHANNELS[n].CVAL;
+    PIT_CHANNELS[n].TCTRL &= ~1;
+  }
+#if defined(__IMXRT1062__)
+  time_gpt_paused = 0;
+  for (int n=0; n<2; n++) {
+    volatile uint32_t *cr = time_gpt(n);
+    if (cr && (*cr & 1)) { // EN
+      *cr &= ~1;
+      time_gpt_paused |= 1 << n;
+    }
+  }
+#endif
+#endif
+}
+
+// start them again where they were
+static void time_unpause() {
+#ifdef PIT_CHANNELS
+  for (int n=0; n<4; n++) {
+    if ((time_pit_paused & (1 << n)) == 0) continue;
+    // enabling loads LDVAL; the period is put back for the reload after
+    uint32_t period = PIT_CHANNELS[n].LDVAL;
+    PIT_CHANNELS[n].LDVAL = time_pit_count[n];
+    PIT_CHANNELS[n].TCTRL |= 1;
+    PIT_CHANNELS[n].LDVAL = period;
+  }
+  time_pit_paused = 0;
+#if defined(__IMXRT1062__)
+  for (int n=0; n<2; n++) {
+    if (time_gpt_paused & (1 << n)) *time_gpt(n) |= 1;
+  }
+  time_gpt_paused = 0;
+#endif
+#endif
+}
+
+/**
+ * @brief Choose the time the program sees across a stop
+ * 
+ * @param mode GDB_TIME_REAL, GDB_TIME_VIRTUAL or GDB_TIME_FROZEN
+ * @return int 0 = success; -1 = no such mode
+ */
+int debug_setTimeMode(int mode) {
+  if (mode < GDB_TIME_REAL || mode > GDB_TIME_FROZEN) return -1;
+  debug_time_mode = mode;
+  return 0;
+}
+
+/**
+ * @brief At the start of a stop, note the time and pause the timers
+ * 
+ */
+void debug_timeHalt() {
+  time_halt_mode = debug_time_mode;
+  if (time_halt_mode == GDB_TIME_REAL) return;
+  if (time_halt_mode == GDB_TIME_FROZEN) time_pause();
+  time_halt_ms = millis();
+  time_halt_us = micros();
+}
+
+/**
+ * @brief At the end of a stop, take the time stopped off the clock and
+ * start the timers again
+ * 
+ */
+void debug_timeResume() {
+  if (time_halt_mode == GDB_TIME_REAL) return;
+  uint32_t ms = millis() - time_halt_ms;
+  // micros() wraps after 71 minutes; it only adds the part below a ms
+  int32_t part = (int32_t)((micros() - time_halt_us) - ms * 1000);
+  uint32_t take = ((int64_t)ms * 1000 + part) / 1000;
+  __disable_irq();
+  systick_millis_count -= take;
+  __enable_irq();
+
+  if (time_halt_mode == GDB_TIME_FROZEN) time_unpause();
+  debug_time_stats.count++;
+  debug_time_stats.last = take;
+  if (take > debug_time_stats.max) debug_time_stats.max = take;
+  debug_time_stats.total += take;
+}
+
 /**
  * @brief Initialize debugging system.
  * 
@@ -1192,6 +3992,12 @@ void debug_init() {
 
   debug_trace = 1;
 
+#ifndef GDB_HOST_SIM
+  // cycle counter times code patches and stopwatches (already running
+  // on Teensy 4)
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
   _VectorsRam[2] = call_nmi_isr;
   _VectorsRam[3] = call_hard_fault_isr;
   _VectorsRam[4] = call_memmanage_fault_isr;
@@ -1214,10 +4020,28 @@ void debug_init() {
   original_software_isr = _VectorsRam[IRQ_DEBUG + 16];
 
   _VectorsRam[IRQ_DEBUG + 16] = debug_call_isr;
-  NVIC_SET_PRIORITY(IRQ_DEBUG, 208); // 255 = lowest priority
+  NVIC_SET_PRIORITY(IRQ_DEBUG, debug_halt_priority); // 255 = lowest priority
   NVIC_ENABLE_IRQ(IRQ_DEBUG);
+#endif // GDB_HOST_SIM
+
+#if GDB_DEBUGMON
+  _VectorsRam[12] = debugmon_isr;
+  debugmon_init();
+#endif
+
+#if GDB_RELOC_POOL
+  // redirect calls to relocated flash functions; fails if a debug probe is attached
+  reloc_enabled = (reloc_init() == 0);
+#endif
+
+#if GDB_STACK_GUARD
+  // the main stack grows down from the top of DTCM towards .bss
+  debug_stackGuard(&_ebss, 1);
+#endif
 
   debug_initBreakpoints();
+  // what GDB had set before it reset the Teensy
+  debug_persistRestore();
 }
 
 void gdb_init(Stream *device);
@@ -1281,6 +4105,22 @@ void __attribute__((naked)) setup() {
 int Debug::begin(Stream *device) { return debug_begin(device); }
 int Debug::setBreakpoint(void *p) { return debug_setBreakpoint(p); }
 int Debug::clearBreakpoint(void *p) { return debug_clearBreakpoint(p); }
+int Debug::ignoreBreakpoint(void *p, uint32_t count) { return debug_ignoreBreakpoint(p, count); }
+uint32_t Debug::breakpointHits(void *p) { return debug_breakpointHits(p); }
+#if GDB_STOPWATCHES
+int Debug::setStopwatch(void *start, void *stop) { return debug_setStopwatch(start, stop); }
+int Debug::clearStopwatch(int n) { return debug_clearStopwatch(n); }
+#else
+int Debug::setStopwatch(void *start, void *stop) { return -1; }
+int Debug::clearStopwatch(int n) { return -1; }
+#endif
+int Debug::setHaltPriority(int p) { return debug_setHaltPriority(p); }
+int Debug::freezeInterrupts(int p) { return debug_setFreezePriority(p); }
+int Debug::setWatchdogMode(int mode) { return debug_setWatchdogMode(mode); }
+int Debug::setTimeMode(int mode) { return debug_setTimeMode(mode); }
+int Debug::setWatchpoint(void *p, int len, int type) { return debug_setWatchpoint(p, len, type); }
+int Debug::clearWatchpoint(void *p, int len, int type) { return debug_clearWatchpoint(p, len, type); }
+int Debug::stackGuard(void *bottom, int on) { return debug_stackGuard(bottom, on); }
 void Debug::setCallback(void (*c)()) { callback = c; }
 uint32_t Debug::getRegister(const char *reg) { return debug_getRegister(reg); }
 int Debug::setRegister(const char *reg, uint32_t value) { return debug_setRegister(reg, value); }
@@ -23,6 +23,268 @@
 // use IRQ_SOFTWARE+1 (a.k.a. IRQ_Reserved2) for Teensy 4.x
 #define IRQ_DEBUG IRQ_SOFTWARE
 
+//
+// Feature profiles. These strip unused subsystems and size buffers to
+// save RAM and flash, which matters on the Teensy 3.2. The Arduino IDE
+// doesn't pass #defines from the sketch to libraries, so select a profile
+// with a build flag, e.g. -DGDB_PROFILE=GDB_PROFILE_MINIMAL. Any of the
+// GDB_FEATURE_* or size settings below can also be overridden one by one.
+//
+//   MINIMAL  - breakpoints, stepping, registers and memory only
+//   STANDARD - adds monitor commands and File-I/O
+//   FULL     - everything, including monitor call() and Serial diagnostics
+//
+
+#define GDB_PROFILE_MINIMAL  1
+#define GDB_PROFILE_STANDARD 2
+#define GDB_PROFILE_FULL     3
+
+#ifndef GDB_PROFILE
+#define GDB_PROFILE GDB_PROFILE_FULL
+#endif
+
+#if GDB_PROFILE == GDB_PROFILE_MINIMAL
+#define GDB_PROFILE_MONITOR     0
+#define GDB_PROFILE_CALL        0
+#define GDB_PROFILE_FILEIO      0
+#define GDB_PROFILE_SERIAL_DIAG 0
+#define GDB_PROFILE_PACKET_SIZE 256
+#define GDB_PROFILE_SEND_SIZE   128
+#define GDB_PROFILE_SW_BREAKS   8
+#define GDB_PROFILE_HIT_COUNTS  8
+#define GDB_PROFILE_PERSIST     0
+#define GDB_PROFILE_STOPWATCHES 0
+#define GDB_PROFILE_RELOC_POOL  0
+#define GDB_PROFILE_COVERAGE    0
+#define GDB_PROFILE_RECORD      0
+#elif GDB_PROFILE == GDB_PROFILE_STANDARD
+#define GDB_PROFILE_MONITOR     1
+#define GDB_PROFILE_CALL        0
+#define GDB_PROFILE_FILEIO      1
+#define GDB_PROFILE_SERIAL_DIAG 0
+#define GDB_PROFILE_PACKET_SIZE 512
+#define GDB_PROFILE_SEND_SIZE   256
+#define GDB_PROFILE_SW_BREAKS   16
+#define GDB_PROFILE_HIT_COUNTS  16
+#define GDB_PROFILE_PERSIST     16
+#define GDB_PROFILE_STOPWATCHES 2
+#define GDB_PROFILE_RELOC_POOL  2048
+#define GDB_PROFILE_COVERAGE    256
+#define GDB_PROFILE_RECORD      0
+#elif GDB_PROFILE == GDB_PROFILE_FULL
+#define GDB_PROFILE_MONITOR     1
+#define GDB_PROFILE_CALL        1
+#define GDB_PROFILE_FILEIO      1
+#define GDB_PROFILE_SERIAL_DIAG 1
+#define GDB_PROFILE_PACKET_SIZE 1024
+#define GDB_PROFILE_SEND_SIZE   256
+#define GDB_PROFILE_SW_BREAKS   32
+#define GDB_PROFILE_HIT_COUNTS  32
+#define GDB_PROFILE_PERSIST     32
+#define GDB_PROFILE_STOPWATCHES 4
+#define GDB_PROFILE_RELOC_POOL  4096
+#define GDB_PROFILE_COVERAGE    1024
+#define GDB_PROFILE_RECORD      32768
+#else
+#error "GDB_PROFILE must be GDB_PROFILE_MINIMAL, GDB_PROFILE_STANDARD or GDB_PROFILE_FULL"
+#endif
+
+// 'monitor' commands (qRcmd)
+#ifndef GDB_FEATURE_MONITOR
+#define GDB_FEATURE_MONITOR GDB_PROFILE_MONITOR
+#endif
+
+// 'monitor call(addr,...)'; needs GDB_FEATURE_MONITOR
+#ifndef GDB_FEATURE_CALL
+#define GDB_FEATURE_CALL (GDB_PROFILE_CALL && GDB_FEATURE_MONITOR)
+#endif
+
+// debug.file_*() through GDB's File-I/O extension
+#ifndef GDB_FEATURE_FILEIO
+#define GDB_FEATURE_FILEIO GDB_PROFILE_FILEIO
+#endif
+
+// print_registers(), fault text and other diagnostics that pull in Serial
+#ifndef GDB_FEATURE_SERIAL_DIAG
+#define GDB_FEATURE_SERIAL_DIAG GDB_PROFILE_SERIAL_DIAG
+#endif
+
+// Largest packet GDB may send us; also the size of the reply buffer
+#ifndef GDB_PACKET_SIZE
+#define GDB_PACKET_SIZE GDB_PROFILE_PACKET_SIZE
+#endif
+
+// GDB's qSupported is about 180 chars and the 'g' reply 136, and
+// neither can be cut short
+#if GDB_PACKET_SIZE < 256
+#error "GDB_PACKET_SIZE must be at least 256"
+#endif
+
+// Buffer for asynchronous messages ('O' console output, etc.)
+#ifndef GDB_SEND_SIZE
+#define GDB_SEND_SIZE GDB_PROFILE_SEND_SIZE
+#endif
+
+// Buffer for File-I/O requests; fits "Fopen,pppppppp/llllllll,ffffffff,mmmmmmmm"
+#define GDB_FILEIO_SIZE 48
+
+// Number of software (RAM) breakpoints
+#ifndef GDB_SW_BREAKPOINTS
+#define GDB_SW_BREAKPOINTS GDB_PROFILE_SW_BREAKS
+#endif
+
+// Number of breakpoint addresses with hit counters and ignore counts.
+// They outlive the breakpoint itself, since GDB takes breakpoints out
+// and puts them back at every stop.
+#ifndef GDB_HIT_COUNTS
+#define GDB_HIT_COUNTS GDB_PROFILE_HIT_COUNTS
+#endif
+
+// Number of breakpoint("name") sites that can be turned on by name; each
+// takes a bit to remember it was turned on
+#ifndef GDB_SITES
+#define GDB_SITES 64
+#endif
+
+// Number of breakpoints kept in RAM that survives a reset, so that
+// 'monitor restart', 'R' and 'k' bring them back before setup() runs;
+// 0 leaves this out
+#ifndef GDB_PERSIST_BREAKPOINTS
+#define GDB_PERSIST_BREAKPOINTS GDB_PROFILE_PERSIST
+#endif
+
+// Number of stopwatches: breakpoint pairs that time the code between
+// them in cycles without stopping; 0 leaves them out
+#ifndef GDB_STOPWATCHES
+#define GDB_STOPWATCHES GDB_PROFILE_STOPWATCHES
+#endif
+
+// Number of coverage points: one-shot breakpoints planted by
+// extras/coverage.py that take themselves out when first reached; 0
+// leaves coverage out
+#ifndef GDB_COVERAGE
+#define GDB_COVERAGE GDB_PROFILE_COVERAGE
+#endif
+
+// Bytes for the execution record behind reverse stepping: while
+// 'monitor record on', the program runs one instruction at a time and
+// the registers and memory each one changes are kept here, oldest
+// dropped first. Goes in DMAMEM on Teensy 4; define GDB_RECORD_MEMORY
+// as EXTMEM to use PSRAM. Teensy 3.x gets an eighth. 0 leaves it out.
+#ifndef GDB_RECORD
+#if defined(__IMXRT1062__) || defined(GDB_HOST_SIM)
+#define GDB_RECORD GDB_PROFILE_RECORD
+#else
+#define GDB_RECORD (GDB_PROFILE_RECORD / 8)
+#endif
+#endif
+
+// Bytes of RAM (ITCM on Teensy 4) for copies of flash functions that
+// have breakpoints; 0 disables relocation
+#ifndef GDB_RELOC_POOL
+#define GDB_RELOC_POOL GDB_PROFILE_RELOC_POOL
+#endif
+
+// Use the DebugMonitor exception for FPB breakpoints in flash and for
+// single-stepping. Teensy 4 only; Teensy 3.x uses the FPB for remapping.
+// If a debug probe has halting debug on, this turns itself off at run
+// time and SVC breakpoints and predicted stepping are used instead.
+#ifndef GDB_DEBUGMON
+#if defined(__IMXRT1062__)
+#define GDB_DEBUGMON 1
+#else
+#define GDB_DEBUGMON 0
+#endif
+#endif
+
+#if ! GDB_DEBUGMON && ! defined(GDB_HOST_SIM)
+// relocated functions are entered through the DebugMonitor
+#undef GDB_RELOC_POOL
+#define GDB_RELOC_POOL 0
+#endif
+
+// Bytes of no-access MPU guard at the bottom of the main stack, and of
+// thread stacks given to debug.stackGuard(); a power of two of at least
+// 32, or 0 for none. An overflow stops with SIGSEGV and the pc and sp.
+// Teensy 4 only.
+#ifndef GDB_STACK_GUARD
+#define GDB_STACK_GUARD 0
+#endif
+
+// Stack the debugger moves to after a stack overflow
+#ifndef GDB_STACK_RESCUE
+#define GDB_STACK_RESCUE 1024
+#endif
+
+#if ! GDB_DEBUGMON
+// the guard's fault handler is part of the Teensy 4 DebugMonitor code
+#undef GDB_STACK_GUARD
+#define GDB_STACK_GUARD 0
+#endif
+
+#if GDB_STACK_GUARD && ((GDB_STACK_GUARD & (GDB_STACK_GUARD - 1)) || GDB_STACK_GUARD < 32)
+#error "GDB_STACK_GUARD must be a power of two of at least 32"
+#endif
+
+// Priority of the interrupt that stops the program (0 is highest, 255
+// lowest). Breakpoints stop thread code and interrupts of lower priority
+// (a larger number); higher ones keep running while stopped. It must
+// stay below the USB and timer interrupts that carry GDB's packets.
+#ifndef GDB_HALT_PRIORITY
+#define GDB_HALT_PRIORITY 208
+#endif
+
+// While stopped, hold off interrupts of this priority and lower with
+// BASEPRI, even those that would preempt the halt; 0 = off
+#ifndef GDB_FREEZE_PRIORITY
+#define GDB_FREEZE_PRIORITY 0
+#endif
+
+// USB and IntervalTimer interrupts run at this priority on Teensy
+#define GDB_TRANSPORT_PRIORITY 128
+
+// priorities go in steps of 16 (the low 4 bits are dropped), so the
+// lowest usable one is a whole step below the transport
+#define GDB_PRIORITY_MIN (GDB_TRANSPORT_PRIORITY + 16)
+
+#if GDB_HALT_PRIORITY < GDB_PRIORITY_MIN || GDB_HALT_PRIORITY > 255
+#error "GDB_HALT_PRIORITY must be between 144 and 255"
+#endif
+
+#if GDB_FREEZE_PRIORITY && (GDB_FREEZE_PRIORITY < GDB_PRIORITY_MIN || GDB_FREEZE_PRIORITY > 255)
+#error "GDB_FREEZE_PRIORITY must be 0 or between 144 and 255"
+#endif
+
+// What happens to running watchdogs while stopped: OFF leaves them alone,
+// so a stop longer than the timeout resets the board; FEED refreshes
+// them; SUSPEND turns off those that can still be reconfigured, feeds
+// the rest, and puts them back as they were when the program carries on
+#define GDB_WATCHDOG_OFF     0
+#define GDB_WATCHDOG_FEED    1
+#define GDB_WATCHDOG_SUSPEND 2
+#ifndef GDB_WATCHDOG
+#define GDB_WATCHDOG GDB_WATCHDOG_FEED
+#endif
+
+#if GDB_WATCHDOG < GDB_WATCHDOG_OFF || GDB_WATCHDOG > GDB_WATCHDOG_SUSPEND
+#error "GDB_WATCHDOG must be GDB_WATCHDOG_OFF, GDB_WATCHDOG_FEED or GDB_WATCHDOG_SUSPEND"
+#endif
+
+// Time the program sees across a stop: REAL lets the clock run on;
+// VIRTUAL takes the time stopped off millis() and micros() on resume;
+// FROZEN also pauses the program's PIT (IntervalTimer) channels and, on
+// Teensy 4, GPT1 and GPT2 while stopped
+#define GDB_TIME_REAL    0
+#define GDB_TIME_VIRTUAL 1
+#define GDB_TIME_FROZEN  2
+#ifndef GDB_TIME
+#define GDB_TIME GDB_TIME_REAL
+#endif
+
+#if GDB_TIME < GDB_TIME_REAL || GDB_TIME > GDB_TIME_FROZEN
+#error "GDB_TIME must be GDB_TIME_REAL, GDB_TIME_VIRTUAL or GDB_TIME_FROZEN"
+#endif
+
 //
 // Need to know where RAM starts/stops so we know where
 // software breakpoints are possible
@@ -42,6 +304,14 @@
 #define RAM_END   ((void*)0x2002FFFF)
 #endif
 
+#ifdef GDB_HOST_SIM
+// simulated memory of the host build in extras/host
+#define FLASH_START ((void*)0x60000000)
+#define FLASH_END ((void*)0x600fffff)
+#define RAM_START ((void*)0x20000000)
+#define RAM_END   ((void*)0x2007ffff)
+#endif
+
 #ifdef __IMXRT1062__
 #define FLASH_START ((void*)0x60000000)
 #define FLASH_END ((void*)0x601f0000) // only true for Teensy 4.0
@@ -82,6 +352,208 @@ extern uint8_t external_psram_size;
 // If this is used internally, not need to remap
 #ifdef GDB_DEBUG_INTERNAL
 
+// Code patching with cache maintenance (TeensyDebug.cpp)
+void debug_syncCode(void *addr, int size);
+uint16_t debug_patchCode16(void *addr, uint16_t code);
+uint32_t debug_patchCode32(void *addr, uint32_t code);
+struct debug_patch_stats_struct {
+  uint32_t count;     // number of patches
+  uint32_t last;      // cycles taken by the last one
+  uint32_t max;       // most cycles taken by one
+};
+extern debug_patch_stats_struct debug_patch_stats;
+
+// Ctrl-C from GDB (TeensyDebug.cpp); stats count cycles to the stop
+extern volatile int debug_break_request;
+extern debug_patch_stats_struct debug_interrupt_stats;
+void debug_interrupt();
+
+// Breakpoint traps (TeensyDebug.cpp): cycle counter on the way in and out;
+// debug_fast_hits = 0 sends hits that don't stop through IRQ_DEBUG too
+extern uint32_t debug_trap_cycles;
+extern uint32_t debug_resume_cycles;
+extern int debug_fast_hits;
+
+// FPB comparators driven through the DebugMonitor exception
+#if GDB_DEBUGMON
+#define FPB_BREAK     1   // breakpoint; stops
+#define FPB_REDIRECT  2   // entry of a relocated function; goes to the copy
+int fpb_set(uint32_t addr, int kind);
+int fpb_find(uint32_t addr, int kind);
+void fpb_clear(int n);
+extern int debugmon_enabled;
+#endif
+
+// Breakpoint hit counters and ignore counts (TeensyDebug.cpp)
+struct debug_hits_struct {
+  uint32_t addr;      // breakpoint address as GDB sees it; 0 = free
+  uint32_t hits;      // times reached, including ignored ones
+  uint32_t ignore;    // hits still to go past without stopping
+};
+extern debug_hits_struct debug_hits[];
+int debug_ignoreBreakpoint(void *p, uint32_t count);
+uint32_t debug_breakpointHits(void *p);
+void debug_clearHits();
+
+// Breakpoints of every kind (TeensyDebug.cpp)
+int debug_setBreakpoint(void *p);
+int debug_clearBreakpoint(void *p);
+int debug_isBreakpoint(void *p);
+
+// Named breakpoint sites from breakpoint("name") (TeensyDebug.cpp)
+struct debug_site_struct {
+  uint32_t addr;      // the nop
+  char name[];        // then padding to a word
+};
+const debug_site_struct *debug_nextSite(const debug_site_struct *site);
+
+// Stopwatches (TeensyDebug.cpp)
+#if GDB_STOPWATCHES
+#define STOPWATCH_BINS 32
+struct debug_stopwatch_struct {
+  uint32_t start;     // address that starts it; 0 = free
+  uint32_t stop;      // address that stops it; may be the same as start
+  uint32_t started;   // cycle count when it started
+  int running;
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t histogram[STOPWATCH_BINS]; // bin n: 2^n to 2^(n+1)-1 cycles
+};
+extern debug_stopwatch_struct debug_stopwatches[];
+int debug_setStopwatch(void *start, void *stop);
+int debug_clearStopwatch(int n);
+void debug_resetStopwatch(int n);
+#endif
+
+// Coverage points (TeensyDebug.cpp)
+#if GDB_COVERAGE
+extern int debug_cover_count;
+extern uint32_t debug_cover_hit[];
+int debug_coverAdd(uint32_t addr);
+int debug_coverStats(int *hit, int *planted);
+void debug_coverClear();
+#endif
+
+// Execution record for reverse stepping (TeensyDebug.cpp)
+#if GDB_RECORD
+extern int debug_record_on;
+int debug_recordCount(int *bytes);
+void debug_recordClear();
+int debug_replaying();
+int debug_replayMove(int back, int run);
+void debug_replayRead(uint32_t addr, uint8_t *buf, int len);
+#endif
+
+// Breakpoints, watchpoints and stopwatches kept across a reset (TeensyDebug.cpp)
+void debug_persistSave();
+void debug_persistClear();
+int debug_persistRestore();
+
+// Interrupt priorities while stopped (TeensyDebug.cpp)
+extern uint8_t debug_halt_priority;
+extern uint8_t debug_freeze_priority;
+int debug_setHaltPriority(int p);
+int debug_setFreezePriority(int p);
+uint32_t debug_freeze();
+void debug_thaw(uint32_t basepri);
+
+// Watchdogs while stopped (TeensyDebug.cpp)
+#define WATCHDOG_ABSENT     -1  // no such watchdog
+#define WATCHDOG_IDLE       0   // not running
+#define WATCHDOG_RUNNING    1   // running; can only be fed
+#define WATCHDOG_MUTABLE    2   // running; can be suspended
+#define WATCHDOG_SUSPENDED  3   // turned off by the debugger for a stop
+extern uint8_t debug_watchdog_mode;
+int debug_setWatchdogMode(int mode);
+int debug_watchdogState(int n, const char **name);
+void debug_watchdogHalt();
+void debug_watchdogFeed();
+void debug_watchdogResume();
+
+// Time across a stop (TeensyDebug.cpp); milliseconds taken off millis()
+struct debug_time_stats_struct {
+  uint32_t count;     // stops taken off the clock
+  uint32_t last;      // ms taken off after the last one
+  uint32_t max;       // most ms taken off after one
+  uint64_t total;     // ms taken off in all
+};
+extern uint8_t debug_time_mode;
+extern uint8_t debug_time_own_pit;
+extern debug_time_stats_struct debug_time_stats;
+int debug_setTimeMode(int mode);
+uint8_t debug_pitRunning();
+void debug_timeHalt();
+void debug_timeResume();
+
+// Data watchpoints (TeensyDebug.cpp)
+int debug_setWatchpoint(void *p, int len, int type);
+int debug_clearWatchpoint(void *p, int len, int type);
+int debug_watchpointHit(uint32_t *addr);
+int debug_watchpointCount(int *used);
+
+// Stack guards (TeensyDebug.cpp)
+int debug_stackGuard(void *bottom, int on);
+int debug_stackOverflow(uint32_t *pc, uint32_t *sp);
+
+// Relocated flash functions (relocate.cpp)
+#if GDB_RELOC_POOL
+struct reloc_function {
+  uint32_t start;     // original entry
+  uint32_t end;       // end of code and literal pool
+  uint32_t copy;      // address of the copy
+  int breakpoints;    // breakpoints set in the copy
+};
+int reloc_create(uint32_t addr);
+int reloc_find(uint32_t addr);
+int reloc_findCopy(uint32_t addr);
+uint32_t reloc_toCopy(uint32_t addr);
+uint32_t reloc_toOriginal(uint32_t addr);
+int reloc_init();
+int reloc_redirect(int n, int on);
+extern reloc_function reloc_functions[];
+#endif
+
+// Thumb-2 next-PC decoder (nextpc.cpp)
+#define THUMB_SEQ        0   // goes on to the next instruction
+#define THUMB_B_T1       1
+#define THUMB_B_T2       2
+#define THUMB_B_T3       3
+#define THUMB_B_T4       4   // also bl
+#define THUMB_CBZ        5
+#define THUMB_BX         6   // also blx Rm
+#define THUMB_MOV_PC     7
+#define THUMB_ADD_PC     8
+#define THUMB_IT         9
+#define THUMB_TB         10
+#define THUMB_POP        11
+#define THUMB_LDR_LIT    12
+#define THUMB_LDR_IMM12  13
+#define THUMB_LDR_IMM8   14
+#define THUMB_LDR_REG    15
+#define THUMB_LDM        16
+#define THUMB_LDMDB      17
+struct thumb_encoding {
+  uint32_t mask;      // 16-bit: first halfword; 32-bit: both, first in the top
+  uint32_t value;
+  uint8_t width;      // 2 or 4
+  uint8_t kind;       // THUMB_*
+  const char *name;
+};
+struct thumb_cpu {
+  uint32_t r[16];     // r[15] is the address of the instruction
+  uint32_t xpsr;
+  uint32_t (*read)(uint32_t addr, int size);
+};
+extern const thumb_encoding thumb_encodings[];
+extern const int thumb_encoding_count;
+int thumb_width(uint16_t h1);
+int thumb_lookup(uint16_t h1, uint16_t h2);
+int thumb_condition(int cond, uint32_t xpsr);
+uint32_t thumb_nextpc(const thumb_cpu *cpu);
+int thumb_relocatable(uint16_t h1, uint16_t h2);
+int thumb_stores(const thumb_cpu *cpu, uint32_t *addr);
 
 #else
 
@@ -96,8 +568,7 @@ extern uint8_t external_psram_size;
 
 #endif
 
-int hcdebug_isEnabled(int n);
-int hcdebug_setBreakpoint(int n);
+int debug_enableSite(const char *name, int on);
 
 // int debug_setBreakpoint(void *p, int n);
 // int debug_clearBreakpoint(void *p, int n);
@@ -105,9 +576,13 @@ int hcdebug_setBreakpoint(int n);
 // uint32_t debug_getRegister(const char *reg);
 
 size_t gdb_out_write(const uint8_t *msg, size_t len);
+extern int gdb_active_flag;
+
+#if GDB_FEATURE_FILEIO
+
 int gdb_file_io(const char *msg);
+char *gdb_file_io_buffer();
 extern int file_io_errno;
-extern int gdb_active_flag;
 
 // May have been defined elsewhere: assume O_CREAT stands for all
 #if !defined(O_CREAT)
@@ -119,27 +594,30 @@ extern int gdb_active_flag;
 #endif // !defined(O_CREAT)
 
 class DebugFileIO {
-private:
-  char gdb_io[256];
 public:
   int file_errno() { return file_io_errno; }
   int file_open(const char *file, int flags = O_CREAT | O_RDWR, int mode = 0644) {
-    sprintf(gdb_io, "Fopen,%x/%x,%x,%x", (unsigned int)file, strlen(file), flags, mode);
+    char *gdb_io = gdb_file_io_buffer();
+    sprintf(gdb_io, "Fopen,%x/%x,%x,%x", (unsigned int)(uintptr_t)file, (unsigned int)strlen(file), flags, mode);
     return gdb_file_io(gdb_io);
   }
   int file_close(int fd) {
+    char *gdb_io = gdb_file_io_buffer();
     sprintf(gdb_io, "Fclose,%x", fd);
     return gdb_file_io(gdb_io);
   }
   int file_read(int fd, void *buf, unsigned int count) {
-    sprintf(gdb_io, "Fread,%x,%x,%x", fd, (unsigned int)buf, count);
+    char *gdb_io = gdb_file_io_buffer();
+    sprintf(gdb_io, "Fread,%x,%x,%x", fd, (unsigned int)(uintptr_t)buf, count);
     return gdb_file_io(gdb_io);
   }
   int file_write(int fd, const void *buf, unsigned int count) {
-    sprintf(gdb_io, "Fwrite,%x,%x,%x", fd, (unsigned int)buf, count);
+    char *gdb_io = gdb_file_io_buffer();
+    sprintf(gdb_io, "Fwrite,%x,%x,%x", fd, (unsigned int)(uintptr_t)buf, count);
     return gdb_file_io(gdb_io);
   }
   int file_system(const char *buf) {
+    char *gdb_io = gdb_file_io_buffer();
     if (*buf == 0) {
       // if we send empty string, return if shell enabled or not
       // to enable in gdb, use:
@@ -148,12 +626,19 @@ public:
     }
     else {
       // make sure to add string terminator
-      sprintf(gdb_io, "Fsystem,%x/%x", (unsigned int)buf, strlen(buf)+1);
+      sprintf(gdb_io, "Fsystem,%x/%x", (unsigned int)(uintptr_t)buf, (unsigned int)strlen(buf)+1);
     }
     return gdb_file_io(gdb_io);
   }
 };
 
+#else
+
+// File-I/O is compiled out in this profile; debug.file_*() is unavailable
+class DebugFileIO { };
+
+#endif // GDB_FEATURE_FILEIO
+
 class Debug : public Print, public DebugFileIO {
 public:
   int begin(int baud) { return 1; }
@@ -161,6 +646,26 @@ public:
   int begin(Stream &device) { return begin(&device); }
   int setBreakpoint(void *p);
   int clearBreakpoint(void *p);
+  // go past the next count hits of a breakpoint without stopping
+  int ignoreBreakpoint(void *p, uint32_t count);
+  uint32_t breakpointHits(void *p);
+  // time the code from start to stop in cycles without stopping; returns
+  // the stopwatch number or -1
+  int setStopwatch(void *start, void *stop);
+  int clearStopwatch(int n);
+  // type: 2 = write, 3 = read, 4 = access; Teensy 4 only
+  int setWatchpoint(void *p, int len, int type = 2);
+  int clearWatchpoint(void *p, int len, int type = 2);
+  // stop in interrupts of lower priority than p (a larger number)
+  int setHaltPriority(int p);
+  // while stopped, hold off interrupts of priority p and lower; 0 = off
+  int freezeInterrupts(int p);
+  // running watchdogs while stopped: GDB_WATCHDOG_OFF, _FEED or _SUSPEND
+  int setWatchdogMode(int mode);
+  // time across a stop: GDB_TIME_REAL, _VIRTUAL or _FROZEN
+  int setTimeMode(int mode);
+  // guard the bottom of a thread stack; needs GDB_STACK_GUARD
+  int stackGuard(void *bottom, int on = 1);
   void setCallback(void (*c)());
   uint32_t getRegister(const char *reg);
   int setRegister(const char *reg, uint32_t value);
@@ -180,8 +685,18 @@ public:
 
 extern Debug debug;
 
-#define breakpoint(n) do {if (hcdebug_isEnabled(n)) {asm volatile("svc #0x11");}} while (0)
-#define breakpoint_enable(n) do {hcdebug_setBreakpoint(n);} while (0)
+// A named breakpoint that can stay in production code: a nop, plus a
+// record of its address and name in the gdb_breakpoints section. Enabling
+// the name sets a breakpoint on the nop. The name must be a string literal.
+#define breakpoint(name) asm volatile( \
+  "1: nop \n" \
+  ".pushsection gdb_breakpoints, \"a\" \n" \
+  ".balign 4 \n" \
+  ".word 1b \n" \
+  ".asciz " #name " \n" \
+  ".popsection")
+#define breakpoint_enable(name) debug_enableSite(name, 1)
+#define breakpoint_disable(name) debug_enableSite(name, 0)
 #define halt_cpu() do {asm volatile("svc #0x11");} while (0)
 // #define triggerBreakpoint() { NVIC_SET_PENDING(IRQ_SOFTWARE); }
 #define DEBUGRUN __attribute__ ((section(".fastrun"), noinline, noclone ))
@@ -0,0 +1,279 @@
+/**
+ * @file gdbhex.h
+ * @author Fernando Trias
+ * @brief Hex encoding, decoding and checksums for the GDB stub
+ * @version 0.1
+ * @date 2020-06-09
+ * 
+ * @copyright Copyright (c) 2020 Fernando Trias
+ * 
+ */
+
+/*
+ * These sit on the path of every 'm', 'g' and 'O' packet, so they use
+ * lookup tables instead of branching on every character and work a
+ * 32-bit word at a time where they can. On Cortex-M4/M7 the checksum uses
+ * UADD8, which adds four bytes lane by lane modulo 256.
+ * 
+ * The header has no Arduino dependencies so it can be built on the host
+ * (see extras/bench).
+ */
+
+#ifndef GDB_HEX_H
+#define GDB_HEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+// value of each ascii hex char; -1 if not a hex char
+static const int8_t gdb_hex_value[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// two ascii hex chars for each byte, ready to store as a little-endian
+// 16-bit value (high nibble first in memory)
+static const uint16_t gdb_hex_pair[256] = {
+  0x3030, 0x3130, 0x3230, 0x3330, 0x3430, 0x3530, 0x3630, 0x3730,
+  0x3830, 0x3930, 0x6130, 0x6230, 0x6330, 0x6430, 0x6530, 0x6630,
+  0x3031, 0x3131, 0x3231, 0x3331, 0x3431, 0x3531, 0x3631, 0x3731,
+  0x3831, 0x3931, 0x6131, 0x6231, 0x6331, 0x6431, 0x6531, 0x6631,
+  0x3032, 0x3132, 0x3232, 0x3332, 0x3432, 0x3532, 0x3632, 0x3732,
+  0x3832, 0x3932, 0x6132, 0x6232, 0x6332, 0x6432, 0x6532, 0x6632,
+  0x3033, 0x3133, 0x3233, 0x3333, 0x3433, 0x3533, 0x3633, 0x3733,
+  0x3833, 0x3933, 0x6133, 0x6233, 0x6333, 0x6433, 0x6533, 0x6633,
+  0x3034, 0x3134, 0x3234, 0x3334, 0x3434, 0x3534, 0x3634, 0x3734,
+  0x3834, 0x3934, 0x6134, 0x6234, 0x6334, 0x6434, 0x6534, 0x6634,
+  0x3035, 0x3135, 0x3235, 0x3335, 0x3435, 0x3535, 0x3635, 0x3735,
+  0x3835, 0x3935, 0x6135, 0x6235, 0x6335, 0x6435, 0x6535, 0x6635,
+  0x3036, 0x3136, 0x3236, 0x3336, 0x3436, 0x3536, 0x3636, 0x3736,
+  0x3836, 0x3936, 0x6136, 0x6236, 0x6336, 0x6436, 0x6536, 0x6636,
+  0x3037, 0x3137, 0x3237, 0x3337, 0x3437, 0x3537, 0x3637, 0x3737,
+  0x3837, 0x3937, 0x6137, 0x6237, 0x6337, 0x6437, 0x6537, 0x6637,
+  0x3038, 0x3138, 0x3238, 0x3338, 0x3438, 0x3538, 0x3638, 0x3738,
+  0x3838, 0x3938, 0x6138, 0x6238, 0x6338, 0x6438, 0x6538, 0x6638,
+  0x3039, 0x3139, 0x3239, 0x3339, 0x3439, 0x3539, 0x3639, 0x3739,
+  0x3839, 0x3939, 0x6139, 0x6239, 0x6339, 0x6439, 0x6539, 0x6639,
+  0x3061, 0x3161, 0x3261, 0x3361, 0x3461, 0x3561, 0x3661, 0x3761,
+  0x3861, 0x3961, 0x6161, 0x6261, 0x6361, 0x6461, 0x6561, 0x6661,
+  0x3062, 0x3162, 0x3262, 0x3362, 0x3462, 0x3562, 0x3662, 0x3762,
+  0x3862, 0x3962, 0x6162, 0x6262, 0x6362, 0x6462, 0x6562, 0x6662,
+  0x3063, 0x3163, 0x3263, 0x3363, 0x3463, 0x3563, 0x3663, 0x3763,
+  0x3863, 0x3963, 0x6163, 0x6263, 0x6363, 0x6463, 0x6563, 0x6663,
+  0x3064, 0x3164, 0x3264, 0x3364, 0x3464, 0x3564, 0x3664, 0x3764,
+  0x3864, 0x3964, 0x6164, 0x6264, 0x6364, 0x6464, 0x6564, 0x6664,
+  0x3065, 0x3165, 0x3265, 0x3365, 0x3465, 0x3565, 0x3665, 0x3765,
+  0x3865, 0x3965, 0x6165, 0x6265, 0x6365, 0x6465, 0x6565, 0x6665,
+  0x3066, 0x3166, 0x3266, 0x3366, 0x3466, 0x3566, 0x3666, 0x3766,
+  0x3866, 0x3966, 0x6166, 0x6266, 0x6366, 0x6466, 0x6566, 0x6666,
+};
+
+// decode two hex chars into one byte; garbage (but only 8 bits) if not hex
+#define GDB_HEX_BYTE(hi, lo) ((uint32_t)((gdb_hex_value[hi] << 4) | (gdb_hex_value[lo] & 0x0F)) & 0xFF)
+
+/**
+ * @brief Convert a hex char to a number
+ * 
+ * @param ch Hex char '0', '1', etc.
+ * @return int Number 0-15 or -1 if not hex
+ */
+static inline int hex(unsigned char ch) {
+  return gdb_hex_value[ch];
+}
+
+/**
+ * @brief Calculate checksum for message
+ * 
+ * @param c Packet
+ * @param len Number of chars in packet
+ * @return int Checksum
+ */
+static inline int calcChecksum(const char *c, int len) {
+  const uint8_t *p = (const uint8_t *)c;
+  uint32_t sum = 0;
+  // bytes up to a word boundary
+  while (len > 0 && ((uintptr_t)p & 3)) {
+    sum += *p++;
+    len--;
+  }
+#if defined(__ARM_FEATURE_DSP)
+  // four lanes, each summing modulo 256
+  uint32_t acc = 0;
+  while (len >= 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    asm("uadd8 %0, %0, %1" : "+r" (acc) : "r" (w) : "cc");
+    p += 4;
+    len -= 4;
+  }
+  sum += (acc & 0xFF) + ((acc >> 8) & 0xFF) + ((acc >> 16) & 0xFF) + (acc >> 24);
+#else
+  // two 16-bit lanes; fold before they can carry into each other
+  while (len >= 4) {
+    uint32_t acc = 0;
+    int words = len >> 2;
+    if (words > 64) words = 64;
+    len -= words << 2;
+    while (words--) {
+      uint32_t w;
+      memcpy(&w, p, 4);
+      acc += (w & 0x00FF00FF) + ((w >> 8) & 0x00FF00FF);
+      p += 4;
+    }
+    sum += (acc & 0xFFFF) + (acc >> 16);
+  }
+#endif
+  while (len-- > 0) {
+    sum += *p++;
+  }
+  return sum & 0xFF;
+}
+
+/**
+ * @brief Take a memory span and format it in hexadecimal
+ * 
+ * @param buff Output in ascii hexadecimal
+ * @param addr Memory address to convert
+ * @param sz Number of bytes to convert; -1 to use strlen
+ * @return char* The address of the last character (a \0) in buff
+ */
+static inline char *mem2hex(char *buff, const void *addr, int sz = -1) {
+  const uint8_t *p = (const uint8_t *)addr;
+  if (sz < 0) sz = strlen((const char*)addr);
+  // bytes up to a word boundary
+  while (sz > 0 && ((uintptr_t)p & 3)) {
+    memcpy(buff, &gdb_hex_pair[*p++], 2);
+    buff += 2;
+    sz--;
+  }
+  while (sz >= 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    uint32_t lo = gdb_hex_pair[w & 0xFF] | ((uint32_t)gdb_hex_pair[(w >> 8) & 0xFF] << 16);
+    uint32_t hi = gdb_hex_pair[(w >> 16) & 0xFF] | ((uint32_t)gdb_hex_pair[w >> 24] << 16);
+    memcpy(buff, &lo, 4);
+    memcpy(buff+4, &hi, 4);
+    buff += 8;
+    p += 4;
+    sz -= 4;
+  }
+  while (sz-- > 0) {
+    memcpy(buff, &gdb_hex_pair[*p++], 2);
+    buff += 2;
+  }
+  *buff = 0;
+  return buff;
+}
+
+/**
+ * @brief Decode ascii hex into memory, one byte store per byte
+ * 
+ * @param mem Destination
+ * @param hexstr Hexadecimal representation; must have 2*sz chars
+ * @param sz Number of bytes to decode
+ * @return int 0 = success; -1 = a char wasn't hex
+ */
+static inline int hex2mem(void *mem, const char *hexstr, int sz) {
+  const uint8_t *h = (const uint8_t *)hexstr;
+  uint8_t *m = (uint8_t *)mem;
+  int bad = 0;
+  for (int i = 0; i < sz; i++) {
+    int hi = gdb_hex_value[h[0]];
+    int lo = gdb_hex_value[h[1]];
+    bad |= hi | lo;
+    m[i] = (hi << 4) | lo;
+    h += 2;
+  }
+  return bad < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Convert hex string to actual string. buff may be the same as
+ * hexstr to decode in place.
+ * 
+ * @param buff Store string here
+ * @param hexstr Hexadeciamal representation
+ * @return char* Pointer to \0 at end of buff
+ */
+static inline char *hex2str(char *buff, const char *hexstr) {
+  const uint8_t *h = (const uint8_t *)hexstr;
+  int sz = strlen(hexstr) >> 1;
+  // four bytes per word; in place is safe because we write behind the reader
+  while (sz >= 4) {
+    uint32_t w =
+      (GDB_HEX_BYTE(h[0], h[1])) |
+      (GDB_HEX_BYTE(h[2], h[3]) << 8) |
+      (GDB_HEX_BYTE(h[4], h[5]) << 16) |
+      (GDB_HEX_BYTE(h[6], h[7]) << 24);
+    memcpy(buff, &w, 4);
+    buff += 4;
+    h += 8;
+    sz -= 4;
+  }
+  while (sz-- > 0) {
+    *buff++ = GDB_HEX_BYTE(h[0], h[1]);
+    h += 2;
+  }
+  *buff = 0;
+  return buff;
+}
+
+/**
+ * @brief Convert ascii hex into an integer. Used when parsing commands.
+ * 
+ * @param ptr Pointer to (char*) with text. Updated as text is parsed.
+ * @param intValue Pointer to (int) that holds value parsed
+ * @return int Number of characters parsed
+ */
+static inline int hexToInt(const char **ptr, int *intValue)
+{
+  const uint8_t *p = (const uint8_t *)*ptr;
+  uint32_t value = 0;
+  int hexValue;
+
+  // a NUL is not a hex char, so it stops the loop as well
+  while ((hexValue = gdb_hex_value[*p]) >= 0) {
+    value = (value << 4) | hexValue;
+    p++;
+  }
+
+  int numChars = p - (const uint8_t *)*ptr;
+  *ptr = (const char *)p;
+  *intValue = value;
+  return numChars;
+}
+
+/**
+ * @brief Convert 8 ascii hex chars in target (little-endian) byte order,
+ * as used by 'G' and 'P', into an integer.
+ * 
+ * @param ptr Pointer to (char*) with text. Advanced by 8.
+ * @return int Value parsed
+ */
+static inline int hex32ToInt(const char **ptr)
+{
+  const uint8_t *p = (const uint8_t *)*ptr;
+  uint32_t intValue =
+    (GDB_HEX_BYTE(p[0], p[1])) |
+    (GDB_HEX_BYTE(p[2], p[3]) << 8) |
+    (GDB_HEX_BYTE(p[4], p[5]) << 16) |
+    (GDB_HEX_BYTE(p[6], p[7]) << 24);
+  *ptr += 8;
+  return intValue;
+}
+
+#endif
@@ -17,11 +17,23 @@
 
 #define GDB_DEBUG_INTERNAL
 #include "TeensyDebug.h"
+#include "gdbhex.h"
 
 // #define GDB_DEBUG_COMMANDS
 
 #define GDB_POLL_INTERVAL_MICROSEC 500
 
+#ifdef GDB_HOST_SIM
+// supplied by the host simulator in extras/host
+void sim_idle();
+void sim_restart();
+#define GDB_IDLE() sim_idle()
+#undef CPU_RESTART
+#define CPU_RESTART sim_restart();
+#else
+#define GDB_IDLE() asm volatile("wfi")
+#endif
+
 
 /*
  * Notes on 'p':
@@ -76,7 +88,7 @@ Stream *dev = NULL;
 int getDebugChar() {
   unsigned int timeout = millis() + 1000;
   while(dev->available() <= 0) {
-    asm volatile("wfi");
+    GDB_IDLE();
     if (millis() > timeout) {
       // Serial.println("{timeout}");
       return -1;
@@ -127,124 +139,8 @@ const char *signal_text[] = {
   "S05", "S02", "S06", "S0B", "S07", "S07", "S04"
 };
 
-/**
- * @brief Calculate checksum for message
- * 
- * @param c Packet
- * @return int Checksum
- */
-int calcChecksum(const char *c) {
-  uint8_t sum = 0;
-  while(*c) {
-    sum += *c++;
-  }
-  return sum;
-}
-
-// constants for hex conversions
-char int2hex[] = { '0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f' };
-
-/**
- * @brief Convert a hex char to a number
- * 
- * @param ch Hex char '0', '1', etc.
- * @return int Number 0-15
- */
-int hex(unsigned char ch) {
-  if (ch >= 'a' && ch <= 'f')
-    return ch - 'a' + 10;
-  if (ch >= '0' && ch <= '9')
-    return ch - '0';
-  if (ch >= 'A' && ch <= 'F')
-    return ch - 'A' + 10;
-  return -1;
-}
-
-/**
- * @brief Take a memory span and format it in hexadecimal
- * 
- * @param buff Output in ascii hexadecimal
- * @param addr Memory address to convert
- * @param sz Number of bytes to convert
- * @return char* The address of the last character (a \0) in buff
- */
-char *mem2hex(char *buff, const void *addr, int sz = -1) {
-  if (sz < 0) sz = strlen((char*)addr);
-  for (int i = 0; i < sz; i++) {
-    uint8_t b = ((uint8_t*)addr)[i];
-    *buff++ = int2hex[b >> 4];
-    *buff++ = int2hex[b & 0x0F];
-  }
-  *buff = 0;
-  return buff;
-}
-
-/**
- * @brief Convert hex string to actual string
- * 
- * @param buff Store string here
- * @param hexstr Hexadeciamal representation
- * @return char* Pointer to \0 at end of buff
- */
-char *hex2str(char *buff, const char *hexstr) {
-  while (*hexstr) {
-    int c_high = hex(*hexstr++);
-    int c_low = hex(*hexstr++);
-    *buff++ = (c_high << 4) + c_low;
-  }
-  *buff = 0;
-  return buff;
-}
-
-/**
- * While we find nice hex chars, build an int.
- * Return number of chars processed.
- */
-
-/**
- * @brief Convert ascii hex into an integer. Used when parsing commands.
- * 
- * @param ptr Pointer to (char*) with text. Updated as text is parsed.
- * @param intValue Pointer to (int) that holds value parsed
- * @return int Number of characters parsed
- */
-static int hexToInt(const char **ptr, int *intValue)
-{
-  int numChars = 0;
-  int hexValue;
-
-  *intValue = 0;
-
-  while (**ptr) {
-    hexValue = hex(**ptr);
-    if (hexValue < 0)
-      break;
-
-    *intValue = (*intValue << 4) | hexValue;
-    numChars++;
-
-    (*ptr)++;
-  }
-
-  return (numChars);
-}
-
-static int hex32ToInt(const char **ptr)
-{
-  const char *p = *ptr;
-  uint32_t intValue;
-  uint8_t *i = (uint8_t*)&intValue;
-
-  i[0] = (hex(p[0]) << 4) + hex(p[1]);
-  i[1] = (hex(p[2]) << 4) + hex(p[3]);
-  i[2] = (hex(p[4]) << 4) + hex(p[5]);
-  i[3] = (hex(p[6]) << 4) + hex(p[7]);
-
-  // Serial.print("parse ");Serial.println(intValue);
-  *ptr += 8;
-  return intValue;
-}
-
+#if GDB_FEATURE_MONITOR
+// monitor arguments: 0x... in hex, anything else in decimal
 static int strToInt(const char *str) {
   if (str[0] == '0' && str[1] == 'x') {
     int ret;
@@ -256,6 +152,7 @@ static int strToInt(const char *str) {
     return atoi(str);
   }
 }
+#endif
 
 /**
  * @brief Send result text to GDB (formatting and calculating checksum)
@@ -266,15 +163,14 @@ void sendResult(const char *result) {
 #ifdef GDB_DEBUG_COMMANDS
   Serial.print("target reply:");Serial.println(result);
 #endif
-  int checksum = calcChecksum(result);
-  const char *presult = result;
+  int len = strlen(result);
+  int checksum = calcChecksum(result, len);
+  char trailer[3];
+  trailer[0] = '#';
+  memcpy(trailer+1, &gdb_hex_pair[checksum], 2);
   putDebugChar('$');
-  while (*presult) {
-    putDebugChar(*presult++);
-  }
-  putDebugChar('#');
-  putDebugChar(int2hex[checksum >> 4]);
-  putDebugChar(int2hex[checksum & 0x0F]);
+  dev->write((const uint8_t *)result, len);
+  dev->write((const uint8_t *)trailer, 3);
   // Serial.println(result);
 }
 
@@ -299,25 +195,71 @@ extern int debugstep;
 
 extern int debugenabled;
 
+/**
+ * @brief Packet buffers. Every buffer the stub uses lives in this one
+ * static block so nothing large goes on the stack of the timer ISR. Each
+ * region has a single owner:
+ * 
+ *   rx     - processGDBinput() reads and decodes the incoming packet
+ *   tx     - process_*() builds the reply that sendResult() sends
+ *   notify - asynchronous messages ('O' output, qSymbol) sent by processGDB()
+ *   fileio - File-I/O requests built by debug.file_*() in thread mode
+ *   replay - memory as it was at the replay position, for process_m()
+ * 
+ * rx and tx are only touched from processGDB(), which runs in the timer
+ * ISR and never nests with itself.
+ */
+struct gdb_buffers_struct {
+  char rx[GDB_PACKET_SIZE+1];
+  char tx[GDB_PACKET_SIZE+1];
+  char notify[GDB_SEND_SIZE];
+#if GDB_FEATURE_FILEIO
+  char fileio[GDB_FILEIO_SIZE];
+#endif
+#if GDB_RECORD
+  uint8_t replay[GDB_PACKET_SIZE/2];
+#endif
+} gdb_buffers;
+
+// Usage statistics for 'monitor buffers'
+struct gdb_buffer_stats_struct {
+  uint16_t rx_peak;
+  uint16_t tx_peak;
+  uint16_t notify_peak;
+  uint16_t fileio_peak;
+  uint16_t rx_overflow;
+  uint16_t tx_overflow;
+  uint16_t notify_overflow;
+} gdb_buffer_stats;
+
 // for messages that are sent seperately (like 'O', print)
-char send_message[256];
+char *send_message = gdb_buffers.notify;
 
 /**
- * @brief Output to the GDB console using 'O' command
+ * @brief Output to the GDB console using 'O' command. If the message
+ * doesn't fit in what's left of the notify buffer it is cut short.
  * 
  * @param msg Message to display
  * @param len Number of characters
  * @return size_t Number of characters sent
  */
 size_t gdb_out_write(const uint8_t *msg, size_t len) {
-  if (send_message[0]) {
-    int lx = strlen(send_message);
-    char *p = send_message + lx;
-    mem2hex(p, (const char *)msg, len);
+  char *p = send_message;
+  if (*p) {
+    p += strlen(p);
   }
   else {
-    send_message[0] = 'O';
-    mem2hex(send_message+1, (const char *)msg, len);
+    *p++ = 'O';
+  }
+  // each byte takes two hex chars; leave room for the terminator
+  size_t room = (send_message + GDB_SEND_SIZE - 1 - p) / 2;
+  if (len > room) {
+    gdb_buffer_stats.notify_overflow++;
+    len = room;
+  }
+  p = mem2hex(p, (const char *)msg, len);
+  if (p - send_message > gdb_buffer_stats.notify_peak) {
+    gdb_buffer_stats.notify_peak = p - send_message;
   }
   return len;
 }
@@ -338,18 +280,33 @@ int gdb_wait_for_flag(volatile int *flag, int timeout) {
     if (timeout && millis() > endtime) {
       return -1;
     }
-    asm volatile("wfi");
+    GDB_IDLE();
     yield();
+    debug_watchdogFeed();
   }
   return 0;
 }
 
+#if GDB_FEATURE_FILEIO
+
 int file_io_result;
 int file_io_errno;
 volatile int file_io_pending = 0;
 
+/**
+ * @brief Return the buffer debug.file_*() use to build requests.
+ * It holds GDB_FILEIO_SIZE chars.
+ */
+char *gdb_file_io_buffer() {
+  return gdb_buffers.fileio;
+}
+
 int gdb_file_io(const char *cmd) {
   // Serial.println(cmd);
+  int len = strlen(cmd);
+  if (len > gdb_buffer_stats.fileio_peak) {
+    gdb_buffer_stats.fileio_peak = len;
+  }
   file_io_pending = 1;
   sendResult(cmd);
   gdb_wait_for_flag(&file_io_pending, 1000);
@@ -357,6 +314,38 @@ int gdb_file_io(const char *cmd) {
   return file_io_result;
 }
 
+#endif // GDB_FEATURE_FILEIO
+
+char *append32(char *p, uint32_t n);
+
+/**
+ * @brief Reply describing why the program stopped; names the data
+ * watchpoint that fired or gives the pc and sp of a stack overflow
+ * 
+ * @return const char* Text of reply
+ */
+const char *stop_reply() {
+  static char reply[32];
+  uint32_t addr;
+  uint32_t sp;
+  if (debug_stackOverflow(&addr, &sp)) {
+    // SIGSEGV with sp and pc (registers 13 and 15) in target order
+    char *p = reply + sprintf(reply, "T0b0d:");
+    p = append32(p, sp);
+    p += sprintf(p, ";0f:");
+    p = append32(p, addr);
+    strcpy(p, ";");
+    return reply;
+  }
+  int type = debug_watchpointHit(&addr);
+  if (type) {
+    const char *kind[] = { "watch", "rwatch", "awatch" };
+    sprintf(reply, "T05%s:%08lx;", kind[type-2], (unsigned long)addr);
+    return reply;
+  }
+  return signal_text[debug_id];
+}
+
 /**
  * @brief Routing for processing breakpoints
  * 
@@ -364,22 +353,36 @@ int gdb_file_io(const char *cmd) {
 #pragma GCC push_options
 #pragma GCC optimize ("O0")
 void process_onbreak() {
+  // hold off the interrupts chosen with 'monitor priority freeze'
+  uint32_t basepri = debug_freeze();
+  // keep the watchdogs from resetting the board while stopped
+  debug_watchdogHalt();
+  // and note the time, to take it off the program's clock
+  debug_timeHalt();
   // send the signal
   halt_state = 1;
-  sendResult(signal_text[debug_id]);
+  sendResult(stop_reply());
   // go into halt state and stay until flag is cleared
   gdb_wait_for_flag(&halt_state, 0);
+  debug_timeResume();
+  debug_watchdogResume();
+  debug_thaw(basepri);
   debug_id = 0;
 }
 
 uint32_t fakesp;
 
+#ifdef GDB_HOST_SIM
+// the simulator has no code at host addresses to return to
+void fake_breakpoint() { }
+#else
 __attribute__((noinline, naked))
 void fake_breakpoint() {
   // asm volatile("ldr r0, =fakesp");
   // asm volatile("str sp, [r0]");
   asm volatile("svc 0x10");
 }
+#endif
 #pragma GCC pop_options
 
 /**
@@ -390,13 +393,11 @@ void fake_breakpoint() {
  * @return char* Pointer last item (a \0) so you can continue appending
  */
 char *append32(char *p, uint32_t n) {
-  uint8_t *x = (uint8_t *) &n;
-  for(int i=0; i<4; i++) {
-    int c = x[i];
-    *p++ = int2hex[c >> 4];
-    *p++ = int2hex[c & 0x0F];
-  }
-  return p;
+  uint32_t lo = gdb_hex_pair[n & 0xFF] | ((uint32_t)gdb_hex_pair[(n >> 8) & 0xFF] << 16);
+  uint32_t hi = gdb_hex_pair[(n >> 16) & 0xFF] | ((uint32_t)gdb_hex_pair[n >> 24] << 16);
+  memcpy(p, &lo, 4);
+  memcpy(p+4, &hi, 4);
+  return p + 8;
 }
 
 // extern void print_registers();
@@ -414,7 +415,7 @@ int process_g(const char *cmd, char *result) {
   // See Notes above for explanation
   uint32_t pc = debug.getRegister("pc");
   uint32_t sp = debug.getRegister("sp");
-  if ((pc|1) == (uint32_t)&fake_breakpoint) {
+  if ((pc|1) == (uint32_t)(uintptr_t)&fake_breakpoint) {
     pc = MAP_DUMMY_BREAKPOINT;
     // Serial.print("fake sp:");Serial.println(sp, HEX);
     sp = fakesp;
@@ -441,6 +442,24 @@ int process_g(const char *cmd, char *result) {
   return 0;
 }
 
+#if GDB_RECORD
+/**
+ * @brief Registers and memory can't be changed at the replay position;
+ * a change at the program's own position leaves the record behind
+ * 
+ * @param result Error reply if refused
+ * @return int 1 = refused
+ */
+static int record_write(char *result) {
+  if (debug_replaying()) {
+    strcpy(result, "E01");
+    return 1;
+  }
+  debug_recordClear();
+  return 0;
+}
+#endif
+
 /**
  * @brief Process 'G' to write registers. Not supported.
  * 
@@ -452,6 +471,9 @@ int process_G(const char *cmd, char *result) {
   // Not fully supported; enable when restore*() works
   // strcpy(result, "E01");
   // return 0;
+#if GDB_RECORD
+  if (record_write(result)) return 0;
+#endif
   cmd++;
   debug.setRegister("r0", hex32ToInt(&cmd));
   debug.setRegister("r1", hex32ToInt(&cmd));
@@ -478,6 +500,9 @@ int process_P(const char *cmd, char *result) {
   // Not fully supported; enable when restore*() works
   // strcpy(result, "E01");
   // return 0;
+#if GDB_RECORD
+  if (record_write(result)) return 0;
+#endif
   cmd++;
   int reg = hex(*cmd++);
   cmd++; // skip '='
@@ -498,13 +523,13 @@ int process_P(const char *cmd, char *result) {
     case 11: debug.setRegister("r11", val); break;
     case 12: debug.setRegister("r12", val); break;
     case 13:
-      if (debug.getRegister("lr") == (uint32_t)&fake_breakpoint) {
+      if (debug.getRegister("lr") == (uint32_t)(uintptr_t)&fake_breakpoint) {
         fakesp = val; // gdb changes sp, and we need to return it later
       }
       debug.setRegister("sp", val); break;
     case 14:
       if (val == (MAP_DUMMY_BREAKPOINT|1)) { // special breakpoint
-        debug.setRegister("lr", (uint32_t)&fake_breakpoint);
+        debug.setRegister("lr", (uint32_t)(uintptr_t)&fake_breakpoint);
         fakesp = debug.getRegister("sp"); // just in case not set later
       }
       else {
@@ -531,13 +556,13 @@ int process_P(const char *cmd, char *result) {
  * @return int 1 = valid; 0 = invalid
  */
 int isValidAddress(uint32_t addr, int sz=0) {
-  if (addr >= (uint32_t)RAM_START && addr <= (uint32_t)RAM_END) {
-    if (addr+sz-1 >= (uint32_t)RAM_START && addr+sz-1 <= (uint32_t)RAM_END) {
+  if (addr >= (uint32_t)(uintptr_t)RAM_START && addr <= (uint32_t)(uintptr_t)RAM_END) {
+    if (addr+sz-1 >= (uint32_t)(uintptr_t)RAM_START && addr+sz-1 <= (uint32_t)(uintptr_t)RAM_END) {
       return 1;
     }
   }
-  else if (addr >= (uint32_t)FLASH_START && addr <= (uint32_t)FLASH_END) {
-    if (addr+sz-1 >= (uint32_t)FLASH_START && addr+sz-1 <= (uint32_t)FLASH_END) {
+  else if (addr >= (uint32_t)(uintptr_t)FLASH_START && addr <= (uint32_t)(uintptr_t)FLASH_END) {
+    if (addr+sz-1 >= (uint32_t)(uintptr_t)FLASH_START && addr+sz-1 <= (uint32_t)(uintptr_t)FLASH_END) {
       return 1;
     }
   }
@@ -583,6 +608,12 @@ int process_m(const char *cmd, char *result) {
     return 0;
   }
 
+  // reply must fit in the tx buffer
+  if (sz < 0 || sz > GDB_PACKET_SIZE/2) {
+    strcpy(result, "E02");
+    return 0;
+  }
+
   // if (addr == MAP_DUMMY_BREAKPOINT) {
   //   if (sz == 2) {
   //     strcpy(result, "fbbe");
@@ -594,13 +625,16 @@ int process_m(const char *cmd, char *result) {
   //   }
   // }
 
-  uint8_t *m = (uint8_t *)addr;
-  for (int i=0; i<sz; i++) {
-    uint8_t d = m[i];
-    *(result++) = int2hex[d >> 4];
-    *(result++) = int2hex[d & 0x0F];
+#if GDB_RECORD
+  if (debug_replaying()) {
+    // memory as it was at the replay position
+    debug_replayRead(addr, gdb_buffers.replay, sz);
+    mem2hex(result, gdb_buffers.replay, sz);
+    return 0;
   }
-  *result = 0;
+#endif
+
+  mem2hex(result, (const void *)addr, sz);
   return 0;
 }
 
@@ -613,22 +647,76 @@ int process_m(const char *cmd, char *result) {
  */
 int process_M(const char *cmd, char *result) {
   int addr, sz;
+#if GDB_RECORD
+  if (record_write(result)) return 0;
+#endif
   cmd++; // skip command
   hexToInt(&cmd, &addr);
   cmd++; // skip comma
   hexToInt(&cmd, &sz);
   cmd++;
 
-  uint8_t *memory = (uint8_t*)addr;
-  for(int i=0; i<sz; i++) {
-    int c_high = hex(*cmd++);
-    int c_low = hex(*cmd++);
-    memory[i] = (c_high << 4) + c_low;
+  // GDB may be writing code to RAM, so single instructions are stored in
+  // one piece and anything else is followed by cache maintenance. Other
+  // addresses get plain stores; patching reads the old value first, and
+  // reading a peripheral register can change it.
+  void *p = (void *)addr;
+  int code = p >= RAM_START && p <= RAM_END;
+  if (sz == 2 && (addr & 1) == 0) {
+    uint16_t v;
+    hex2mem(&v, cmd, 2);
+    if (code) debug_patchCode16(p, v);
+    else *(volatile uint16_t *)p = v;
+  }
+  else if (sz == 4 && (addr & 3) == 0) {
+    uint32_t v;
+    hex2mem(&v, cmd, 4);
+    if (code) debug_patchCode32(p, v);
+    else *(volatile uint32_t *)p = v;
+  }
+  else {
+    hex2mem(p, cmd, sz);
+    if (code) debug_syncCode(p, sz);
   }
   strcpy(result, "OK");
   return 0;
 }
 
+#if GDB_RECORD
+
+/**
+ * @brief Move through the execution record instead of running
+ * 
+ * @param back 1 for 'bs' and 'bc'
+ * @param run 1 for 'bc' and 'c'
+ * @param result Stop reply
+ * @return int 0; GDB gets the reply now
+ */
+int process_replay(int back, int run, char *result) {
+  if (debug_replayMove(back, run)) {
+    strcpy(result, back ? "T05replaylog:begin;" : "T05replaylog:end;");
+  }
+  else {
+    strcpy(result, "S05");
+  }
+  return 0;
+}
+
+/**
+ * @brief Process 'bs' and 'bc', reverse step and continue
+ * 
+ * @param cmd Original command
+ * @param result Stop reply
+ * @return int 0
+ */
+int process_b(const char *cmd, char *result) {
+  if (cmd[1] == 's' || cmd[1] == 'c') return process_replay(1, cmd[1] == 'c', result);
+  result[0] = 0;
+  return 0;
+}
+
+#endif // GDB_RECORD
+
 /**
  * @brief Process 'c' continue
  * 
@@ -637,6 +725,15 @@ int process_M(const char *cmd, char *result) {
  * @return int 1 to signal caller
  */
 int process_c(const char *cmd, char *result) {
+#if GDB_RECORD
+  if (debug_replaying()) return process_replay(0, 1, result);
+  if (debug_record_on) {
+    halt_state = 0;
+    debugstep = 2;  // one recorded instruction at a time
+    strcpy(result, "");
+    return 1;
+  }
+#endif
   halt_state = 0; // not halted
   debugstep = 0;  // not stepping
   strcpy(result, "");
@@ -660,6 +757,9 @@ int process_s(const char *cmd, char *result) {
     strcpy(result, "E01"); // SNN
     return 0;
   }
+#if GDB_RECORD
+  if (debug_replaying()) return process_replay(0, 0, result);
+#endif
   debugstep = 1;   // just step
   halt_state = 0;
   strcpy(result, ""); // return comes from the actual break
@@ -675,7 +775,7 @@ int process_s(const char *cmd, char *result) {
  */
 int process_question(const char *cmd, char *result) {
   // sprintf(result, "S0%d", debug_id);
-  strcpy(result, signal_text[debug_id]);
+  strcpy(result, stop_reply());
   return 0;
 }
 
@@ -712,18 +812,29 @@ int process_B(const char *cmd, char *result) {
  * @return int 0 if success
  */
 int process_z(const char *cmd, char *result) {
-  int btype, addr;
+  int btype, addr, sz = 0;
   cmd++;
   hexToInt(&cmd, &btype);
   cmd++;
   hexToInt(&cmd, &addr);
-//  cmd++;
-//  hexToInt(&cmd, &sz);
+  if (*cmd == ',') {
+    cmd++;
+    hexToInt(&cmd, &sz);
+  }
   // if (addr == 0) {
   //   strcpy(result, "E01");
   //   return 0;
   // }
-  if (addr == MAP_DUMMY_BREAKPOINT) { // hard-coded breakpoint
+  if (btype >= 2 && btype <= 4) { // watchpoints
+    int used;
+    if (debug_watchpointCount(&used) == 0) {
+      strcpy(result, ""); // not supported
+    }
+    else {
+      strcpy(result, debug.clearWatchpoint((void*)addr, sz, btype) ? "E01" : "OK");
+    }
+  }
+  else if (addr == MAP_DUMMY_BREAKPOINT) { // hard-coded breakpoint
     strcpy(result, "OK");
   }
   else if (debug.clearBreakpoint((void*)addr)) {
@@ -744,19 +855,31 @@ int process_z(const char *cmd, char *result) {
  * @return int 
  */
 int process_Z(const char *cmd, char *result) {
-  int btype, addr;
+  int btype, addr, sz = 0;
   cmd++;
-  hexToInt(&cmd, &btype); // don't care. We figure out what's best.
+  // for breakpoints (0, 1) don't care. We figure out what's best.
+  hexToInt(&cmd, &btype);
   cmd++;
   hexToInt(&cmd, &addr);
-  // optional size not used because we only support Thumb
-//  cmd++;
-//  hexToInt(&cmd, &sz);
+  // size only matters for watchpoints because we only support Thumb
+  if (*cmd == ',') {
+    cmd++;
+    hexToInt(&cmd, &sz);
+  }
   // if (addr == 0) {
   //   strcpy(result, "E01");
   //   return 0;
   // }
-  if (addr == MAP_DUMMY_BREAKPOINT) { // hard-coded breakpoint
+  if (btype >= 2 && btype <= 4) { // watchpoints
+    int used;
+    if (debug_watchpointCount(&used) == 0) {
+      strcpy(result, ""); // not supported; GDB uses software watchpoints
+    }
+    else {
+      strcpy(result, debug.setWatchpoint((void*)addr, sz, btype) ? "E01" : "OK");
+    }
+  }
+  else if (addr == MAP_DUMMY_BREAKPOINT) { // hard-coded breakpoint
     strcpy(result, "OK");
   }
   else if (debug.setBreakpoint((void*)addr)) {
@@ -802,12 +925,55 @@ char *getNextToken(char **text, char token) {
   return orig;
 }
 
+#if GDB_FEATURE_MONITOR
+
+#if GDB_FEATURE_CALL
 int (*call0)();
 int (*call1)(int p1);
 int (*call2)(int p1, int p2);
 int (*call3)(int p1, int p2, int p3);
+#endif
 
-int process_monitor(char *cmd, char *result) {
+/**
+ * @brief Append text to a monitor reply, hex encoded. Text that doesn't
+ * fit before end is cut short and marked with "...", and counted as a tx
+ * overflow.
+ * 
+ * @param result Hex encoded text is added here
+ * @param end Where the reply has to stop; one more char is left for the \0
+ * @param text Text to add
+ * @param len Length of text; -1 to use strlen
+ * @return char* End of result
+ */
+static char *monitor_text(char *result, char *end, const char *text, int len = -1) {
+  if (len < 0) len = strlen(text);
+  int room = (end - result) / 2;
+  if (len <= room) return mem2hex(result, text, len);
+  gdb_buffer_stats.tx_overflow++;
+  if (room < 4) return mem2hex(result, "...", room);
+  result = mem2hex(result, text, room - 4);
+  return mem2hex(result, "...\n", 4);
+}
+
+/**
+ * @brief Append buffer usage for 'monitor buffers'
+ * 
+ * @param result Hex encoded text is added here
+ * @param end Where the reply has to stop
+ * @param name Name of buffer
+ * @param peak Peak number of chars used
+ * @param size Size of buffer
+ * @param overflow Number of times it overflowed
+ * @return char* End of result
+ */
+char *monitor_buffer_line(char *result, char *end, const char *name, int peak, int size, int overflow) {
+  char x[48];
+  snprintf(x, sizeof(x), "%-6s %5d/%d peak, %d overflow\n", name, peak, size, overflow);
+  return monitor_text(result, end, x);
+}
+
+int process_monitor(char *cmd, char *result, int size) {
+  char *end = result + size;  // replies are cut short here
   char *place = cmd;
   char *word;
   word = getNextWord(&place);
@@ -829,8 +995,8 @@ int process_monitor(char *cmd, char *result) {
     pinMode(ipin, INPUT);
     int v = digitalRead(ipin);
     char x[6];
-    sprintf(x, "%d\n", v);
-    mem2hex(result, (const char *)x, strlen(x));
+    snprintf(x, sizeof(x), "%d\n", v);
+    monitor_text(result, end, x);
     return 0;   
   }
   else if (stricmp(word, "analogWrite") == 0) {
@@ -849,23 +1015,24 @@ int process_monitor(char *cmd, char *result) {
     pinMode(ipin, INPUT);
     int v = analogRead(ipin);
     char x[6];
-    sprintf(x, "%d\n", v);
-    mem2hex(result, (const char *)x, strlen(x));
+    snprintf(x, sizeof(x), "%d\n", v);
+    monitor_text(result, end, x);
     return 0;   
   }
   else if (stricmp(word, "symbol") == 0) {
     char *name = getNextWord(&place);
-    sprintf(send_message, "qSymbol:%s", name);
+    snprintf(send_message, GDB_SEND_SIZE, "qSymbol:%s", name);
     strcpy(result, "OK"); 
     return 0;   
   }
+#if GDB_FEATURE_CALL
   else if (stricmp(word, "call") == 0) {
     int args = 0, p[4], ret;
     char *arg = getNextWord(&place);
     uint32_t addr = strToInt(arg);
     // Serial.print("addr ");Serial.println(addr);
     if (addr == 0) {
-      mem2hex(result, "E Invalid address\n");
+      monitor_text(result, end, "E Invalid address\n");
       return 0;
     }
     addr |= 1; // set the exchange bit
@@ -895,15 +1062,354 @@ int process_monitor(char *cmd, char *result) {
         ret = call3(p[0], p[1], p[2]);
         break;
       default:
-        mem2hex(result, "E Too many parameters (max=3)\n");
+        monitor_text(result, end, "E Too many parameters (max=3)\n");
         return 0;
     }
     char x[40];
-    sprintf(x, "%d\n", ret);
-    mem2hex(result, (const char *)x, strlen(x));
+    snprintf(x, sizeof(x), "%d\n", ret);
+    monitor_text(result, end, x);
     return 0; 
   }
+#endif // GDB_FEATURE_CALL
+  else if (stricmp(word, "buffers") == 0) {
+    result = monitor_buffer_line(result, end, "rx", gdb_buffer_stats.rx_peak, GDB_PACKET_SIZE, gdb_buffer_stats.rx_overflow);
+    result = monitor_buffer_line(result, end, "tx", gdb_buffer_stats.tx_peak, GDB_PACKET_SIZE, gdb_buffer_stats.tx_overflow);
+    result = monitor_buffer_line(result, end, "notify", gdb_buffer_stats.notify_peak, GDB_SEND_SIZE-1, gdb_buffer_stats.notify_overflow);
+#if GDB_FEATURE_FILEIO
+    result = monitor_buffer_line(result, end, "fileio", gdb_buffer_stats.fileio_peak, GDB_FILEIO_SIZE-1, 0);
+#endif
+    return 0;
+  }
+  else if (stricmp(word, "watchpoints") == 0) {
+    int used;
+    int count = debug_watchpointCount(&used);
+    char x[96];
+    snprintf(x, sizeof(x), "%d hardware watchpoints, %d in use\nset remote hardware-watchpoint-limit %d\n", count, used, count);
+    monitor_text(result, end, x);
+    return 0;
+  }
+  else if (stricmp(word, "priority") == 0) {
+    // priority [halt n | freeze n|off]
+    char *which = place ? getNextWord(&place) : NULL;
+    if (which) {
+      char *arg = place ? getNextWord(&place) : NULL;
+      int ok = -1;
+      if (arg && stricmp(which, "halt") == 0) {
+        ok = debug_setHaltPriority(strtol(arg, NULL, 0));
+      }
+      else if (arg && stricmp(which, "freeze") == 0) {
+        ok = debug_setFreezePriority(stricmp(arg, "off") == 0 ? 0 : strtol(arg, NULL, 0));
+      }
+      if (ok < 0) {
+        char x[64];
+        snprintf(x, sizeof(x), "E Usage: priority [halt n | freeze n|off], n %d to 255\n", GDB_PRIORITY_MIN);
+        monitor_text(result, end, x);
+      }
+      else {
+        strcpy(result, "OK");
+      }
+      return 0;
+    }
+    char x[192];
+    if (debug_halt_priority < 240) {
+      snprintf(x, sizeof(x), "halt priority %d: breakpoints stop interrupts of priority %d to 255\n",
+        debug_halt_priority, debug_halt_priority + 16);
+    }
+    else {
+      snprintf(x, sizeof(x), "halt priority %d: breakpoints stop only code outside interrupts\n", debug_halt_priority);
+    }
+    if (debug_freeze_priority) {
+      snprintf(x + strlen(x), sizeof(x) - strlen(x), "freeze priority %d: interrupts of priority %d to 255 wait while stopped\n",
+        debug_freeze_priority, debug_freeze_priority);
+    }
+    else {
+      snprintf(x + strlen(x), sizeof(x) - strlen(x), "freeze off\n");
+    }
+    monitor_text(result, end, x);
+    return 0;
+  }
+  else if (stricmp(word, "watchdog") == 0) {
+    // watchdog [off|feed|suspend]
+    const char *modes[] = { "off", "feed", "suspend" };
+    char *arg = place ? getNextWord(&place) : NULL;
+    if (arg) {
+      int mode = -1;
+      for (int i=0; i<3; i++) {
+        if (stricmp(arg, modes[i]) == 0) mode = i;
+      }
+      if (debug_setWatchdogMode(mode) < 0) {
+        const char *x = "E Usage: watchdog [off|feed|suspend]\n";
+        monitor_text(result, end, x);
+      }
+      else {
+        strcpy(result, "OK");
+      }
+      return 0;
+    }
+    char x[256];
+    snprintf(x, sizeof(x), "watchdogs while stopped: %s\n", modes[debug_watchdog_mode]);
+    const char *name;
+    int state;
+    int n;
+    for (n=0; (state = debug_watchdogState(n, &name)) != WATCHDOG_ABSENT; n++) {
+      const char *what;
+      if (state == WATCHDOG_SUSPENDED) what = "suspended for this stop";
+      else if (state == WATCHDOG_IDLE) what = "off";
+      else if (debug_watchdog_mode == GDB_WATCHDOG_OFF) what = "running; resets the board after a long stop";
+      else if (state == WATCHDOG_MUTABLE && debug_watchdog_mode == GDB_WATCHDOG_SUSPEND) what = "running; suspended while stopped";
+      else what = "running; fed while stopped";
+      snprintf(x + strlen(x), sizeof(x) - strlen(x), "%s: %s\n", name, what);
+    }
+    if (n == 0) snprintf(x + strlen(x), sizeof(x) - strlen(x), "no watchdogs on this board\n");
+    monitor_text(result, end, x);
+    return 0;
+  }
+  else if (stricmp(word, "time") == 0) {
+    // time [real|virtual|frozen]
+    const char *modes[] = { "real", "virtual", "frozen" };
+    char *arg = place ? getNextWord(&place) : NULL;
+    if (arg) {
+      int mode = -1;
+      for (int i=0; i<3; i++) {
+        if (stricmp(arg, modes[i]) == 0) mode = i;
+      }
+      if (debug_setTimeMode(mode) < 0) {
+        const char *x = "E Usage: time [real|virtual|frozen]\n";
+        monitor_text(result, end, x);
+      }
+      else {
+        strcpy(result, "OK");
+      }
+      return 0;
+    }
+    char x[160];
+    snprintf(x, sizeof(x), "time across a stop: %s\n%lu stops, %lu ms taken off millis(), last %lu ms, longest %lu ms\n",
+      modes[debug_time_mode], (unsigned long)debug_time_stats.count, (unsigned long)debug_time_stats.total,
+      (unsigned long)debug_time_stats.last, (unsigned long)debug_time_stats.max);
+    monitor_text(result, end, x);
+    return 0;
+  }
+  else if (stricmp(word, "hits") == 0) {
+    if (place && stricmp(getNextWord(&place), "clear") == 0) {
+      debug_clearHits();
+      strcpy(result, "OK");
+      return 0;
+    }
+    int lines = 0;
+    for (int i=0; i<GDB_HIT_COUNTS; i++) {
+      if (debug_hits[i].addr == 0) continue;
+      char x[64];
+      snprintf(x, sizeof(x), "0x%08lx %10lu hits, ignore %lu\n", (unsigned long)debug_hits[i].addr,
+        (unsigned long)debug_hits[i].hits, (unsigned long)debug_hits[i].ignore);
+      if (result + 2 * strlen(x) + 8 >= end) {
+        result = monitor_text(result, end, "...\n", 4);
+        break;
+      }
+      result = monitor_text(result, end, x);
+      lines++;
+    }
+    if (lines == 0) monitor_text(result, end, "no breakpoint hits\n");
+    return 0;
+  }
+  else if (stricmp(word, "ignore") == 0) {
+    char *addr = place ? getNextWord(&place) : NULL;
+    char *count = place ? getNextWord(&place) : NULL;
+    if (addr == NULL || count == NULL) {
+      monitor_text(result, end, "E Usage: ignore <address> <count>\n");
+    }
+    else if (debug_ignoreBreakpoint((void*)strToInt(addr), strToInt(count))) {
+      monitor_text(result, end, "E No free hit counter\n");
+    }
+    else {
+      strcpy(result, "OK");
+    }
+    return 0;
+  }
+#if GDB_STOPWATCHES
+  else if (stricmp(word, "stopwatch") == 0) {
+    char *arg = place ? getNextWord(&place) : NULL;
+    char *arg2 = place ? getNextWord(&place) : NULL;
+    char x[96];
+    if (arg && arg2 && stricmp(arg, "clear") == 0) {
+      strcpy(result, debug_clearStopwatch(strToInt(arg2)) ? "E01" : "OK");
+      return 0;
+    }
+    if (arg && arg2 && stricmp(arg, "reset") == 0) {
+      int n = strToInt(arg2);
+      if (n >= 0 && n < GDB_STOPWATCHES) debug_resetStopwatch(n);
+      strcpy(result, "OK");
+      return 0;
+    }
+    if (arg && arg2) {
+      int n = debug_setStopwatch((void*)strToInt(arg), (void*)strToInt(arg2));
+      if (n < 0) snprintf(x, sizeof(x), "E No free stopwatch or breakpoint\n");
+      else snprintf(x, sizeof(x), "stopwatch %d\n", n);
+      monitor_text(result, end, x);
+      return 0;
+    }
+    // with a number, that one and its histogram; otherwise all of them
+    int only = arg ? strToInt(arg) : -1;
+    int lines = 0;
+    char *last = end - 2 * sizeof(x);
+    for (int i=0; i<GDB_STOPWATCHES; i++) {
+      debug_stopwatch_struct *sw = &debug_stopwatches[i];
+      if (sw->start == 0 || (only >= 0 && i != only)) continue;
+      if (result >= last) break;
+      snprintf(x, sizeof(x), "%d: 0x%08lx -> 0x%08lx %lu times", i, (unsigned long)sw->start,
+        (unsigned long)sw->stop, (unsigned long)sw->count);
+      result = monitor_text(result, end, x);
+      if (sw->count) {
+        snprintf(x, sizeof(x), ", cycles min %lu mean %lu max %lu", (unsigned long)sw->min,
+          (unsigned long)(sw->total / sw->count), (unsigned long)sw->max);
+        result = monitor_text(result, end, x);
+      }
+      result = monitor_text(result, end, "\n", 1);
+      lines++;
+      if (only < 0) continue;
+      for (int b=0; b<STOPWATCH_BINS; b++) {
+        if (sw->histogram[b] == 0) continue;
+        if (result >= last) break;
+        snprintf(x, sizeof(x), "  %lu-%lu: %lu\n", (unsigned long)(1UL << b) & ~1UL,
+          (unsigned long)((2UL << b) - 1), (unsigned long)sw->histogram[b]);
+        result = monitor_text(result, end, x);
+      }
+    }
+    if (lines == 0) monitor_text(result, end, "no stopwatches\n");
+    return 0;
+  }
+#endif
+#if GDB_COVERAGE
+  else if (stricmp(word, "cover") == 0) {
+    // cover [add <address>... | bits <word> | clear]
+    char *arg = place ? getNextWord(&place) : NULL;
+    char x[96];
+    if (arg && stricmp(arg, "clear") == 0) {
+      debug_coverClear();
+      strcpy(result, "OK");
+      return 0;
+    }
+    if (arg && stricmp(arg, "add") == 0) {
+      const char *why[] = { "", "no room", "not in RAM", "out of order" };
+      int added = 0;
+      char *addr;
+      while (place && (addr = getNextWord(&place)) != NULL && *addr) {
+        int err = debug_coverAdd(strToInt(addr));
+        if (err) {
+          snprintf(x, sizeof(x), "E %d added; %.16s %s\n", added, addr, why[-err]);
+          monitor_text(result, end, x);
+          return 0;
+        }
+        added++;
+      }
+      strcpy(result, "OK");
+      return 0;
+    }
+    if (arg && stricmp(arg, "bits") == 0) {
+      // hit bits from the given word on, 8 hex digits a word, as many
+      // as fit in a packet
+      char *first = place ? getNextWord(&place) : NULL;
+      int n = first ? strToInt(first) : 0;
+      int words = (debug_cover_count + 31) / 32;
+      char *last = end - 2 * 10;
+      for (; n < words && result < last; n++) {
+        snprintf(x, sizeof(x), "%08lx", (unsigned long)debug_cover_hit[n]);
+        result = monitor_text(result, end, x, 8);
+      }
+      monitor_text(result, end, "\n", 1);
+      return 0;
+    }
+    if (arg) {
+      monitor_text(result, end, "E Usage: cover [add <address>... | bits <word> | clear]\n");
+      return 0;
+    }
+    int hit, planted;
+    int count = debug_coverStats(&hit, &planted);
+    snprintf(x, sizeof(x), "%d points, %d reached, %d still planted, room for %d\nRAM 0x%08lx-0x%08lx\n",
+      count, hit, planted, GDB_COVERAGE - count,
+      (unsigned long)(uintptr_t)RAM_START, (unsigned long)(uintptr_t)RAM_END);
+    monitor_text(result, end, x);
+    return 0;
+  }
+#endif
+#if GDB_RECORD
+  else if (stricmp(word, "record") == 0) {
+    // record [on | off | clear]
+    char *arg = place ? getNextWord(&place) : NULL;
+    char x[96];
+    if (arg && (stricmp(arg, "on") == 0 || stricmp(arg, "off") == 0)) {
+      if (! debug_record_on) debug_recordClear();
+      debug_record_on = stricmp(arg, "on") == 0;
+      strcpy(result, "OK");
+      return 0;
+    }
+    if (arg && stricmp(arg, "clear") == 0) {
+      debug_recordClear();
+      strcpy(result, "OK");
+      return 0;
+    }
+    if (arg) {
+      monitor_text(result, end, "E Usage: record [on | off | clear]\n");
+      return 0;
+    }
+    int bytes;
+    int count = debug_recordCount(&bytes);
+    snprintf(x, sizeof(x), "recording %s, %d instructions in %d of %d bytes, replay %d back\n",
+      debug_record_on ? "on" : "off", count, bytes, GDB_RECORD, debug_replaying());
+    monitor_text(result, end, x);
+    return 0;
+  }
+#endif
+  else if (stricmp(word, "sites") == 0) {
+    int lines = 0;
+    for (const debug_site_struct *site = debug_nextSite(NULL); site; site = debug_nextSite(site)) {
+      char x[64];
+      snprintf(x, sizeof(x), "0x%08lx %-3s %s\n", (unsigned long)site->addr,
+        debug_isBreakpoint((void*)(uintptr_t)site->addr) > 0 ? "on" : "off", site->name);
+      if (result + 2 * strlen(x) + 8 >= end) {
+        result = monitor_text(result, end, "...\n", 4);
+        break;
+      }
+      result = monitor_text(result, end, x);
+      lines++;
+    }
+    if (lines == 0) monitor_text(result, end, "no breakpoint() sites\n");
+    return 0;
+  }
+  else if (stricmp(word, "site") == 0) {
+    // site on|off <name>; the name is the rest of the line
+    char *state = place ? getNextWord(&place) : NULL;
+    if (state == NULL || place == NULL || (stricmp(state, "on") && stricmp(state, "off"))) {
+      monitor_text(result, end, "E Usage: site on|off <name>\n");
+    }
+    else if (debug_enableSite(place, stricmp(state, "on") == 0) < 0) {
+      monitor_text(result, end, "E No such site or no free breakpoint\n");
+    }
+    else {
+      strcpy(result, "OK");
+    }
+    return 0;
+  }
+  else if (stricmp(word, "patch") == 0) {
+    char x[96];
+    snprintf(x, sizeof(x), "%lu patches, last %lu cycles, max %lu cycles\n",
+      (unsigned long)debug_patch_stats.count, (unsigned long)debug_patch_stats.last,
+      (unsigned long)debug_patch_stats.max);
+    monitor_text(result, end, x);
+    return 0;
+  }
+  else if (stricmp(word, "interrupt") == 0) {
+    char x[80];
+    snprintf(x, sizeof(x), "%lu Ctrl-C stops, last %lu cycles, max %lu cycles\n",
+      (unsigned long)debug_interrupt_stats.count, (unsigned long)debug_interrupt_stats.last,
+      (unsigned long)debug_interrupt_stats.max);
+    monitor_text(result, end, x);
+    return 0;
+  }
   else if (stricmp(word, "restart") == 0) {
+    // breakpoints come back after the reset unless "restart clean"
+    char *opt = place ? getNextWord(&place) : NULL;
+    if (opt && stricmp(opt, "clean") == 0) debug_persistClear();
+    else if (! halt_state) debug_persistSave();
     CPU_RESTART;
     strcpy(result, "");    
     return 0;   
@@ -912,6 +1418,8 @@ int process_monitor(char *cmd, char *result) {
   return 0;
 }
 
+#endif // GDB_FEATURE_MONITOR
+
 /**
  * @brief Process 'q' query command. For now report back PacketSize.
  * Handle 'monitor' commands.
@@ -920,16 +1428,24 @@ int process_monitor(char *cmd, char *result) {
  * @param result Results or ""
  * @return int 0
  */
-int process_q(const char *cmd, char *result) {
+int process_q(char *cmd, char *result) {
   if (strncmp(cmd, "qSupported", 10) == 0) {
-    strcpy(result, "PacketSize=1024");
+    // PacketSize is in hex
+#if GDB_RECORD
+    sprintf(result, "PacketSize=%x;ReverseStep+;ReverseContinue+", GDB_PACKET_SIZE);
+#else
+    sprintf(result, "PacketSize=%x", GDB_PACKET_SIZE);
+#endif
     return 0;
   }
+#if GDB_FEATURE_MONITOR
   else if (strncmp(cmd, "qRcmd", 5) == 0) {
-    char x[256];
-    hex2str(x, cmd+6);
-    return process_monitor(x, result);
+    // decode in place; the text is half the size of the hex
+    char *x = cmd+6;
+    hex2str(x, x);
+    return process_monitor(x, result, GDB_PACKET_SIZE);
   }
+#endif
   else if (strncmp(cmd, "qAttached", 9) == 0) {
     strcpy(result, "1");
     return 0;
@@ -938,6 +1454,8 @@ int process_q(const char *cmd, char *result) {
   return 0;
 }
 
+#if GDB_FEATURE_FILEIO
+
 /**
  * @brief Functions are not supported, but would be very useful in the future
  * 
@@ -969,6 +1487,8 @@ int process_F(const char *cmd, char *result) {
   return 0;
 }
 
+#endif // GDB_FEATURE_FILEIO
+
 /**
  * @brief Process 'R' restart
  * 
@@ -1033,7 +1553,9 @@ int processCommand(char *cmd, char *result) {
     case 'M': return process_M(cmd, result);
     case 'c': return process_c(cmd, result);
     case 's': return process_s(cmd, result);
+#if GDB_FEATURE_FILEIO
     case 'F': return process_F(cmd, result);
+#endif
     case 'R': return process_R(cmd, result);
     case 'r': return process_R(cmd, result);
     case 'k': return process_k(cmd, result);
@@ -1045,6 +1567,9 @@ int processCommand(char *cmd, char *result) {
     case 'z': return process_z(cmd, result);
     case 'Z': return process_Z(cmd, result);
     case 'q': return process_q(cmd, result);
+#if GDB_RECORD
+    case 'b': return process_b(cmd, result);
+#endif
   }
   // if it's not listed above, it's not supported
   result[0] = 0;
@@ -1056,7 +1581,7 @@ int processCommand(char *cmd, char *result) {
  * 
  */
 void processGDBinput() {
-  char result[1024];
+  char *result = gdb_buffers.tx;
 
   // no data? do nothing
   if (! hasDebugChar()) return;
@@ -1077,10 +1602,12 @@ void processGDBinput() {
   // GDB had a problem with last command; should resend. TODO
   if (c == '-') {
     // Serial.println("NAK");
+#if GDB_FEATURE_FILEIO
     if (file_io_pending) {
       file_io_result = -1;
       file_io_pending = 0;
     }
+#endif
     return;
   }
 
@@ -1100,9 +1627,10 @@ void processGDBinput() {
   }
 
   // buffer to read command; matches our PacketSize
-  const int cmd_max = 1024;
-  char cmd[cmd_max];      // buffer
+  const int cmd_max = GDB_PACKET_SIZE;
+  char *cmd = gdb_buffers.rx;  // buffer
   char *pcmd = cmd;       // pointer to last char
+  int overflow = 0;       // packet didn't fit
   // int sum;               
   int checksum = 0;   // to store checksum
 
@@ -1118,12 +1646,24 @@ void processGDBinput() {
     }
 
     if (c == '#') break; // checksum follows
-    *pcmd++ = c;
-    if (pcmd >= cmd+cmd_max) { // overrun
-      pcmd = cmd;
+    if (pcmd >= cmd+cmd_max) { // overrun; read the rest and reject
+      overflow = 1;
+      continue;
     }
+    *pcmd++ = c;
   }
   *pcmd = 0;
+
+  if (overflow) {
+    gdb_buffer_stats.rx_overflow++;
+    getDebugChar();
+    getDebugChar();
+    putDebugChar('-');
+    return;
+  }
+  if (pcmd - cmd > gdb_buffer_stats.rx_peak) {
+    gdb_buffer_stats.rx_peak = pcmd - cmd;
+  }
   
 #ifdef GDB_DEBUG_COMMANDS
   Serial.print("gdb command:");Serial.println(cmd);
@@ -1133,7 +1673,7 @@ void processGDBinput() {
   checksum = hex(c) << 4;
   c = getDebugChar();
   checksum += hex(c);
-  if (checksum != calcChecksum(cmd)) {
+  if (checksum != calcChecksum(cmd, pcmd - cmd)) {
     // Serial.println("bad checksum");
     // Serial.println(calcChecksum(cmd), HEX);
     putDebugChar('-');
@@ -1149,6 +1689,12 @@ void processGDBinput() {
   // hitting the break or successful step
   if (r==1) return;
 
+  // replies are built to fit; monitor_text() counts those cut short
+  int len = strlen(result);
+  if (len > gdb_buffer_stats.tx_peak) {
+    gdb_buffer_stats.tx_peak = len;
+  }
+
   // toss results back to GDB
   sendResult(result);
 }
@@ -1178,9 +1724,12 @@ void processGDB() {
   if (cause_break) {
     // Serial.println("BREAK!!");
     cause_break = 0;
-    debug_id = 1;
-    // NVIC_SET_PENDING(IRQ_SOFTWARE); 
-    asm volatile("svc 0x12");
+    // nothing to do if it is already stopped
+    if (! halt_state) debug_interrupt();
+  }
+  else if (debug_break_request && ! halt_state) {
+    // the last try found it getting past a breakpoint
+    debug_interrupt();
   }
 }
 
@@ -1197,7 +1746,10 @@ IntervalTimer gdb_timer;
 void gdb_init(Stream *device) {
   send_message[0] = 0;
   devInit(device);
+  uint8_t pits = debug_pitRunning();
   gdb_timer.begin(processGDB, GDB_POLL_INTERVAL_MICROSEC);
+  // GDB_TIME_FROZEN mustn't pause this one
+  debug_time_own_pit = debug_pitRunning() & ~pits;
   debug.setCallback(process_onbreak);
   debug_active = 1;
 
@@ -0,0 +1,387 @@
+/**
+ * @file nextpc.cpp
+ * @author Fernando Trias
+ * @brief Work out where a Thumb-2 instruction goes next
+ * @version 0.1
+ * @date 2020-06-09
+ *
+ * @copyright Copyright (c) 2020 Fernando Trias
+ *
+ */
+
+/*
+ * Stepping without the DebugMonitor (Teensy 3.x, or Teensy 4 with a
+ * debug probe attached) plants a temporary breakpoint where the current
+ * instruction will go. The registers are known at that point, so the
+ * next PC is computed exactly: conditions are evaluated against the
+ * flags, loads into PC read the value they will load, and instructions
+ * that an IT block will skip are stepped over.
+ *
+ * Each encoding that can change the flow is an entry in
+ * thumb_encodings[]; everything else falls through to the next
+ * instruction. extras/host/nextpc-check runs the decoder over
+ * disassembled code and reports how many of the entries were used.
+ *
+ * Flags changed by an instruction inside an IT block (CMP, TST) are not
+ * taken into account when looking past it.
+ */
+
+#include <Arduino.h>
+
+#define GDB_DEBUG_INTERNAL
+#include "TeensyDebug.h"
+
+// Most specific first; the two "other" entries end each width
+const thumb_encoding thumb_encodings[] = {
+  // 16-bit
+  { 0xFF00,     0xDE00,     2, THUMB_SEQ,      "udf" },
+  { 0xFF00,     0xDF00,     2, THUMB_SEQ,      "svc" },
+  { 0xF000,     0xD000,     2, THUMB_B_T1,     "b<c> (T1)" },
+  { 0xF800,     0xE000,     2, THUMB_B_T2,     "b (T2)" },
+  { 0xF500,     0xB100,     2, THUMB_CBZ,      "cbz/cbnz" },
+  { 0xFF87,     0x4700,     2, THUMB_BX,       "bx Rm" },
+  { 0xFF87,     0x4780,     2, THUMB_BX,       "blx Rm" },
+  { 0xFF00,     0xBD00,     2, THUMB_POP,      "pop {..., pc}" },
+  { 0xFF87,     0x4687,     2, THUMB_MOV_PC,   "mov pc, Rm" },
+  { 0xFF87,     0x4487,     2, THUMB_ADD_PC,   "add pc, Rm" },
+  { 0xFF0F,     0xBF00,     2, THUMB_SEQ,      "nop/yield/wfe/wfi/sev" },
+  { 0xFF00,     0xBF00,     2, THUMB_IT,       "it" },
+  { 0,          0,          2, THUMB_SEQ,      "other (16-bit)" },
+  // 32-bit
+  { 0xF800D000, 0xF000D000, 4, THUMB_B_T4,     "bl" },
+  { 0xF800D000, 0xF0009000, 4, THUMB_B_T4,     "b.w (T4)" },
+  { 0xFB80D000, 0xF3808000, 4, THUMB_SEQ,      "msr/mrs/barriers" },
+  { 0xF800D000, 0xF0008000, 4, THUMB_B_T3,     "b<c>.w (T3)" },
+  { 0xFFF0FFE0, 0xE8D0F000, 4, THUMB_TB,       "tbb/tbh" },
+  { 0xFF7FF000, 0xF85FF000, 4, THUMB_LDR_LIT,  "ldr.w pc, [pc, #+-imm12]" },
+  { 0xFFF0F000, 0xF8D0F000, 4, THUMB_LDR_IMM12,"ldr.w pc, [Rn, #imm12]" },
+  { 0xFFF0F800, 0xF850F800, 4, THUMB_LDR_IMM8, "ldr pc, [Rn, #+-imm8] (pre/post)" },
+  { 0xFFF0FFC0, 0xF850F000, 4, THUMB_LDR_REG,  "ldr.w pc, [Rn, Rm, lsl #n]" },
+  { 0xFFD08000, 0xE8908000, 4, THUMB_LDM,      "ldm/pop.w {..., pc}" },
+  { 0xFFD08000, 0xE9108000, 4, THUMB_LDMDB,    "ldmdb {..., pc}" },
+  { 0,          0,          4, THUMB_SEQ,      "other (32-bit)" },
+};
+
+const int thumb_encoding_count = sizeof(thumb_encodings) / sizeof(thumb_encodings[0]);
+
+/**
+ * @brief Size of an instruction from its first halfword
+ *
+ * @param h1 First halfword
+ * @return int 2 or 4
+ */
+int thumb_width(uint16_t h1) {
+  return (h1 & 0xF800) >= 0xE800 ? 4 : 2;
+}
+
+/**
+ * @brief Find the entry in thumb_encodings[] for an instruction
+ *
+ * @param h1 First halfword
+ * @param h2 Second halfword; ignored for 16-bit instructions
+ * @return int Index into thumb_encodings[]
+ */
+int thumb_lookup(uint16_t h1, uint16_t h2) {
+  int width = thumb_width(h1);
+  uint32_t insn = width == 4 ? ((uint32_t)h1 << 16) | h2 : h1;
+  for (int i=0; i<thumb_encoding_count; i++) {
+    const thumb_encoding *e = &thumb_encodings[i];
+    if (e->width == width && (insn & e->mask) == e->value) return i;
+  }
+  return thumb_encoding_count - 1; // not reached
+}
+
+/**
+ * @brief Whether a condition passes with the flags in xPSR
+ *
+ * @param cond Condition code (0 = EQ ... 14 = AL)
+ * @param xpsr Program status register
+ * @return int 1 = passes
+ */
+int thumb_condition(int cond, uint32_t xpsr) {
+  int n = (xpsr >> 31) & 1;
+  int z = (xpsr >> 30) & 1;
+  int c = (xpsr >> 29) & 1;
+  int v = (xpsr >> 28) & 1;
+  int pass;
+  switch(cond >> 1) {
+    case 0: pass = z; break;              // EQ/NE
+    case 1: pass = c; break;              // CS/CC
+    case 2: pass = n; break;              // MI/PL
+    case 3: pass = v; break;              // VS/VC
+    case 4: pass = c && ! z; break;       // HI/LS
+    case 5: pass = n == v; break;         // GE/LT
+    case 6: pass = ! z && n == v; break;  // GT/LE
+    default: return 1;                    // AL
+  }
+  return (cond & 1) ? ! pass : pass;
+}
+
+static inline int32_t sign_extend(uint32_t x, int bits) {
+  return (int32_t)(x << (32 - bits)) >> (32 - bits);
+}
+
+// IT[7:0] from xPSR
+static inline int thumb_itstate(uint32_t xpsr) {
+  return ((xpsr >> 25) & 0x3) | ((xpsr >> 8) & 0xFC);
+}
+
+// ITSTATE after an instruction in the block
+static inline int thumb_itadvance(int it) {
+  return (it & 0x7) ? (it & 0xE0) | ((it << 1) & 0x1F) : 0;
+}
+
+/**
+ * @brief Step over instructions that the IT block will skip
+ *
+ * @param addr Next instruction
+ * @param it ITSTATE when it runs
+ * @return uint32_t First instruction that will run
+ */
+static uint32_t thumb_skip(const thumb_cpu *cpu, uint32_t addr, int it) {
+  while ((it & 0xF) && ! thumb_condition(it >> 4, cpu->xpsr)) {
+    addr += thumb_width(cpu->read(addr, 2));
+    it = thumb_itadvance(it);
+  }
+  return addr;
+}
+
+/**
+ * @brief Next instruction to run
+ *
+ * @param cpu Registers, with r[15] the address of the instruction
+ * @return uint32_t Address of the next instruction
+ */
+uint32_t thumb_nextpc(const thumb_cpu *cpu) {
+  uint32_t pc = cpu->r[15];
+  uint16_t h1 = cpu->read(pc, 2);
+  uint16_t h2 = thumb_width(h1) == 4 ? cpu->read(pc + 2, 2) : 0;
+  const thumb_encoding *e = &thumb_encodings[thumb_lookup(h1, h2)];
+  uint32_t insn = e->width == 4 ? ((uint32_t)h1 << 16) | h2 : h1;
+  uint32_t next = pc + e->width;
+  int it = thumb_itstate(cpu->xpsr);
+
+  // reading PC gives the address of the instruction plus 4
+  #define REG(n) ((n) == 15 ? pc + 4 : cpu->r[n])
+
+  if ((it & 0xF) && ! thumb_condition(it >> 4, cpu->xpsr)) {
+    // the IT block skips this one
+    return thumb_skip(cpu, next, thumb_itadvance(it));
+  }
+
+  uint32_t addr;
+  switch(e->kind) {
+    case THUMB_B_T1:
+      if (! thumb_condition((insn >> 8) & 0xF, cpu->xpsr)) return next;
+      return pc + 4 + sign_extend((insn & 0xFF) << 1, 9);
+
+    case THUMB_B_T2:
+      return pc + 4 + sign_extend((insn & 0x7FF) << 1, 12);
+
+    case THUMB_B_T3: {
+      if (! thumb_condition((insn >> 22) & 0xF, cpu->xpsr)) return next;
+      uint32_t s = (insn >> 26) & 1, j1 = (insn >> 13) & 1, j2 = (insn >> 11) & 1;
+      uint32_t imm = (s << 20) | (j2 << 19) | (j1 << 18) | (((insn >> 16) & 0x3F) << 12) | ((insn & 0x7FF) << 1);
+      return pc + 4 + sign_extend(imm, 21);
+    }
+
+    case THUMB_B_T4: {
+      uint32_t s = (insn >> 26) & 1;
+      uint32_t i1 = ! (((insn >> 13) & 1) ^ s), i2 = ! (((insn >> 11) & 1) ^ s);
+      uint32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) | (((insn >> 16) & 0x3FF) << 12) | ((insn & 0x7FF) << 1);
+      return pc + 4 + sign_extend(imm, 25);
+    }
+
+    case THUMB_CBZ: {
+      uint32_t value = cpu->r[insn & 0x7];
+      int taken = (insn & 0x800) ? value != 0 : value == 0;
+      if (! taken) return next;
+      return pc + 4 + ((((insn >> 9) & 1) << 6) | (((insn >> 3) & 0x1F) << 1));
+    }
+
+    case THUMB_BX:
+      return REG((insn >> 3) & 0xF) & ~1;
+
+    case THUMB_MOV_PC:
+      return REG((insn >> 3) & 0xF) & ~1;
+
+    case THUMB_ADD_PC:
+      return (pc + 4 + REG((insn >> 3) & 0xF)) & ~1;
+
+    case THUMB_IT:
+      return thumb_skip(cpu, next, insn & 0xFF);
+
+    case THUMB_TB: {
+      uint32_t rn = REG((insn >> 16) & 0xF), rm = REG(insn & 0xF);
+      uint32_t offset = (insn & 0x10) ? cpu->read(rn + (rm << 1), 2) : cpu->read(rn + rm, 1);
+      return pc + 4 + (offset << 1);
+    }
+
+    case THUMB_POP:
+      addr = cpu->r[13] + 4 * __builtin_popcount(insn & 0xFF);
+      break;
+
+    case THUMB_LDR_LIT: {
+      uint32_t base = (pc + 4) & ~3;
+      addr = (insn & (1 << 23)) ? base + (insn & 0xFFF) : base - (insn & 0xFFF);
+      break;
+    }
+
+    case THUMB_LDR_IMM12:
+      addr = REG((insn >> 16) & 0xF) + (insn & 0xFFF);
+      break;
+
+    case THUMB_LDR_IMM8: {
+      uint32_t rn = REG((insn >> 16) & 0xF);
+      uint32_t offset = (insn & 0x200) ? rn + (insn & 0xFF) : rn - (insn & 0xFF);
+      addr = (insn & 0x400) ? offset : rn;
+      break;
+    }
+
+    case THUMB_LDR_REG:
+      addr = REG((insn >> 16) & 0xF) + (REG(insn & 0xF) << ((insn >> 4) & 0x3));
+      break;
+
+    case THUMB_LDM:
+      // PC is the highest register, so it is loaded last
+      addr = REG((insn >> 16) & 0xF) + 4 * (__builtin_popcount(insn & 0xFFFF) - 1);
+      break;
+
+    case THUMB_LDMDB:
+      addr = REG((insn >> 16) & 0xF) - 4;
+      break;
+
+    default:
+      return thumb_skip(cpu, next, (it & 0xF) ? thumb_itadvance(it) : 0);
+  }
+  #undef REG
+
+  // loads into PC
+  return cpu->read(addr, 4) & ~1;
+}
+
+/**
+ * @brief Whether an instruction that goes on to the next one does the
+ * same thing at another address, i.e. doesn't read PC as an operand.
+ * Used for displaced stepping; the branches in thumb_encodings[] are
+ * emulated there instead.
+ *
+ * @param h1 First halfword
+ * @param h2 Second halfword; ignored for 16-bit instructions
+ * @return int 1 = can be moved; 0 = reads PC
+ */
+int thumb_relocatable(uint16_t h1, uint16_t h2) {
+  (void)h2;
+  if (thumb_width(h1) == 2) {
+    if ((h1 & 0xF800) == 0x4800) return 0;  // ldr Rt, [pc, #imm8]
+    if ((h1 & 0xF800) == 0xA000) return 0;  // adr Rd, label
+    if ((h1 & 0xFC78) == 0x4478) return 0;  // add/cmp/mov Rd, pc
+    return 1;
+  }
+  if ((h1 & 0xF) != 0xF) return 1;          // Rn isn't pc
+  if ((h1 & 0xFA00) == 0xF000 || (h1 & 0xFE00) == 0xEA00) {
+    // data processing; Rn = pc makes orr/orn into mov/mvn
+    int op = (h1 >> 5) & 0xF;
+    return op == 2 || op == 3;
+  }
+  if ((h1 & 0xFE00) == 0xF800) return 0;    // ldr/ldrb/ldrh/ldrs*/pld literal
+  if ((h1 & 0xFE40) == 0xE840) return 0;    // ldrd literal, tbb/tbh [pc, ...]
+  if ((h1 & 0xFB5F) == 0xF20F) return 0;    // adr.w (addw/subw Rd, pc, #imm)
+  if ((h1 & 0xEE0F) == 0xEC0F) return 0;    // vldr/ldc literal
+  return 1;
+}
+
+/**
+ * @brief Memory an instruction writes, worked out from the registers.
+ * Used to keep what was there before a recorded step. Conditions are
+ * not checked, so a store that an IT block skips still reports its
+ * range.
+ *
+ * @param cpu Registers, with r[15] the address of the instruction
+ * @param addr Set to the lowest address written
+ * @return int Number of bytes written; 0 if it doesn't store
+ */
+int thumb_stores(const thumb_cpu *cpu, uint32_t *addr) {
+  const uint32_t *r = cpu->r;
+  uint32_t pc = r[15];
+  uint16_t h1 = cpu->read(pc, 2);
+
+  if (thumb_width(h1) == 2) {
+    int imm5 = (h1 >> 6) & 0x1F;
+    uint32_t rn = r[(h1 >> 3) & 7];
+    uint32_t rm = r[(h1 >> 6) & 7];
+    if ((h1 & 0xF800) == 0x6000) { *addr = rn + imm5 * 4; return 4; }  // str Rt, [Rn, #imm5]
+    if ((h1 & 0xF800) == 0x7000) { *addr = rn + imm5; return 1; }      // strb
+    if ((h1 & 0xF800) == 0x8000) { *addr = rn + imm5 * 2; return 2; }  // strh
+    if ((h1 & 0xFE00) == 0x5000) { *addr = rn + rm; return 4; }        // str Rt, [Rn, Rm]
+    if ((h1 & 0xFE00) == 0x5200) { *addr = rn + rm; return 2; }        // strh
+    if ((h1 & 0xFE00) == 0x5400) { *addr = rn + rm; return 1; }        // strb
+    if ((h1 & 0xF800) == 0x9000) { *addr = r[13] + (h1 & 0xFF) * 4; return 4; } // str Rt, [sp, #imm8]
+    if ((h1 & 0xFE00) == 0xB400) {                                     // push {..., lr}
+      int n = __builtin_popcount(h1 & 0x1FF);
+      *addr = r[13] - 4 * n;
+      return 4 * n;
+    }
+    if ((h1 & 0xF800) == 0xC000) {                                     // stmia Rn!, {...}
+      *addr = r[(h1 >> 8) & 7];
+      return 4 * __builtin_popcount(h1 & 0xFF);
+    }
+    return 0;
+  }
+
+  uint16_t h2 = cpu->read(pc + 2, 2);
+  uint32_t base = r[h1 & 0xF];
+  int imm8 = h2 & 0xFF;
+
+  if ((h1 & 0xFF90) == 0xF880) {
+    // str/strb/strh.w Rt, [Rn, #imm12]
+    *addr = base + (h2 & 0xFFF);
+    return 1 << ((h1 >> 5) & 3);
+  }
+  if ((h1 & 0xFF90) == 0xF800) {
+    int size = 1 << ((h1 >> 5) & 3);
+    if (h2 & 0x800) {
+      // [Rn, #+-imm8], [Rn, #+-imm8]! and [Rn], #+-imm8
+      uint32_t offset = (h2 & 0x200) ? base + imm8 : base - imm8;
+      *addr = (h2 & 0x400) ? offset : base;
+      return size;
+    }
+    if ((h2 & 0xFC0) == 0) {
+      // [Rn, Rm, lsl #imm2]
+      *addr = base + (r[h2 & 0xF] << ((h2 >> 4) & 3));
+      return size;
+    }
+    return 0;
+  }
+  if ((h1 & 0xFFF0) == 0xE840) { *addr = base + imm8 * 4; return 4; } // strex
+  if ((h1 & 0xFFF0) == 0xE8C0) {
+    if ((h2 & 0xF0) == 0x40) { *addr = base; return 1; }             // strexb
+    if ((h2 & 0xF0) == 0x50) { *addr = base; return 2; }             // strexh
+    return 0;
+  }
+  if ((h1 & 0xFE50) == 0xE840 && (h1 & 0x120)) {
+    // strd Rt, Rt2, [Rn, #+-imm8] (pre or post)
+    uint32_t offset = (h1 & 0x80) ? base + imm8 * 4 : base - imm8 * 4;
+    *addr = (h1 & 0x100) ? offset : base;
+    return 8;
+  }
+  if ((h1 & 0xFFD0) == 0xE880) {                                       // stm.w Rn{!}, {...}
+    *addr = base;
+    return 4 * __builtin_popcount(h2);
+  }
+  if ((h1 & 0xFFD0) == 0xE900) {                                       // stmdb/push.w
+    int n = __builtin_popcount(h2);
+    *addr = base - 4 * n;
+    return 4 * n;
+  }
+  if ((h1 & 0xFF30) == 0xED00) {                                       // vstr
+    *addr = (h1 & 0x80) ? base + imm8 * 4 : base - imm8 * 4;
+    return (h2 & 0x100) ? 8 : 4;
+  }
+  if ((h1 & 0xFE10) == 0xEC00 && (h1 & 0x180) && (h1 & 0x1A0) != 0x100) {
+    // vstm/vpush; P=0 U=0 is a 64-bit move and P=1 W=0 is vstr
+    *addr = (h1 & 0x100) ? base - imm8 * 4 : base;
+    return imm8 * 4;
+  }
+  return 0;
+}
@@ -0,0 +1,526 @@
+/**
+ * @file relocate.cpp
+ * @author Fernando Trias
+ * @brief Copy flash functions to RAM so they can take software breakpoints
+ * @version 0.1
+ * @date 2020-06-09
+ *
+ * @copyright Copyright (c) 2020 Fernando Trias
+ *
+ */
+
+/*
+ * Flash can't be patched with SVC instructions, and Teensy 4 has no FPB
+ * remapping at all. Instead, the function holding the breakpoint is
+ * copied into a RAM pool (ITCM) and calls to its entry are redirected
+ * to the copy (see reloc_redirect). The breakpoint then goes in the
+ * copy like any other RAM breakpoint.
+ *
+ * The copy keeps the original layout, including its literal pools, and
+ * the same address modulo 4, so PC-relative loads and branches inside
+ * the function need no changes. Branches and calls that leave the
+ * function are sent through veneers placed after the copy:
+ *
+ *   ldr.w pc, [pc, #0]
+ *   .word target|1
+ *
+ * Instructions that can't be fixed up this way (16-bit branches or
+ * cbz/cbnz that leave the function, literals outside it, reads of PC
+ * into a register) make relocation fail and the caller falls back to
+ * whatever it did before.
+ */
+
+#include <Arduino.h>
+
+#define GDB_DEBUG_INTERNAL
+#include "TeensyDebug.h"
+
+#if GDB_RELOC_POOL
+
+// Largest function that will be relocated
+#define RELOC_MAX_SIZE 2048
+// Number of functions that can be relocated
+#define RELOC_MAX_FUNCTIONS 16
+// Number of external branches a function may have
+#define RELOC_MAX_VENEERS 64
+// How far back from a breakpoint to look for the function entry
+#define RELOC_MAX_PROLOGUE 1024
+
+#ifdef GDB_HOST_SIM
+// the host build keeps the pool in simulated RAM
+#define reloc_pool ((uint8_t*)RAM_START + 0x40000)
+#else
+// FASTRUN puts code in ITCM on Teensy 4
+__attribute__((section(".fastrun"), aligned(8)))
+uint8_t reloc_pool[GDB_RELOC_POOL];
+#endif
+
+int reloc_pool_used = 0;
+
+reloc_function reloc_functions[RELOC_MAX_FUNCTIONS];
+int reloc_count = 0;
+
+#define HALF(a) (*(uint16_t*)(a))
+
+static inline int reloc_is32(uint16_t h1) {
+  return (h1 & 0xF800) >= 0xE800;
+}
+
+static inline int32_t sign_extend(uint32_t x, int bits) {
+  return (int32_t)(x << (32 - bits)) >> (32 - bits);
+}
+
+/**
+ * @brief What an instruction does to control flow and PC-relative data
+ */
+struct reloc_inst {
+  int width;          // 2 or 4
+  int kind;           // RELOC_*
+  int conditional;    // branch is conditional
+  uint32_t target;    // branch target or literal address
+  int size;           // bytes read from the literal
+};
+
+#define RELOC_PLAIN   0   // nothing PC-relative
+#define RELOC_BRANCH  1   // b, b<c>, cbz, cbnz (16-bit)
+#define RELOC_BRANCHW 2   // b.w, b<c>.w
+#define RELOC_CALL    3   // bl
+#define RELOC_RETURN  4   // bx, pop {pc}, ldr pc, mov pc: ends a path
+#define RELOC_LITERAL 5   // ldr/adr relative to PC
+#define RELOC_TABLE   6   // tbb/tbh [pc, ...]
+#define RELOC_BAD     7   // uses PC in a way we can't move
+
+/**
+ * @brief Decode the instruction at addr
+ */
+static void reloc_decode(uint32_t addr, reloc_inst *r) {
+  uint16_t h1 = HALF(addr);
+  uint32_t pc = addr + 4;
+  uint32_t apc = pc & ~3;
+  r->kind = RELOC_PLAIN;
+  r->conditional = 0;
+  r->target = 0;
+  r->size = 0;
+
+  if (! reloc_is32(h1)) {
+    r->width = 2;
+    if ((h1 & 0xF000) == 0xD000 && (h1 & 0x0E00) != 0x0E00) { // b<c>
+      r->kind = RELOC_BRANCH;
+      r->conditional = 1;
+      r->target = pc + sign_extend((h1 & 0xFF) << 1, 9);
+    }
+    else if ((h1 & 0xF800) == 0xE000) { // b
+      r->kind = RELOC_BRANCH;
+      r->target = pc + sign_extend((h1 & 0x7FF) << 1, 12);
+    }
+    else if ((h1 & 0xF500) == 0xB100) { // cbz, cbnz
+      r->kind = RELOC_BRANCH;
+      r->conditional = 1;
+      r->target = pc + (((h1 >> 9) & 1) << 6) + (((h1 >> 3) & 0x1F) << 1);
+    }
+    else if ((h1 & 0xFF00) == 0xBD00 || (h1 & 0xFF80) == 0x4700 || (h1 & 0xFF87) == 0x4687) {
+      r->kind = RELOC_RETURN; // pop {..pc}, bx rm, mov pc, rm
+    }
+    else if ((h1 & 0xF800) == 0x4800) { // ldr rt, [pc, #imm]
+      r->kind = RELOC_LITERAL;
+      r->target = apc + ((h1 & 0xFF) << 2);
+      r->size = 4;
+    }
+    else if ((h1 & 0xF800) == 0xA000) { // adr rd, label
+      r->kind = RELOC_LITERAL;
+      r->target = apc + ((h1 & 0xFF) << 2);
+    }
+    else if ((h1 & 0xFF78) == 0x4478 || (h1 & 0xFF78) == 0x4678) {
+      r->kind = RELOC_BAD; // add rd, pc / mov rd, pc
+    }
+    return;
+  }
+
+  uint16_t h2 = HALF(addr + 2);
+  r->width = 4;
+  if ((h1 & 0xF800) == 0xF000 && (h2 & 0x8000)) {
+    uint32_t s = (h1 >> 10) & 1;
+    uint32_t j1 = (h2 >> 13) & 1;
+    uint32_t j2 = (h2 >> 11) & 1;
+    if ((h2 & 0x5000) == 0x0000) { // b<c>.w
+      if (((h1 >> 6) & 0xE) == 0xE) return; // not a branch
+      r->kind = RELOC_BRANCHW;
+      r->conditional = 1;
+      uint32_t imm = (s << 20) | (j2 << 19) | (j1 << 18) | ((h1 & 0x3F) << 12) | ((h2 & 0x7FF) << 1);
+      r->target = pc + sign_extend(imm, 21);
+    }
+    else {  // b.w or bl
+      uint32_t i1 = ! (j1 ^ s);
+      uint32_t i2 = ! (j2 ^ s);
+      uint32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) | ((h1 & 0x3FF) << 12) | ((h2 & 0x7FF) << 1);
+      r->kind = (h2 & 0x4000) ? RELOC_CALL : RELOC_BRANCHW;
+      r->target = pc + sign_extend(imm, 25);
+    }
+  }
+  else if (h1 == 0xE8BD && (h2 & 0x8000)) { // pop.w {..pc}
+    r->kind = RELOC_RETURN;
+  }
+  else if ((h1 & 0xFFF0) == 0xF850 && (h2 & 0xF000) == 0xF000 && (h1 & 0xF) != 0xF) {
+    r->kind = RELOC_RETURN; // ldr.w pc, [rn, ...]
+  }
+  else if ((h1 & 0xFFF0) == 0xF8D0 && (h2 & 0xF000) == 0xF000) {
+    r->kind = RELOC_RETURN; // ldr.w pc, [rn, #imm12]
+  }
+  else if ((h1 & 0xFFF0) == 0xE8D0 && (h2 & 0xFFE0) == 0xF000) { // tbb, tbh
+    r->kind = (h1 & 0xF) == 0xF ? RELOC_TABLE : RELOC_RETURN;
+    r->size = (h2 & 0x10) ? 2 : 1;
+  }
+  else if ((h1 & 0xFE1F) == 0xF81F) { // ldr{b,h,sb,sh}.w / pld literal
+    uint32_t imm = h2 & 0xFFF;
+    r->kind = RELOC_LITERAL;
+    r->target = (h1 & 0x80) ? apc + imm : apc - imm;
+    r->size = ((h1 >> 5) & 3) == 2 ? 4 : ((h1 >> 5) & 3) == 1 ? 2 : 1;
+    if ((h2 & 0xF000) == 0xF000 && ((h1 >> 5) & 3) == 2) r->kind = RELOC_RETURN; // ldr pc, =x
+  }
+  else if ((h1 & 0xFE5F) == 0xE85F) { // ldrd literal
+    uint32_t imm = (h2 & 0xFF) << 2;
+    r->kind = RELOC_LITERAL;
+    r->target = (h1 & 0x80) ? apc + imm : apc - imm;
+    r->size = 8;
+  }
+  else if ((h1 & 0xFF3F) == 0xED1F) { // vldr literal
+    uint32_t imm = (h2 & 0xFF) << 2;
+    r->kind = RELOC_LITERAL;
+    r->target = (h1 & 0x80) ? apc + imm : apc - imm;
+    r->size = (h2 & 0x100) ? 8 : 4;
+  }
+  else if ((h1 & 0xFBFF) == 0xF20F || (h1 & 0xFBFF) == 0xF2AF) { // adr.w
+    uint32_t imm = (((h1 >> 10) & 1) << 11) | (((h2 >> 12) & 7) << 8) | (h2 & 0xFF);
+    r->kind = RELOC_LITERAL;
+    r->target = (h1 & 0x00A0) ? apc - imm : apc + imm;
+  }
+}
+
+// Literal pools and branch tables found by reloc_extent()
+#define RELOC_MAX_DATA 16
+uint32_t reloc_data_lo[RELOC_MAX_DATA];
+uint32_t reloc_data_hi[RELOC_MAX_DATA];
+int reloc_data_count;
+
+// note that lo..hi holds data; returns -1 if there are too many ranges
+static int reloc_addData(uint32_t lo, uint32_t hi) {
+  for (int i = 0; i < reloc_data_count; i++) {
+    // merge with ranges that touch, allowing for alignment padding
+    if (lo <= reloc_data_hi[i] + 2 && hi + 2 >= reloc_data_lo[i]) {
+      if (lo < reloc_data_lo[i]) reloc_data_lo[i] = lo;
+      if (hi > reloc_data_hi[i]) reloc_data_hi[i] = hi;
+      return 0;
+    }
+  }
+  if (reloc_data_count >= RELOC_MAX_DATA) return -1;
+  reloc_data_lo[reloc_data_count] = lo;
+  reloc_data_hi[reloc_data_count] = hi;
+  reloc_data_count++;
+  return 0;
+}
+
+// if pc is in data, return the end of it
+static uint32_t reloc_skipData(uint32_t pc) {
+  for (int i = 0; i < reloc_data_count; i++) {
+    if (pc >= reloc_data_lo[i] && pc < reloc_data_hi[i]) {
+      pc = reloc_data_hi[i];
+      i = -1; // ranges may follow each other
+    }
+  }
+  return pc;
+}
+
+// does a branch from pc to target jump over data that starts right after pc?
+static int reloc_skipsData(uint32_t next, uint32_t target) {
+  for (int i = 0; i < reloc_data_count; i++) {
+    if (reloc_data_lo[i] <= next + 2 && target >= reloc_data_hi[i] && target <= reloc_data_hi[i] + 2) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Find the end of the function that starts at start: follow the
+ * code until a return or unconditional branch that no earlier branch
+ * jumps past, skipping literal pools and branch tables, and include the
+ * pools it uses. Leaves the data ranges in reloc_data_*.
+ *
+ * @param start Entry of the function
+ * @param veneers Set to the number of external branches
+ * @return uint32_t End address, or 0 if the function can't be moved
+ */
+static uint32_t reloc_extent(uint32_t start, int *veneers) {
+  uint32_t limit = start + RELOC_MAX_SIZE;
+  uint32_t reach = start;     // furthest internal branch target seen
+  uint32_t pc = start;
+  reloc_inst r;
+
+  reloc_data_count = 0;
+  while (1) {
+    pc = reloc_skipData(pc);
+    if (pc >= limit) return 0;
+    reloc_decode(pc, &r);
+    uint32_t next = pc + r.width;
+    switch(r.kind) {
+      case RELOC_BAD:
+        return 0;
+      case RELOC_LITERAL:
+        if (r.size && r.target >= next && r.target < limit) {
+          if (reloc_addData(r.target, r.target + r.size)) return 0;
+        }
+        break;
+      case RELOC_TABLE: {
+        // the table follows the instruction; the lowest case ends it
+        uint32_t table_end = limit;
+        for (uint32_t i = next; i < table_end; i += r.size) {
+          uint32_t off = r.size == 1 ? *(uint8_t*)i : HALF(i);
+          uint32_t t = next + off * 2;
+          if (t < table_end && t >= i + r.size) table_end = t;
+          if (t > reach) reach = t;
+        }
+        if (reloc_addData(next, table_end)) return 0;
+        break;
+      }
+      case RELOC_BRANCH:
+      case RELOC_BRANCHW:
+        // forward branches stay inside if conditional, or if they skip
+        // a literal pool; other unconditional ones may be tail calls
+        if (r.target > pc && r.target < limit &&
+            (r.conditional || reloc_skipsData(next, r.target))) {
+          if (r.target > reach) reach = r.target;
+        }
+        if (! r.conditional && next > reach) {
+          pc = next;
+          goto done;
+        }
+        break;
+      case RELOC_RETURN:
+        if (next > reach) {
+          pc = next;
+          goto done;
+        }
+        break;
+    }
+    pc = next;
+  }
+
+done:
+  // include the pools that follow the code, allowing for alignment padding
+  uint32_t end = pc;
+  for (int grown = 1; grown; ) {
+    grown = 0;
+    for (int i = 0; i < reloc_data_count; i++) {
+      if (reloc_data_lo[i] <= end + 2 && reloc_data_hi[i] > end) {
+        end = reloc_data_hi[i];
+        grown = 1;
+      }
+    }
+  }
+
+  // check every instruction again now the extent is known
+  *veneers = 0;
+  for (pc = reloc_skipData(start); pc < end; pc = reloc_skipData(pc + r.width)) {
+    reloc_decode(pc, &r);
+    int inside = r.target >= start && r.target + r.size <= end;
+    if (r.kind == RELOC_LITERAL || r.kind == RELOC_BRANCH) {
+      if (! inside) return 0;
+    }
+    else if (r.kind == RELOC_BRANCHW || r.kind == RELOC_CALL) {
+      if (! inside) (*veneers)++;
+    }
+  }
+  return end;
+}
+
+/**
+ * @brief Encode a b.w/b<c>.w/bl at addr to target, keeping the kind
+ */
+static void reloc_branch(uint32_t addr, uint32_t target) {
+  uint16_t h1 = HALF(addr);
+  uint16_t h2 = HALF(addr + 2);
+  int32_t off = target - (addr + 4);
+  uint32_t s = off < 0;
+  if ((h2 & 0x5000) == 0x0000) { // b<c>.w
+    uint32_t j1 = (off >> 18) & 1;
+    uint32_t j2 = (off >> 19) & 1;
+    h1 = (h1 & 0xFBC0) | (s << 10) | ((off >> 12) & 0x3F);
+    h2 = (h2 & 0xD000) | (j1 << 13) | (j2 << 11) | ((off >> 1) & 0x7FF);
+  }
+  else {
+    uint32_t j1 = ! (((off >> 23) & 1) ^ s);
+    uint32_t j2 = ! (((off >> 22) & 1) ^ s);
+    h1 = (h1 & 0xF800) | (s << 10) | ((off >> 12) & 0x3FF);
+    h2 = (h2 & 0xD000) | (j1 << 13) | (j2 << 11) | ((off >> 1) & 0x7FF);
+  }
+  HALF(addr) = h1;
+  HALF(addr + 2) = h2;
+}
+
+/**
+ * @brief Look backwards from addr for a push of LR that starts a
+ * function containing addr.
+ */
+static uint32_t reloc_findEntry(uint32_t addr, uint32_t *end, int *veneers) {
+  for (uint32_t p = addr; p + RELOC_MAX_PROLOGUE >= addr && p >= (uint32_t)(uintptr_t)FLASH_START; p -= 2) {
+    uint16_t h1 = HALF(p);
+    int prologue = (h1 & 0xFF00) == 0xB500 ||                  // push {..lr}
+      (h1 == 0xE92D && (HALF(p + 2) & 0x4000));                // stmdb sp!, {..lr}
+    if (prologue) {
+      *end = reloc_extent(p, veneers);
+      if (*end > addr) return p;
+    }
+    if (p == 0) break;
+  }
+  return 0;
+}
+
+/**
+ * @brief Index of the relocated function whose original code holds addr
+ *
+ * @param addr Address in flash
+ * @return int Index or -1
+ */
+int reloc_find(uint32_t addr) {
+  for (int i = 0; i < reloc_count; i++) {
+    if (addr >= reloc_functions[i].start && addr < reloc_functions[i].end) return i;
+  }
+  return -1;
+}
+
+/**
+ * @brief Index of the relocated function whose copy holds addr
+ *
+ * @param addr Address in the pool
+ * @return int Index or -1
+ */
+int reloc_findCopy(uint32_t addr) {
+  for (int i = 0; i < reloc_count; i++) {
+    reloc_function *f = &reloc_functions[i];
+    if (addr >= f->copy && addr < f->copy + (f->end - f->start)) return i;
+  }
+  return -1;
+}
+
+/**
+ * @brief Map an address in relocated flash code to its copy; other
+ * addresses are returned unchanged. The Thumb bit is kept.
+ */
+uint32_t reloc_toCopy(uint32_t addr) {
+  int i = reloc_find(addr & ~1);
+  if (i < 0) return addr;
+  return addr - reloc_functions[i].start + reloc_functions[i].copy;
+}
+
+/**
+ * @brief Map an address in a copy back to the original flash code so
+ * GDB sees addresses that match the symbols.
+ */
+uint32_t reloc_toOriginal(uint32_t addr) {
+  int i = reloc_findCopy(addr & ~1);
+  if (i < 0) return addr;
+  return addr - reloc_functions[i].copy + reloc_functions[i].start;
+}
+
+/**
+ * @brief Copy the function containing addr into the pool, if it isn't
+ * already. The entry is not redirected here.
+ *
+ * @param addr Address in flash, e.g. of a breakpoint
+ * @return int Index in reloc_functions or -1 if it can't be relocated
+ */
+int reloc_create(uint32_t addr) {
+  addr &= ~1;
+  int n = reloc_find(addr);
+  if (n >= 0) return n;
+  if (reloc_count >= RELOC_MAX_FUNCTIONS) return -1;
+
+  uint32_t end;
+  int veneers;
+  uint32_t start = reloc_findEntry(addr, &end, &veneers);
+  if (start == 0 || veneers > RELOC_MAX_VENEERS) return -1;
+
+  // keep the address modulo 4 so literal offsets stay the same
+  uint32_t size = end - start;
+  uint32_t pool = (uint32_t)(uintptr_t)reloc_pool;
+  uint32_t copy = (pool + reloc_pool_used + 3) & ~3;
+  copy += start & 3;
+  uint32_t veneer = (copy + size + 3) & ~3;
+  uint32_t top = veneer + veneers * 8;
+  if (top > pool + GDB_RELOC_POOL) return -1;
+
+  memcpy((void*)copy, (void*)start, size);
+
+  // reloc_findEntry() left the data ranges of this function
+  reloc_inst r;
+  for (uint32_t pc = reloc_skipData(start); pc < end; pc = reloc_skipData(pc + r.width)) {
+    reloc_decode(pc, &r);
+    if ((r.kind == RELOC_BRANCHW || r.kind == RELOC_CALL) && (r.target < start || r.target >= end)) {
+      uint16_t *v = (uint16_t*)veneer;
+      v[0] = 0xF8DF; // ldr.w pc, [pc, #0]
+      v[1] = 0xF000;
+      *(uint32_t*)(veneer + 4) = r.target | 1;
+      reloc_branch(pc - start + copy, veneer);
+      veneer += 8;
+    }
+  }
+
+  // make the new code visible to instruction fetch
+  debug_syncCode((void*)copy, top - copy);
+
+  reloc_pool_used = top - pool;
+  reloc_function *f = &reloc_functions[reloc_count];
+  f->start = start;
+  f->end = end;
+  f->copy = copy;
+  f->breakpoints = 0;
+  return reloc_count++;
+}
+
+/*
+ * Entry redirect. An FPB comparator on the original entry raises the
+ * DebugMonitor exception, and TeensyDebug.cpp moves the stacked PC to
+ * the copy, so every call to the function runs the copy. Calls already
+ * in progress finish in flash.
+ */
+
+#ifdef GDB_HOST_SIM
+
+// the simulator never executes flash code, so there is nothing to redirect
+int reloc_init() { return 0; }
+int reloc_redirect(int n, int on) { return 0; }
+
+#else
+
+/**
+ * @brief Check that calls can be redirected
+ *
+ * @return int 0 if success; -1 if the DebugMonitor isn't available
+ */
+int reloc_init() {
+  return debugmon_enabled ? 0 : -1;
+}
+
+/**
+ * @brief Start or stop sending calls of a relocated function to its copy.
+ * Calls from code that DebugMonitor can't preempt are sent there by the
+ * HardFault handler (debugmon_escalated() in TeensyDebug.cpp).
+ *
+ * @param n Index in reloc_functions
+ * @param on 1 to redirect; 0 to run the original again
+ * @return int 0 if success; -1 if no comparator is free
+ */
+int reloc_redirect(int n, int on) {
+  uint32_t start = reloc_functions[n].start;
+  int c = fpb_find(start, FPB_REDIRECT);
+  if (on) {
+    if (c >= 0) return 0;
+    return fpb_set(start, FPB_REDIRECT) < 0 ? -1 : 0;
+  }
+  if (c >= 0) fpb_clear(c);
+  return 0;
+}
+
+#endif // GDB_HOST_SIM
+
+#endif // GDB_RELOC_POOL